@@ -0,0 +1,246 @@
+/******************************************************************************
+* Copyright (C) 2014, Kevin Martin (kev82@khn.org.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+/*
+ * A lua interpreter for the benchmark scripts. On top of the standard
+ * libraries it provides a bench table with
+ *
+ * bench.now() - monotonic time in seconds
+ * bench.allocs() - number of malloc/calloc/realloc calls made so far
+ *  by anything in the process, luadeploy.so and sqlite included
+ * bench.parallel(n, code, ...) - runs the lua source code on n threads at
+ *  once, each in its own lua state with these same libraries. The code
+ *  gets the thread's number, from 1, followed by the extra arguments as
+ *  strings. Returns a list of what each thread returned, which may be a
+ *  table of numbers, strings and booleans but not a nested table.
+ *
+ * usage: benchhost script.lua [args...]
+ */
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+extern void *__libc_malloc(size_t bytes);
+extern void *__libc_calloc(size_t n, size_t bytes);
+extern void *__libc_realloc(void *p, size_t bytes);
+extern void __libc_free(void *p);
+
+static long long bench_allocations = 0;
+
+void *malloc(size_t bytes) {
+	__atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(bytes);
+}
+
+void *calloc(size_t n, size_t bytes) {
+	__atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(n, bytes);
+}
+
+void *realloc(void *p, size_t bytes) {
+	__atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(p, bytes);
+}
+
+void free(void *p) {
+	__libc_free(p);
+}
+
+static int bench_now(lua_State *l) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	lua_pushnumber(l, ts.tv_sec + ts.tv_nsec / 1e9);
+	return 1;
+}
+
+static int bench_allocs(lua_State *l) {
+	lua_pushnumber(l, __atomic_load_n(&bench_allocations, __ATOMIC_RELAXED));
+	return 1;
+}
+
+static int bench_parallel(lua_State *l);
+
+static const luaL_Reg bench_funcs[] = {
+ {"now", bench_now},
+ {"allocs", bench_allocs},
+ {"parallel", bench_parallel},
+ {NULL, NULL}
+};
+
+static lua_State *bench_newstate() {
+	lua_State *l = luaL_newstate();
+	luaL_openlibs(l);
+
+	luaL_newlib(l, bench_funcs);
+	lua_setglobal(l, "bench");
+	return l;
+}
+
+struct bench_thread
+{
+	pthread_t thread;
+	lua_State *l;	//the code and its arguments, then its result
+	int nargs;
+	int ok;
+};
+
+static void *bench_threadmain(void *p) {
+	struct bench_thread *t = (struct bench_thread *)p;
+	t->ok = lua_pcall(t->l, t->nargs, 1, 0) == LUA_OK;
+	return NULL;
+}
+
+//Copies a value that isn't a table between states
+static void bench_copyvalue(lua_State *from, int idx, lua_State *to) {
+	switch(lua_type(from, idx)) {
+	case LUA_TNUMBER:
+		lua_pushnumber(to, lua_tonumber(from, idx));
+		break;
+	case LUA_TBOOLEAN:
+		lua_pushboolean(to, lua_toboolean(from, idx));
+		break;
+	case LUA_TSTRING: {
+		size_t bytes;
+		const char *s = lua_tolstring(from, idx, &bytes);
+		lua_pushlstring(to, s, bytes);
+		break;
+	}
+	default:
+		lua_pushnil(to);
+	}
+}
+
+//The threads have all been joined, so their states can be read here
+static int bench_parallel(lua_State *l) {
+	int n = luaL_checkint(l, 1);
+	luaL_argcheck(l, n >= 1, 1, "need at least one thread");
+	size_t codebytes;
+	const char *code = luaL_checklstring(l, 2, &codebytes);
+	int nargs = lua_gettop(l) - 2;
+
+	struct bench_thread *threads = (struct bench_thread *)
+	 lua_newuserdata(l, n * sizeof(struct bench_thread));
+	memset(threads, 0, n * sizeof(struct bench_thread));
+
+	int i, j;
+	for(i=0;i<n;++i) {
+		lua_State *tl = bench_newstate();
+		threads[i].l = tl;
+		if(luaL_loadbufferx(tl, code, codebytes, "parallel", "t") != LUA_OK) {
+			lua_pushstring(l, lua_tostring(tl, -1));
+			for(j=0;j<=i;++j) lua_close(threads[j].l);
+			return lua_error(l);
+		}
+
+		lua_pushinteger(tl, i+1);
+		for(j=0;j<nargs;++j) {
+			lua_pushstring(tl, luaL_checkstring(l, 3+j));
+		}
+		threads[i].nargs = nargs+1;
+	}
+
+	for(i=0;i<n;++i) {
+		if(pthread_create(&threads[i].thread, NULL, bench_threadmain,
+		 &threads[i]) != 0) {
+			fprintf(stderr, "unable to start thread %d\n", i+1);
+			exit(1);
+		}
+	}
+
+	int failed = -1;
+	lua_createtable(l, n, 0);
+	for(i=0;i<n;++i) {
+		pthread_join(threads[i].thread, NULL);
+		lua_State *tl = threads[i].l;
+
+		if(!threads[i].ok) {
+			if(failed == -1) failed = i;
+			continue;
+		}
+
+		if(lua_type(tl, -1) == LUA_TTABLE) {
+			lua_newtable(l);
+			lua_pushnil(tl);
+			while(lua_next(tl, -2) != 0) {
+				bench_copyvalue(tl, -2, l);
+				bench_copyvalue(tl, -1, l);
+				lua_rawset(l, -3);
+				lua_pop(tl, 1);
+			}
+		} else {
+			bench_copyvalue(tl, -1, l);
+		}
+		lua_rawseti(l, -2, i+1);
+	}
+
+	if(failed != -1) {
+		lua_pushfstring(l, "thread %d: %s", failed+1,
+		 lua_tostring(threads[failed].l, -1));
+	}
+	for(i=0;i<n;++i) lua_close(threads[i].l);
+	if(failed != -1) return lua_error(l);
+
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	if(argc < 2) {
+		fprintf(stderr, "usage: %s script.lua [args...]\n", argv[0]);
+		return 1;
+	}
+
+	lua_State *l = bench_newstate();
+
+	lua_newtable(l);
+	int i;
+	for(i=0;i<argc;++i) {
+		lua_pushstring(l, argv[i]);
+		lua_rawseti(l, -2, i-1);
+	}
+	lua_setglobal(l, "arg");
+
+	if(luaL_loadfilex(l, argv[1], "t") != LUA_OK) {
+		fprintf(stderr, "%s\n", lua_tostring(l, -1));
+		lua_close(l);
+		return 1;
+	}
+
+	for(i=2;i<argc;++i) {
+		lua_pushstring(l, argv[i]);
+	}
+
+	if(lua_pcall(l, argc-2, 0, 0) != LUA_OK) {
+		fprintf(stderr, "%s\n", lua_tostring(l, -1));
+		lua_close(l);
+		return 1;
+	}
+
+	lua_close(l);
+	return 0;
+}
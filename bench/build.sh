@@ -0,0 +1,32 @@
+#!/bin/sh
+
+if [ "$1" = "" ]; then
+	cmd="build"
+else
+	cmd="$1"
+fi
+
+case "$cmd" in
+
+build) rm -f benchhost benchso.so
+	gcc -Wall -O2 -o benchhost benchhost.c \
+	 -I/usr/include/lua5.2 -llua5.2 -lpthread
+	gcc -Wall -O2 -fPIC -shared -o benchso.so benchso.c \
+	 -I/usr/include/lua5.2
+	;;
+
+#needs ../sqlext/ldext_fPIC.a, see ../sqlext/build.sh buildfpica
+sqlbench) rm -f sqlbench
+	gcc -Wall -O2 -o sqlbench sqlbench.c ../sqlext/ldext_fPIC.a \
+	 -I/usr/include/lua5.2 -llua5.2 -lsqlite3 -lcrypto -ldl
+	;;
+
+#luadeploy.so is expected in the repository root, see ../build.sh
+run) shift
+	LUA_CPATH="../?.so;;" ./benchhost "$@"
+	;;
+
+clean) rm -f benchhost benchso.so sqlbench
+	;;
+
+esac
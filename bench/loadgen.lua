@@ -0,0 +1,221 @@
+--[[
+Drives a server from several client threads at once and reports
+throughput, and latency percentiles in microseconds.
+
+usage: ./build.sh run loadgen.lua [option=value ...]
+
+ modules=1000     lua modules in the database
+ regexes=2000     manifest regexes, each pointing at one of the modules
+ sos=10           copies of benchso.so, each its own shared object
+ bytes=1024       size of each lua module's bytecode, roughly
+ threads=4        client threads, each with its own newState
+ requests=10000   requests per thread, after the warm up
+ warmup=1000      requests per thread before timing starts
+ workers=1        server worker threads
+ transport=inproc inproc or mqueue
+ sopath=memfd     where the server puts shared objects
+ mix=lua:90,so:5,miss:5
+                  relative weights of lua module hits, shared object
+                  hits and names that don't exist
+ json=loadgen.json
+                  where to write the results as JSON
+
+Each request is a pushSearch on the thread's state followed by running
+what was found, which is how a launcher loads its modules. benchso.so is
+built by ./build.sh.
+--]]
+local luadeploy = require "luadeploy"
+
+local opts = {
+ modules = 1000, regexes = 2000, sos = 10, bytes = 1024,
+ threads = 4, requests = 10000, warmup = 1000, workers = 1,
+ transport = "inproc", sopath = "memfd", mix = "lua:90,so:5,miss:5",
+ json = "loadgen.json",
+}
+for _, a in ipairs(arg) do
+	local k, v = a:match("^(%w+)=(.*)$")
+	if k == nil or opts[k] == nil then
+		error("unknown option " .. a)
+	end
+	opts[k] = type(opts[k]) == "number" and assert(tonumber(v)) or v
+end
+
+local kinds = {"lua", "so", "miss"}
+local weights = {}
+for _, kind in ipairs(kinds) do
+	weights[kind] = tonumber(opts.mix:match(kind .. ":(%d+)")) or 0
+end
+if opts.sos == 0 then weights.so = 0 end
+
+local function hex(s)
+	return (s:gsub(".", function(c) return string.format("%02X", c:byte()) end))
+end
+
+--the synthetic database
+local sql = {
+ "create table bench_obj(loader text, objref text, obj blob, exports text);",
+ "create table bench_manifest(type text, regex text, priority int," ..
+  " entrypoint text, objref text, loader text);",
+}
+local pad = string.rep("x", opts.bytes)
+for i=1,opts.modules do
+	local code = string.dump(load(string.format(
+	 "local pad = %q return %d", pad, i)))
+	sql[#sql+1] = string.format(
+	 "insert into bench_obj values('lua', 'obj%d', X'%s', null);",
+	 i, hex(code))
+end
+for i=1,opts.regexes do
+	sql[#sql+1] = string.format(
+	 "insert into bench_manifest values" ..
+	 "('module', '^mod%d(\\.(.*))?$', %d, null, 'obj%d', 'lua');",
+	 i, i % 7, (i-1) % opts.modules + 1)
+end
+if opts.sos ~= 0 then
+	local f = assert(io.open("benchso.so", "rb"))
+	local so = hex(f:read("*a"))
+	f:close()
+	for i=1,opts.sos do
+		sql[#sql+1] = string.format(
+		 "insert into bench_obj values('so', 'so%d', X'%s', null);", i, so)
+		sql[#sql+1] = string.format(
+		 "insert into bench_manifest values" ..
+		 "('module', '^so%d$', 1, 'luaopen_benchso', 'so%d', 'so');", i, i)
+	end
+end
+
+local db = luadeploy.openSQLString(table.concat(sql, "\n"))
+local server = luadeploy.startServer("loadgen", "bench", db, opts.sopath,
+ opts.workers, opts.transport)
+
+--Runs on every client thread. Returns the time and the process's
+--allocation count when it started and finished timing, and for each
+--request the kind, as an index into kinds, then its latency.
+local client = [[
+local index, sname, regexes, sos, weights, requests, warmup = ...
+local luadeploy = require "luadeploy"
+
+local st = luadeploy.newState({"base", "package", "ldclient"})
+math.randomseed(index)
+
+local lua, so, miss = weights:match("(%d+),(%d+),(%d+)")
+lua, so, miss = tonumber(lua), tonumber(so), tonumber(miss)
+regexes, sos = tonumber(regexes), tonumber(sos)
+
+local function request()
+	local r = math.random() * (lua + so + miss)
+	local kind, name
+	if r < lua then
+		kind, name = 1, "mod" .. math.random(regexes)
+	elseif r < lua + so then
+		kind, name = 2, "so" .. math.random(sos)
+	else
+		kind, name = 3, "nomod" .. math.random(regexes)
+	end
+
+	local start = bench.now()
+	if pcall(st.pushSearch, st, sname, "module", name) then
+		st:run(0)
+	end
+	return kind, bench.now() - start
+end
+
+for i=1,tonumber(warmup) do
+	request()
+end
+
+local results = {}
+results.allocsstarted = bench.allocs()
+results.started = bench.now()
+for i=1,tonumber(requests) do
+	results[2*i-1], results[2*i] = request()
+end
+results.finished = bench.now()
+results.allocsfinished = bench.allocs()
+return results
+]]
+
+local threads = bench.parallel(opts.threads, client, "loadgen",
+ opts.regexes, opts.sos,
+ string.format("%d,%d,%d", weights.lua, weights.so, weights.miss),
+ opts.requests, opts.warmup)
+
+local latencies = {all = {}}
+for _, kind in ipairs(kinds) do latencies[kind] = {} end
+--the allocation count is process wide, so is taken over the same span
+--as the throughput, leaving out each thread's setup and warm up
+local started, finished = math.huge, 0
+local allocsstarted, allocsfinished = math.huge, 0
+for _, t in ipairs(threads) do
+	started = math.min(started, t.started)
+	finished = math.max(finished, t.finished)
+	allocsstarted = math.min(allocsstarted, t.allocsstarted)
+	allocsfinished = math.max(allocsfinished, t.allocsfinished)
+	for i=1,#t,2 do
+		local l = latencies[kinds[t[i]]]
+		l[#l+1] = t[i+1]
+		latencies.all[#latencies.all+1] = t[i+1]
+	end
+end
+
+local function summarise(l)
+	table.sort(l)
+	local function pct(p)
+		return #l == 0 and 0 or 1e6 * l[math.max(1, math.ceil(#l * p / 100))]
+	end
+	return {
+	 count = #l, p50 = pct(50), p90 = pct(90), p99 = pct(99), max = pct(100)
+	}
+end
+
+local results = {
+ throughput = #latencies.all / (finished - started),
+ allocs = (allocsfinished - allocsstarted) / (opts.threads * opts.requests),
+}
+for kind, l in pairs(latencies) do
+	results[kind] = summarise(l)
+end
+
+print(string.format("%d threads, %d workers, %s: %.0f requests/s, " ..
+ "%.1f allocs/request", opts.threads, opts.workers, opts.transport,
+ results.throughput, results.allocs))
+for _, kind in ipairs({"all", "lua", "so", "miss"}) do
+	local r = results[kind]
+	if r.count ~= 0 then
+		print(string.format(
+		 "%s: %d requests, p50 %.2f us, p90 %.2f us, p99 %.2f us, max %.2f us",
+		 kind, r.count, r.p50, r.p90, r.p99, r.max))
+	end
+end
+
+--flat enough to write by hand
+local function json(v)
+	if type(v) == "table" then
+		local keys = {}
+		for k in pairs(v) do keys[#keys+1] = k end
+		table.sort(keys)
+		local fields = {}
+		for _, k in ipairs(keys) do
+			fields[#fields+1] = string.format("%q:%s", k, json(v[k]))
+		end
+		return "{" .. table.concat(fields, ",") .. "}"
+	elseif type(v) == "number" then
+		return string.format("%.17g", v)
+	end
+	return string.format("%q", v)
+end
+
+local stats = server:stats()
+local f = assert(io.open(opts.json, "w"))
+f:write(json({
+ options = opts,
+ results = results,
+ server = {
+  cachehits = stats.cachehits,
+  cachemisses = stats.cachemisses,
+  sharedobjs = stats.sharedobjs,
+ },
+}), "\n")
+f:close()
+
+server:stop()
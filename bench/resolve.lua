@@ -0,0 +1,89 @@
+--[[
+Times module resolution through the server, one request at a time.
+
+usage: ./build.sh run resolve.lua [modules] [requests]
+
+Builds an in memory database with the given number of lua modules,
+each with its own manifest regex, then resolves random modules and
+names that don't exist. Reports the time and number of allocations
+per request for hits and for misses, and for hits sent in batches.
+--]]
+local luadeploy = require "luadeploy"
+
+local nmodules = tonumber(arg[1]) or 1000
+local nrequests = tonumber(arg[2]) or 20000
+
+local function hex(s)
+	return (s:gsub(".", function(c) return string.format("%02X", c:byte()) end))
+end
+
+local sql = {
+ "create table bench_obj(loader text, objref text, obj blob, exports text);",
+ "create table bench_manifest(type text, regex text, priority int," ..
+  " entrypoint text, objref text, loader text);",
+}
+for i=1,nmodules do
+	local code = string.dump(load(string.format("return %d", i)))
+	sql[#sql+1] = string.format(
+	 "insert into bench_obj values('lua', 'obj%d', X'%s', null);",
+	 i, hex(code))
+	sql[#sql+1] = string.format(
+	 "insert into bench_manifest values" ..
+	 "('module', '^mod%d(\\.(.*))?$', %d, null, 'obj%d', 'lua');",
+	 i, i % 7, i)
+end
+
+local db = luadeploy.openSQLString(table.concat(sql, "\n"))
+local server = luadeploy.startServer("bench", "bench", db, "/nonexistent")
+local search = luadeploy.newSearcher("bench", "module")
+
+local function run(label, makename)
+	--warm up so compiled manifests and prepared statements exist
+	for i=1,100 do
+		pcall(search, makename(i))
+	end
+
+	collectgarbage()
+	local allocs = bench.allocs()
+	local start = bench.now()
+	for i=1,nrequests do
+		pcall(search, makename(i))
+	end
+	local elapsed = bench.now() - start
+	allocs = bench.allocs() - allocs
+
+	print(string.format("%s: %d requests, %.2f us/request, %.1f allocs/request",
+	 label, nrequests, 1e6 * elapsed / nrequests, allocs / nrequests))
+end
+
+math.randomseed(1)
+run("hit", function() return "mod" .. math.random(nmodules) end)
+run("miss", function() return "nomod" .. math.random(nmodules) end)
+
+--the same hits again, sent 100 names to a round trip
+do
+	local batchsize = 100
+	local names = {}
+	for i=1,batchsize do
+		names[i] = "mod" .. math.random(nmodules)
+	end
+
+	collectgarbage()
+	local allocs = bench.allocs()
+	local start = bench.now()
+	for i=1,nrequests/batchsize do
+		luadeploy.sendRequests("bench", "module", names)
+	end
+	local elapsed = bench.now() - start
+	allocs = bench.allocs() - allocs
+
+	print(string.format(
+	 "batched hit: %d requests, %.2f us/request, %.1f allocs/request",
+	 nrequests, 1e6 * elapsed / nrequests, allocs / nrequests))
+end
+
+local stats = server:stats()
+print(string.format("cache: %d hits, %d misses, %d evictions",
+ stats.cachehits, stats.cachemisses, stats.cacheevictions))
+
+server:stop()
@@ -0,0 +1,468 @@
+/******************************************************************************
+* Copyright (C) 2014, Kevin Martin (kev82@khn.org.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+/*
+ * Times each SQL function and virtual table sqlext registers, over
+ * generated inputs, and reports nanoseconds and allocations per call.
+ * Allocations are counted the same way benchhost counts them.
+ *
+ * usage: sqlbench [-t seconds] [baseline]
+ *
+ * Prints a tab separated line per case: name, ns/op and allocs/op.
+ * Save the output from one build and pass it as the baseline when
+ * running another, and each line gets the change from the baseline.
+ * Every case runs for at least -t seconds, 0.2 by default.
+ */
+
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+int ldext_init(
+ sqlite3 *db,
+ const char **errmsg,
+ const void *api);
+
+extern void *__libc_malloc(size_t bytes);
+extern void *__libc_calloc(size_t n, size_t bytes);
+extern void *__libc_realloc(void *p, size_t bytes);
+extern void __libc_free(void *p);
+
+static long long bench_allocations = 0;
+
+void *malloc(size_t bytes) {
+	__atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(bytes);
+}
+
+void *calloc(size_t n, size_t bytes) {
+	__atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(n, bytes);
+}
+
+void *realloc(void *p, size_t bytes) {
+	__atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(p, bytes);
+}
+
+void free(void *p) {
+	__libc_free(p);
+}
+
+static double bench_mintime = 0.2;
+static char bench_dir[] = "/tmp/sqlbench.XXXXXX";
+
+//name, ns/op and allocs/op from the baseline file
+struct bench_result
+{
+	char name[64];
+	double ns;
+	double allocs;
+};
+
+static struct bench_result *bench_baseline = NULL;
+static int bench_nbaseline = 0;
+
+static double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_fail(sqlite3 *db, const char *what) {
+	fprintf(stderr, "%s: %s\n", what, sqlite3_errmsg(db));
+	exit(1);
+}
+
+static void bench_exec(sqlite3 *db, const char *sql) {
+	char *errmsg = NULL;
+	if(sqlite3_exec(db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", sql, errmsg);
+		exit(1);
+	}
+}
+
+static void bench_report(const char *name, double ns, double allocs) {
+	printf("%s\t%.1f\t%.2f", name, ns, allocs);
+
+	int i;
+	for(i=0;i<bench_nbaseline;++i) {
+		if(strcmp(bench_baseline[i].name, name) != 0) continue;
+		printf("\t%+.1f%%\t%+.2f",
+		 100.0 * (ns - bench_baseline[i].ns) / bench_baseline[i].ns,
+		 allocs - bench_baseline[i].allocs);
+		break;
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+//Steps the statement to completion over and over, binding the next of
+//args to ?1 each time if there are any, until it has run for long
+//enough. The first run isn't timed, so caches are warm.
+static void bench_stmt(
+ const char *name,
+ sqlite3 *db,
+ const char *sql,
+ const char *const *args,
+ int nargs) {
+	sqlite3_stmt *stmt;
+	if(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		bench_fail(db, sql);
+	}
+
+	long long iterations = 1;
+	long long done = 0;
+	double elapsed = 0;
+	long long allocs = 0;
+	int warm = 0;
+	while(1) {
+		long long startallocs =
+		 __atomic_load_n(&bench_allocations, __ATOMIC_RELAXED);
+		double start = bench_now();
+
+		long long i;
+		for(i=0;i<iterations;++i) {
+			if(nargs != 0) {
+				sqlite3_bind_text(stmt, 1, args[(done+i) % nargs], -1,
+				 SQLITE_STATIC);
+			}
+			int rc;
+			while((rc = sqlite3_step(stmt)) == SQLITE_ROW);
+			if(rc != SQLITE_DONE) bench_fail(db, name);
+			sqlite3_reset(stmt);
+		}
+
+		double took = bench_now() - start;
+		long long tookallocs =
+		 __atomic_load_n(&bench_allocations, __ATOMIC_RELAXED) - startallocs;
+		done += iterations;
+
+		if(!warm) {
+			warm = 1;
+			continue;
+		}
+
+		elapsed += took;
+		allocs += tookallocs;
+		if(elapsed >= bench_mintime) {
+			bench_report(name, 1e9 * elapsed / (done - 1),
+			 (double)allocs / (done - 1));
+			break;
+		}
+		iterations *= 2;
+	}
+
+	sqlite3_finalize(stmt);
+}
+
+static void bench_writefile(const char *path, const char *data, size_t bytes) {
+	FILE *f = fopen(path, "wb");
+	if(f == NULL || fwrite(data, 1, bytes, f) != bytes) {
+		fprintf(stderr, "Unable to write %s\n", path);
+		exit(1);
+	}
+	fclose(f);
+}
+
+//An export definition, as a file would have it
+static void bench_exportline(char *buffer, size_t size, int i) {
+	snprintf(buffer, size,
+	 "--export file sep '%%'%%module%%^mod%d(\\.(.*))?$%%%d%%\n", i, i % 7);
+}
+
+//The text of an exports block with n definitions, malloced
+static char *bench_exportstext(int n) {
+	char *text;
+	size_t bytes;
+	FILE *f = open_memstream(&text, &bytes);
+	fprintf(f, "--begin exports\n");
+	int i;
+	for(i=0;i<n;++i) {
+		char line[128];
+		bench_exportline(line, sizeof(line), i);
+		fputs(line, f);
+	}
+	fprintf(f, "--end exports\n");
+	fclose(f);
+	return text;
+}
+
+//A database with a manifest of n regexes over n lua objects of the
+//given size, as software bench
+static sqlite3 *bench_loaderdb(int n, int objbytes) {
+	sqlite3 *db;
+	if(sqlite3_open(":memory:", &db) != SQLITE_OK) bench_fail(db, "open");
+	if(ldext_init(db, NULL, NULL) != SQLITE_OK) bench_fail(db, "ldext_init");
+
+	bench_exec(db,
+	 "create table bench_obj(loader text, objref text, obj blob,"
+	 " exports text);"
+	 "create table bench_manifest(type text, regex text, priority int,"
+	 " entrypoint text, objref text, loader text);"
+	 "begin;");
+
+	char sql[256];
+	int i;
+	for(i=0;i<n;++i) {
+		snprintf(sql, sizeof(sql),
+		 "insert into bench_obj values('lua', 'obj%d', zeroblob(%d), null);"
+		 "insert into bench_manifest values('module',"
+		 " '^mod%d(\\.(.*))?$', %d, null, 'obj%d', 'lua');",
+		 i, objbytes, i, i % 7, i);
+		bench_exec(db, sql);
+	}
+	bench_exec(db, "commit;");
+	return db;
+}
+
+//Names that hit the first n regexes of bench_loaderdb, in an order
+//that isn't the manifest's
+static const char **bench_names(const char *prefix, int n) {
+	const char **names = (const char **)malloc(n * sizeof(const char *));
+	int i;
+	for(i=0;i<n;++i) {
+		char name[64];
+		snprintf(name, sizeof(name), "%s%d", prefix, (i * 7919) % n);
+		names[i] = strdup(name);
+	}
+	return names;
+}
+
+static void bench_loader() {
+	sqlite3 *db = bench_loaderdb(1, 0);
+	static const char *const regmatchargs[] = {"mod1.sub.module"};
+	bench_stmt("regmatch", db,
+	 "select ld_loader_regmatch('^mod1(\\.(.*))?$', ?1)", regmatchargs, 1);
+	sqlite3_close(db);
+
+	char name[64];
+	static const int regexes[] = {10, 100, 1000};
+	int i;
+	for(i=0;i<3;++i) {
+		db = bench_loaderdb(regexes[i], 64);
+		const char **hits = bench_names("mod", regexes[i]);
+		const char **misses = bench_names("nomod", regexes[i]);
+
+		snprintf(name, sizeof(name), "search/hit/regexes=%d", regexes[i]);
+		bench_stmt(name, db, "select ld_loader_search('bench', 'module', ?1)",
+		 hits, regexes[i]);
+		snprintf(name, sizeof(name), "search/miss/regexes=%d", regexes[i]);
+		bench_stmt(name, db, "select ld_loader_search('bench', 'module', ?1)",
+		 misses, regexes[i]);
+
+		bench_exec(db, "select ld_loader_release()");
+		sqlite3_close(db);
+	}
+
+	static const int objbytes[] = {1024, 65536, 1048576};
+	for(i=0;i<3;++i) {
+		db = bench_loaderdb(16, objbytes[i]);
+		const char **objrefs = bench_names("obj", 16);
+
+		snprintf(name, sizeof(name), "getobj/bytes=%d", objbytes[i]);
+		bench_stmt(name, db, "select ld_loader_getobj('bench', ?1)",
+		 objrefs, 16);
+
+		bench_exec(db, "select ld_loader_release()");
+		sqlite3_close(db);
+	}
+}
+
+static void bench_files(sqlite3 *db) {
+	char name[64];
+	char path[256];
+	const char *args[1] = {path};
+
+	static const int filebytes[] = {1024, 65536, 1048576};
+	int i;
+	for(i=0;i<3;++i) {
+		char *data = (char *)malloc(filebytes[i]);
+		memset(data, 'x', filebytes[i]);
+		snprintf(path, sizeof(path), "%s/data%d", bench_dir, filebytes[i]);
+		bench_writefile(path, data, filebytes[i]);
+		free(data);
+
+		snprintf(name, sizeof(name), "getfile_sha256/bytes=%d", filebytes[i]);
+		bench_stmt(name, db, "select ld_getfile_sha256(?1)", args, 1);
+	}
+
+	//lua source of roughly the given size, one assignment per line
+	static const int luabytes[] = {1024, 65536};
+	for(i=0;i<2;++i) {
+		char *data;
+		size_t bytes;
+		FILE *f = open_memstream(&data, &bytes);
+		int line = 0;
+		while(ftell(f) < luabytes[i]) {
+			fprintf(f, "v%d = %d + %d\n", line % 150, line, line);
+			++line;
+		}
+		fprintf(f, "return 1\n");
+		fclose(f);
+
+		snprintf(path, sizeof(path), "%s/code%d.lua", bench_dir, luabytes[i]);
+		bench_writefile(path, data, bytes);
+		free(data);
+
+		snprintf(name, sizeof(name), "getfile_compiledlua/bytes=%d",
+		 luabytes[i]);
+		bench_stmt(name, db, "select ld_getfile_compiledlua(?1)", args, 1);
+	}
+}
+
+static void bench_exports(sqlite3 *db) {
+	char name[64];
+	char path[256];
+
+	static const int counts[] = {10, 100, 1000};
+	int i;
+	for(i=0;i<3;++i) {
+		char *text = bench_exportstext(counts[i]);
+
+		//exports inside a lua file's comments
+		snprintf(path, sizeof(path), "%s/exports%d.lua", bench_dir, counts[i]);
+		char *code = sqlite3_mprintf("%sreturn 1\n", text);
+		bench_writefile(path, code, strlen(code));
+		sqlite3_free(code);
+
+		const char *args[1] = {path};
+		snprintf(name, sizeof(name), "getfile_exportstext/exports=%d",
+		 counts[i]);
+		bench_stmt(name, db, "select ld_getfile_exportstext(?1)", args, 1);
+
+		args[0] = text;
+		snprintf(name, sizeof(name), "exports_count/exports=%d", counts[i]);
+		bench_stmt(name, db, "select ld_exports_count(?1)", args, 1);
+
+		//a table of objects, each with this many exports
+		bench_exec(db,
+		 "drop table if exists bench_exp;"
+		 "create table bench_exp(objref text, exports text);");
+		sqlite3_stmt *stmt;
+		sqlite3_prepare_v2(db, "insert into bench_exp values(?1, ?2)", -1,
+		 &stmt, NULL);
+		int j;
+		for(j=0;j<10;++j) {
+			char objref[32];
+			snprintf(objref, sizeof(objref), "obj%d", j);
+			sqlite3_bind_text(stmt, 1, objref, -1, SQLITE_TRANSIENT);
+			sqlite3_bind_text(stmt, 2, text, -1, SQLITE_STATIC);
+			sqlite3_step(stmt);
+			sqlite3_reset(stmt);
+		}
+		sqlite3_finalize(stmt);
+
+		bench_exec(db,
+		 "drop table if exists bench_exptbl;"
+		 "create virtual table bench_exptbl using"
+		 " ldtbl_exports(bench_exp, objref, exports);");
+		snprintf(name, sizeof(name), "ldtbl_exports/objs=10,exports=%d",
+		 counts[i]);
+		bench_stmt(name, db, "select count(*) from bench_exptbl", NULL, 0);
+
+		free(text);
+	}
+}
+
+static void bench_scandir(sqlite3 *db) {
+	char name[64];
+	char path[512];
+	char sql[512];
+
+	static const int fanout[] = {10, 100, 1000};
+	int i, j;
+	for(i=0;i<3;++i) {
+		char dir[256];
+		snprintf(dir, sizeof(dir), "%s/dir%d", bench_dir, fanout[i]);
+		mkdir(dir, 0700);
+		for(j=0;j<fanout[i];++j) {
+			snprintf(path, sizeof(path), "%s/file%d.lua", dir, j);
+			bench_writefile(path, "return 1\n", 9);
+		}
+
+		snprintf(sql, sizeof(sql),
+		 "drop table if exists bench_dir;"
+		 "create virtual table bench_dir using ldtbl_scandir(%s);", dir);
+		bench_exec(db, sql);
+
+		snprintf(name, sizeof(name), "ldtbl_scandir/files=%d", fanout[i]);
+		bench_stmt(name, db, "select count(*) from bench_dir", NULL, 0);
+	}
+}
+
+static void bench_readbaseline(const char *path) {
+	FILE *f = fopen(path, "r");
+	if(f == NULL) {
+		fprintf(stderr, "Unable to open %s\n", path);
+		exit(1);
+	}
+
+	char line[256];
+	while(fgets(line, sizeof(line), f) != NULL) {
+		struct bench_result r;
+		if(sscanf(line, "%63[^\t]\t%lf\t%lf", r.name, &r.ns, &r.allocs) != 3) {
+			continue;
+		}
+		bench_baseline = (struct bench_result *)realloc(bench_baseline,
+		 (bench_nbaseline+1) * sizeof(struct bench_result));
+		bench_baseline[bench_nbaseline++] = r;
+	}
+	fclose(f);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	while((opt = getopt(argc, argv, "t:")) != -1) {
+		if(opt == 't') {
+			bench_mintime = atof(optarg);
+		} else {
+			fprintf(stderr, "usage: %s [-t seconds] [baseline]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(optind < argc) bench_readbaseline(argv[optind]);
+
+	if(mkdtemp(bench_dir) == NULL) {
+		fprintf(stderr, "Unable to create %s\n", bench_dir);
+		return 1;
+	}
+
+	bench_loader();
+
+	sqlite3 *db;
+	if(sqlite3_open(":memory:", &db) != SQLITE_OK) bench_fail(db, "open");
+	if(ldext_init(db, NULL, NULL) != SQLITE_OK) bench_fail(db, "ldext_init");
+	bench_files(db);
+	bench_exports(db);
+	bench_scandir(db);
+	sqlite3_close(db);
+
+	char cmd[64];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", bench_dir);
+	return system(cmd) == 0 ? 0 : 1;
+}
@@ -0,0 +1,55 @@
+--[[
+Compares request round trip time over the in process queue and the
+POSIX message queue.
+
+usage: ./build.sh run transport.lua [requests] [workers]
+
+Both servers serve the same one module database, so after the first
+request every round trip is a cache hit and the time is dominated by
+the transport.
+--]]
+local luadeploy = require "luadeploy"
+
+local nrequests = tonumber(arg[1]) or 100000
+local nworkers = tonumber(arg[2]) or 1
+
+local function hex(s)
+	return (s:gsub(".", function(c) return string.format("%02X", c:byte()) end))
+end
+
+local db = luadeploy.openSQLString(
+ "create table bench_obj(loader text, objref text, obj blob, exports text);" ..
+ "create table bench_manifest(type text, regex text, priority int," ..
+ " entrypoint text, objref text, loader text);" ..
+ "insert into bench_obj values('lua', 'obj', X'" ..
+ hex(string.dump(load("return 1"))) .. "', null);" ..
+ "insert into bench_manifest values" ..
+ "('module', '^mod$', 1, null, 'obj', 'lua');")
+
+local function run(transport)
+	local sname = "bench" .. transport
+	local server = luadeploy.startServer(sname, "bench", db, "/nonexistent",
+	 nworkers, transport)
+	local search = luadeploy.newSearcher(sname, "module")
+
+	for i=1,1000 do
+		search("mod")
+	end
+
+	collectgarbage()
+	local allocs = bench.allocs()
+	local start = bench.now()
+	for i=1,nrequests do
+		search("mod")
+	end
+	local elapsed = bench.now() - start
+	allocs = bench.allocs() - allocs
+
+	print(string.format("%s: %d requests, %.2f us/request, %.1f allocs/request",
+	 transport, nrequests, 1e6 * elapsed / nrequests, allocs / nrequests))
+
+	server:stop()
+end
+
+run("inproc")
+run("mqueue")
@@ -11,11 +11,9 @@ function app.installapp(database, softwarename)
 
 	local appdb = luadeploy.openDBFile(database)
 
-	local sodir = luadeploy.tmpsodir("/tmp/ldinstall_{pid}")
-	appdb:writeSharedObjs(softwarename, sodir)
-
+	--shared objects are copied to memfds as they are needed
 	local dbserver = luadeploy.startServer("application", softwarename,
-	 appdb, sodir)
+	 appdb, "memfd")
 
 	local modules = {
 	 "base",
@@ -0,0 +1,270 @@
+/******************************************************************************
+* Copyright (C) 2014, Kevin Martin (kev82@khn.org.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+//Allocators for the states newState creates, which count what their
+//state uses and can cap it.
+//
+//The system allocator is realloc with the counting done on top. The
+//arena allocator carves small blocks out of large chunks, one free
+//list per size class, and passes anything bigger to malloc. Lua tells
+//the allocator the old size of every block, so small blocks need no
+//header. When the state is closed the frees are ignored and the chunks
+//are released in one go, rather than block by block.
+//
+//A state is only used by one thread at a time, so none of this locks.
+
+#include <lua.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LDALLOC_SYSTEM 0
+#define LDALLOC_ARENA 1
+
+#define LDALLOC_GRANULE 16
+#define LDALLOC_CLASSES 32	//so blocks up to 512 bytes come from chunks
+#define LDALLOC_SMALLMAX (LDALLOC_GRANULE * LDALLOC_CLASSES)
+#define LDALLOC_CHUNKBYTES 65536
+
+//Chunks and large blocks start with one of these so they can all be
+//found at teardown
+struct ldalloc_link
+{
+	struct ldalloc_link *prev;
+	struct ldalloc_link *next;
+} __attribute__((aligned(16)));
+
+struct ldalloc_free
+{
+	struct ldalloc_free *next;
+};
+
+struct ldalloc
+{
+	int type;
+	int closing;	//lua_close is running, frees can be skipped
+
+	size_t bytes;	//what lua thinks it has
+	size_t peak;
+	size_t limit;	//0 for none
+	long long allocs;
+	size_t reserved;	//chunks and large blocks, arena only
+
+	//arena only
+	struct ldalloc_link chunks;	//list heads, circular
+	struct ldalloc_link large;
+	char *bump;	//unused space at the end of the newest chunk
+	char *bumpend;
+	struct ldalloc_free *freelists[LDALLOC_CLASSES];
+};
+
+static struct ldalloc *ldalloc_create(int type) {
+	struct ldalloc *a = (struct ldalloc *)calloc(1, sizeof(struct ldalloc));
+	assert(a != NULL);
+	a->type = type;
+	a->chunks.prev = a->chunks.next = &a->chunks;
+	a->large.prev = a->large.next = &a->large;
+	return a;
+}
+
+static void ldalloc_linkin(struct ldalloc_link *head, struct ldalloc_link *l) {
+	l->prev = head;
+	l->next = head->next;
+	head->next->prev = l;
+	head->next = l;
+}
+
+static void ldalloc_unlink(struct ldalloc_link *l) {
+	l->prev->next = l->next;
+	l->next->prev = l->prev;
+}
+
+static void ldalloc_freelist(struct ldalloc_link *head) {
+	struct ldalloc_link *l = head->next;
+	while(l != head) {
+		struct ldalloc_link *next = l->next;
+		free(l);
+		l = next;
+	}
+}
+
+//Frees everything, the state must have been closed
+static void ldalloc_destroy(struct ldalloc *a) {
+	ldalloc_freelist(&a->chunks);
+	ldalloc_freelist(&a->large);
+	free(a);
+}
+
+static int ldalloc_class(size_t bytes) {
+	return (bytes - 1) / LDALLOC_GRANULE;
+}
+
+static void *ldalloc_smallget(struct ldalloc *a, int c) {
+	struct ldalloc_free *f = a->freelists[c];
+	if(f != NULL) {
+		a->freelists[c] = f->next;
+		return f;
+	}
+
+	size_t bytes = (c+1) * LDALLOC_GRANULE;
+	if(a->bump + bytes > a->bumpend) {
+		//what's left of the old chunk is wasted, at most 511 bytes
+		struct ldalloc_link *chunk = (struct ldalloc_link *)
+		 malloc(LDALLOC_CHUNKBYTES);
+		if(chunk == NULL) return NULL;
+		ldalloc_linkin(&a->chunks, chunk);
+		a->reserved += LDALLOC_CHUNKBYTES;
+		a->bump = (char *)(chunk + 1);
+		a->bumpend = (char *)chunk + LDALLOC_CHUNKBYTES;
+	}
+
+	void *p = a->bump;
+	a->bump += bytes;
+	return p;
+}
+
+static void ldalloc_smallput(struct ldalloc *a, int c, void *p) {
+	struct ldalloc_free *f = (struct ldalloc_free *)p;
+	f->next = a->freelists[c];
+	a->freelists[c] = f;
+}
+
+static void *ldalloc_largeget(struct ldalloc *a, size_t bytes) {
+	struct ldalloc_link *l = (struct ldalloc_link *)
+	 malloc(sizeof(struct ldalloc_link) + bytes);
+	if(l == NULL) return NULL;
+	ldalloc_linkin(&a->large, l);
+	a->reserved += bytes;
+	return l + 1;
+}
+
+static void ldalloc_largeput(struct ldalloc *a, void *p, size_t bytes) {
+	struct ldalloc_link *l = (struct ldalloc_link *)p - 1;
+	ldalloc_unlink(l);
+	a->reserved -= bytes;
+	free(l);
+}
+
+static void *ldalloc_arena(
+ struct ldalloc *a,
+ void *ptr,
+ size_t osize,
+ size_t nsize) {
+	if(ptr == NULL) osize = 0;	//it's the type of object instead
+
+	if(nsize == 0) {
+		if(ptr == NULL || a->closing) return NULL;
+		if(osize <= LDALLOC_SMALLMAX) {
+			ldalloc_smallput(a, ldalloc_class(osize), ptr);
+		} else {
+			ldalloc_largeput(a, ptr, osize);
+		}
+		return NULL;
+	}
+
+	//a large block resized stays a large block if it can
+	if(osize > LDALLOC_SMALLMAX && nsize > LDALLOC_SMALLMAX) {
+		struct ldalloc_link *l = (struct ldalloc_link *)ptr - 1;
+		ldalloc_unlink(l);
+		struct ldalloc_link *n = (struct ldalloc_link *)
+		 realloc(l, sizeof(struct ldalloc_link) + nsize);
+		if(n == NULL) {
+			ldalloc_linkin(&a->large, l);
+			return nsize < osize ? ptr : NULL;
+		}
+		ldalloc_linkin(&a->large, n);
+		a->reserved += nsize - osize;
+		return n + 1;
+	}
+
+	if(ptr != NULL && osize <= LDALLOC_SMALLMAX && nsize <= LDALLOC_SMALLMAX &&
+	 ldalloc_class(osize) == ldalloc_class(nsize)) {
+		return ptr;
+	}
+
+	void *p = nsize <= LDALLOC_SMALLMAX ?
+	 ldalloc_smallget(a, ldalloc_class(nsize)) : ldalloc_largeget(a, nsize);
+	if(p == NULL) {
+		//Keeping a block that's too big is always safe, it just
+		//ends up on a smaller class's free list
+		return ptr != NULL && nsize < osize ? ptr : NULL;
+	}
+
+	if(ptr != NULL) {
+		memcpy(p, ptr, osize < nsize ? osize : nsize);
+		ldalloc_arena(a, ptr, osize, 0);
+	}
+	return p;
+}
+
+//The lua_Alloc for every state newState creates
+static void *ldalloc_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	struct ldalloc *a = (struct ldalloc *)ud;
+	size_t old = ptr != NULL ? osize : 0;
+
+	//lua counts on shrinking never failing, so only growth is capped
+	if(nsize > old && a->limit != 0 && a->bytes - old + nsize > a->limit) {
+		return NULL;
+	}
+
+	void *p;
+	if(a->type == LDALLOC_ARENA) {
+		p = ldalloc_arena(a, ptr, osize, nsize);
+	} else if(nsize == 0) {
+		free(ptr);
+		p = NULL;
+	} else {
+		p = realloc(ptr, nsize);
+	}
+
+	if(nsize != 0 && p == NULL) return NULL;
+
+	a->bytes = a->bytes - old + nsize;
+	if(a->bytes > a->peak) a->peak = a->bytes;
+	if(nsize > old) ++a->allocs;
+	return p;
+}
+
+static void ldalloc_push(lua_State *l, struct ldalloc *a) {
+	lua_createtable(l, 0, 6);
+
+	lua_pushstring(l, a->type == LDALLOC_ARENA ? "arena" : "system");
+	lua_setfield(l, -2, "allocator");
+
+	lua_pushnumber(l, a->bytes);
+	lua_setfield(l, -2, "bytes");
+
+	lua_pushnumber(l, a->peak);
+	lua_setfield(l, -2, "peak");
+
+	lua_pushnumber(l, a->allocs);
+	lua_setfield(l, -2, "allocs");
+
+	lua_pushnumber(l, a->limit);
+	lua_setfield(l, -2, "limit");
+
+	if(a->type == LDALLOC_ARENA) {
+		lua_pushnumber(l, a->reserved);
+		lua_setfield(l, -2, "reserved");
+	}
+}
@@ -8,10 +8,10 @@ fi
 
 case "$cmd" in
 
-clientamalg) cat msg.h client.c
+clientamalg) cat ../sqlext/ldsearch.h msg.h queue.c client.c
 	;;
 
-amalg) cat msg.h server.c client.c db.c state.c
+amalg) cat ../sqlext/ldsearch.h msg.h queue.c dlcache.c trace.c metrics.c server.c client.c value.c store.c db.c alloc.c runpool.c channel.c state.c
 	echo "static char luadeploy_code[] = {"
 	cat ldcode.lua | luac -o - - | xxd -i
 	echo "};"
@@ -0,0 +1,338 @@
+/******************************************************************************
+* Copyright (C) 2014, Kevin Martin (kev82@khn.org.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+//Channels, bounded queues of messages between states on any threads.
+//
+//A message is the values given to one send, serialised, and a
+//channel is a shared object, so passing one to another state, or
+//sending it down another channel, gives that state the same channel.
+//Messages are kept in a lock free ring (Vyukov's MPMC design, as in
+//queue.c) and two semaphores count the messages and the free space,
+//which is what senders and receivers block on.
+//
+//Blocking doesn't give the thread up to anything else, so a state on
+//the run pool that blocks on a channel ties up its worker until it
+//returns.
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LDCHANNEL_MAXCAPACITY (1 << 20)
+
+struct ldchannel_slot
+{
+	size_t seq;
+	struct ldvalue_blob *blob;
+};
+
+struct ldchannel
+{
+	struct ldshared shared;
+	int capacity;
+	size_t mask;	//the ring is the capacity rounded up to a power of two
+	struct ldchannel_slot *slots;
+
+	sem_t messages;
+	sem_t spaces;
+
+	size_t head __attribute__((aligned(64)));
+	size_t tail __attribute__((aligned(64)));
+};
+
+static int ldchannel_trypush(struct ldchannel *c, struct ldvalue_blob *blob) {
+	size_t pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+	struct ldchannel_slot *slot;
+
+	while(1) {
+		slot = &c->slots[pos & c->mask];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&c->tail, &pos, pos+1, 1,
+			 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		} else if(diff < 0) {
+			return 0;	//full
+		} else {
+			pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->blob = blob;
+	__atomic_store_n(&slot->seq, pos+1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+//Returns NULL if no message has finished being pushed
+static struct ldvalue_blob *ldchannel_trypop(struct ldchannel *c) {
+	size_t pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+	struct ldchannel_slot *slot;
+
+	while(1) {
+		slot = &c->slots[pos & c->mask];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos+1);
+
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&c->head, &pos, pos+1, 1,
+			 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		} else if(diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	struct ldvalue_blob *blob = slot->blob;
+	__atomic_store_n(&slot->seq, pos+c->mask+1, __ATOMIC_RELEASE);
+	return blob;
+}
+
+//Waits on s, for ever if timeout is negative. Returns 0 if it timed out.
+static int ldchannel_wait(sem_t *s, double timeout) {
+	if(timeout < 0) {
+		while(sem_wait(s) != 0) assert(errno == EINTR);
+		return 1;
+	}
+
+	if(timeout == 0) {
+		while(sem_trywait(s) != 0) {
+			if(errno == EAGAIN) return 0;
+			assert(errno == EINTR);
+		}
+		return 1;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	time_t whole = (time_t)timeout;
+	ts.tv_sec += whole;
+	ts.tv_nsec += (long)((timeout - whole) * 1e9);
+	if(ts.tv_nsec >= 1000000000L) {
+		++ts.tv_sec;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	while(sem_timedwait(s, &ts) != 0) {
+		if(errno == ETIMEDOUT) return 0;
+		assert(errno == EINTR);
+	}
+	return 1;
+}
+
+static void ldchannel_destroy(struct ldshared *s) {
+	struct ldchannel *c = (struct ldchannel *)s;
+
+	struct ldvalue_blob *blob;
+	while((blob = ldchannel_trypop(c)) != NULL) ldvalue_freeblob(blob);
+
+	sem_destroy(&c->messages);
+	sem_destroy(&c->spaces);
+	free(c->slots);
+	free(c);
+}
+
+static struct ldchannel *ldchannel_check(lua_State *l, int idx);
+
+//Sends the values from first up, waiting for space up to timeout
+static int ldchannel_send(lua_State *l, int first, double timeout) {
+	struct ldchannel *c = ldchannel_check(l, 1);
+
+	//serialised before waiting, so nothing can fail once there's space
+	struct ldvalue_blob *blob =
+	 ldvalue_serialise(l, lua_gettop(l) - first + 1);
+
+	if(!ldchannel_wait(&c->spaces, timeout)) {
+		ldvalue_freeblob(blob);
+		return 0;
+	}
+
+	//a receiver can have taken the space's slot and not given it back
+	while(!ldchannel_trypush(c, blob)) sched_yield();
+	sem_post(&c->messages);
+	return 1;
+}
+
+//Pushes the values in the next message, waiting up to timeout for one.
+//Returns -1 if it timed out.
+static int ldchannel_receive(lua_State *l, double timeout) {
+	struct ldchannel *c = ldchannel_check(l, 1);
+
+	if(!ldchannel_wait(&c->messages, timeout)) return -1;
+
+	//likewise a sender can be part way through pushing the message
+	struct ldvalue_blob *blob;
+	while((blob = ldchannel_trypop(c)) == NULL) sched_yield();
+	sem_post(&c->spaces);
+
+	return ldvalue_deserialise(l, blob);
+}
+
+static double ldchannel_checktimeout(lua_State *l, int idx) {
+	lua_Number timeout = luaL_checknumber(l, idx);
+	luaL_argcheck(l, timeout >= 0, idx, "negative timeout");
+	return timeout;
+}
+
+//channel:send(...) waits for space
+static int ldchannel_mtsend(lua_State *l) {
+	ldchannel_send(l, 2, -1);
+	return 0;
+}
+
+//channel:trySend(...) returns false if the channel is full
+static int ldchannel_mttrysend(lua_State *l) {
+	lua_pushboolean(l, ldchannel_send(l, 2, 0));
+	return 1;
+}
+
+//channel:sendTimeout(seconds, ...) returns false if it timed out
+static int ldchannel_mtsendtimeout(lua_State *l) {
+	lua_pushboolean(l, ldchannel_send(l, 3, ldchannel_checktimeout(l, 2)));
+	return 1;
+}
+
+//channel:receive() waits for a message and returns its values
+static int ldchannel_mtreceive(lua_State *l) {
+	lua_settop(l, 1);
+	return ldchannel_receive(l, -1);
+}
+
+//channel:tryReceive() returns false if there's no message, else true
+//and the message's values
+static int ldchannel_mttryreceive(lua_State *l) {
+	lua_settop(l, 1);
+	lua_pushboolean(l, 1);
+	int n = ldchannel_receive(l, 0);
+	if(n < 0) {
+		lua_pushboolean(l, 0);
+		return 1;
+	}
+	return n + 1;
+}
+
+//channel:receiveTimeout(seconds) is tryReceive, waiting up to seconds
+static int ldchannel_mtreceivetimeout(lua_State *l) {
+	lua_settop(l, 2);
+	double timeout = ldchannel_checktimeout(l, 2);
+	lua_pushboolean(l, 1);
+	int n = ldchannel_receive(l, timeout);
+	if(n < 0) {
+		lua_pushboolean(l, 0);
+		return 1;
+	}
+	return n + 1;
+}
+
+//#channel is how many messages are waiting
+static int ldchannel_mtlen(lua_State *l) {
+	struct ldchannel *c = ldchannel_check(l, 1);
+	int n;
+	sem_getvalue(&c->messages, &n);
+	lua_pushinteger(l, n < 0 ? 0 : n);
+	return 1;
+}
+
+static int ldchannel_mtcapacity(lua_State *l) {
+	lua_pushinteger(l, ldchannel_check(l, 1)->capacity);
+	return 1;
+}
+
+static void ldchannel_setmetatable(lua_State *l) {
+	if(ldshared_newmetatable(l, (void *)ldchannel_setmetatable)) {
+		lua_newtable(l);
+		lua_pushcfunction(l, ldchannel_mtsend);
+		lua_setfield(l, -2, "send");
+		lua_pushcfunction(l, ldchannel_mttrysend);
+		lua_setfield(l, -2, "trySend");
+		lua_pushcfunction(l, ldchannel_mtsendtimeout);
+		lua_setfield(l, -2, "sendTimeout");
+		lua_pushcfunction(l, ldchannel_mtreceive);
+		lua_setfield(l, -2, "receive");
+		lua_pushcfunction(l, ldchannel_mttryreceive);
+		lua_setfield(l, -2, "tryReceive");
+		lua_pushcfunction(l, ldchannel_mtreceivetimeout);
+		lua_setfield(l, -2, "receiveTimeout");
+		lua_pushcfunction(l, ldchannel_mtcapacity);
+		lua_setfield(l, -2, "capacity");
+		lua_setfield(l, -2, "__index");
+
+		lua_pushcfunction(l, ldchannel_mtlen);
+		lua_setfield(l, -2, "__len");
+	}
+	lua_setmetatable(l, -2);
+}
+
+static struct ldchannel *ldchannel_check(lua_State *l, int idx) {
+	return (struct ldchannel *)ldshared_check(l, idx,
+	 (void *)ldchannel_setmetatable, "channel")->s;
+}
+
+//channel(capacity)
+static int ldchannel_create(lua_State *l) {
+	int capacity = luaL_checkint(l, 1);
+	luaL_argcheck(l, capacity > 0 && capacity <= LDCHANNEL_MAXCAPACITY, 1,
+	 "capacity out of range");
+
+	size_t nslots = 1;
+	while(nslots < (size_t)capacity) nslots *= 2;
+
+	struct ldchannel *c = NULL;
+	if(posix_memalign((void **)&c, 64, sizeof(struct ldchannel)) != 0) {
+		return luaL_error(l, "Unable to allocate channel");
+	}
+	c->slots = (struct ldchannel_slot *)
+	 malloc(nslots * sizeof(struct ldchannel_slot));
+	if(c->slots == NULL) {
+		free(c);
+		return luaL_error(l, "Unable to allocate channel");
+	}
+
+	ldshared_init(&c->shared, ldchannel_destroy, ldchannel_setmetatable);
+	c->capacity = capacity;
+	c->mask = nslots - 1;
+	size_t i;
+	for(i=0;i<nslots;++i) c->slots[i].seq = i;
+	c->head = c->tail = 0;
+	sem_init(&c->messages, 0, 0);
+	sem_init(&c->spaces, 0, capacity);
+
+	ldshared_push(l, &c->shared, 0);
+	ldshared_release(&c->shared);
+	return 1;
+}
+
+//require "ldchannel" in a state newState made
+static int ldchannel_moduleloader(lua_State *l) {
+	lua_newtable(l);
+	lua_pushcfunction(l, ldchannel_create);
+	lua_setfield(l, -2, "new");
+	return 1;
+}
@@ -22,11 +22,85 @@
 ******************************************************************************/
 
 #include <lua.h>
+#include <lauxlib.h>
 #include <semaphore.h>
 #include <mqueue.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+
+static long long ldclient_nanotime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//Tells the server how long the response handler took and the whole
+//round trip. Negative means don't know.
+static void ldclient_reporttiming(
+ struct ldloader_request *req,
+ long long loadns) {
+	if(req->timingHandler == NULL) return;
+	req->timingHandler(req, loadns,
+	 loadns < 0 ? -1 : ldclient_nanotime() - req->sent);
+}
+
+//Fallback for servers that aren't in our registry, either because
+//they use the msg queue transport or because they live in another
+//copy of this code.
+static int ldclient_postmqueue(
+ const char *server,
+ struct ldloader_request *req) {
+	char buffer[1024];
+	snprintf(buffer, 1023, "/lds-%d-%s", getpid(), server);
+	buffer[1023] = 0;
+
+	mqd_t q = mq_open(buffer, O_WRONLY);
+	if(q == -1) return 0;
+
+	mq_send(q, (char *)&req, sizeof(struct ldloader_request *), 0);
+	mq_close(q);
+	return 1;
+}
+
+//Sends the request, returning the in process queue it went on, if
+//any, which the caller releases once the server has responded
+static struct ldqueue *ldclient_post(
+ lua_State *l,
+ const char *server,
+ struct ldloader_request *req) {
+	sem_init(&req->sem, 0, 0);
+	req->timingHandler = NULL;
+	req->sent = ldclient_nanotime();
+
+	struct ldqueue *q = ldqueue_acquire(server);
+	if(q != NULL) {
+		ldqueue_push(q, req);
+	} else if(!ldclient_postmqueue(server, req)) {
+		sem_destroy(&req->sem);
+		luaL_error(l, "Unable to open msg queue");
+	}
+	return q;
+}
+
+static void ldclient_wait(struct ldloader_request *req, struct ldqueue *q) {
+	//the server writes into req, so we can't leave early
+	while(sem_wait(&req->sem) == -1 && errno == EINTR);
+	sem_destroy(&req->sem);
+	if(q != NULL) ldqueue_release(q);
+}
+
+//Sends the request and waits for the server to respond
+static void ldclient_send(
+ lua_State *l,
+ const char *server,
+ struct ldloader_request *req) {
+	struct ldqueue *q = ldclient_post(l, server, req);
+	ldclient_wait(req, q);
+}
 
 static int ldclient_request(lua_State *l) {
 	lua_settop(l, 3);
@@ -34,40 +108,247 @@ static int ldclient_request(lua_State *l) {
 	luaL_checktype(l, 2, LUA_TSTRING);
 	luaL_checktype(l, 3, LUA_TSTRING);
 
-	char buffer[1024];
-	snprintf(buffer, 1023, "/lds-%d-%s", getpid(), lua_tostring(l, 1));
-	buffer[1023] = 0;
+	//the strings stay on the stack until the server is done with them
+	struct ldloader_request req;
+	req.type = lua_tostring(l, 2);
+	req.name = lua_tostring(l, 3);
+	req.count = 0;
+	req.batch = NULL;
 
-	mqd_t q = mq_open(buffer, O_WRONLY);
-	if(q == -1) return luaL_error(l, "Unable to open msg queue");
+	ldclient_send(l, lua_tostring(l, 1), &req);
 
-	struct ldloader_request *req =
-	 (struct ldloader_request *)malloc(sizeof(struct ldloader_request));
-	sem_init(&req->sem, 0, 0);
-	req->type = strdup(lua_tostring(l, 2));
-	req->name = strdup(lua_tostring(l, 3));
+	lua_settop(l, 3);
+	lua_pushcfunction(l, req.responseHandler);
+	lua_pushlightuserdata(l, req.responseData);
 
-	lua_settop(l, 0);
+	long long start = ldclient_nanotime();
+	int rc = lua_pcall(l, 1, LUA_MULTRET, 0);
+	ldclient_reporttiming(&req, ldclient_nanotime() - start);
+	if(rc != LUA_OK) return lua_error(l);
 
-	mq_send(q, (char *)&req, sizeof(struct ldloader_request *), 0);
-	sem_wait(&req->sem);
+	return lua_gettop(l) - 3;
+}
 
-	mq_close(q);
-	sem_destroy(&req->sem);
-	free(req->type);
-	free(req->name);
+//Resolves a list of names in one round trip. Returns a table of
+//what search would have returned for each name that was found, as a
+//list, and a table of error messages for the rest, both keyed by name.
+static int ldclient_requestmany(lua_State *l) {
+	lua_settop(l, 3);
+	luaL_checktype(l, 1, LUA_TSTRING);
+	luaL_checktype(l, 2, LUA_TSTRING);
+	luaL_checktype(l, 3, LUA_TTABLE);
+
+	int count = lua_rawlen(l, 3);
+
+	//the names are kept alive by the table
+	struct ldloader_response *batch = (struct ldloader_response *)
+	 lua_newuserdata(l, (count+1) * sizeof(struct ldloader_response));
+	int i;
+	for(i=0;i<count;++i) {
+		lua_rawgeti(l, 3, i+1);
+		if(lua_type(l, -1) != LUA_TSTRING) {
+			return luaL_error(l, "name %d is not a string", i+1);
+		}
+		batch[i].name = lua_tostring(l, -1);
+		lua_pop(l, 1);
+	}
+
+	struct ldloader_request req;
+	req.type = lua_tostring(l, 2);
+	req.name = NULL;
+	req.count = count;
+	req.batch = batch;
+	req.timingHandler = NULL;
+
+	if(count != 0) {
+		ldclient_send(l, lua_tostring(l, 1), &req);
+	}
+	long long loadns = 0;
+
+	lua_newtable(l);
+	lua_newtable(l);
+	//[sstuFE]
+
+	for(i=0;i<count;++i) {
+		int base = lua_gettop(l);
+		lua_pushcfunction(l, batch[i].responseHandler);
+		lua_pushlightuserdata(l, batch[i].responseData);
 
-	lua_pushcfunction(l, req->responseHandler);
-	lua_pushlightuserdata(l, req->responseData);
-	free(req);
+		long long start = ldclient_nanotime();
+		int rc = lua_pcall(l, 1, LUA_MULTRET, 0);
+		loadns += ldclient_nanotime() - start;
+		if(rc != LUA_OK) {
+			lua_setfield(l, base, batch[i].name);
+			continue;
+		}
 
-	lua_call(l, 1, LUA_MULTRET);
-	return lua_gettop(l);
+		int nresults = lua_gettop(l) - base;
+		lua_createtable(l, nresults, 0);
+		lua_insert(l, base+1);
+		while(nresults != 0) {
+			lua_rawseti(l, base+1, nresults--);
+		}
+		lua_setfield(l, base-1, batch[i].name);
+	}
+	ldclient_reporttiming(&req, loadns);
+
+	return 2;
+}
+
+//A request that has been sent but not waited for. It lives in a
+//userdata, which lua never moves, so the server can write the
+//response straight into it.
+struct ldclient_async
+{
+	struct ldloader_request req;
+	struct ldqueue *q;
+	int state;
+};
+
+#define LDCLIENT_ASYNC_UNSENT 0
+#define LDCLIENT_ASYNC_PENDING 1
+#define LDCLIENT_ASYNC_DONE 2	//responded, handler not called yet
+#define LDCLIENT_ASYNC_TAKEN 3
+
+static struct ldclient_async *ldclient_checkasync(lua_State *l) {
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+	return (struct ldclient_async *)lua_touserdata(l, 1);
+}
+
+static int ldclient_mtpoll(lua_State *l) {
+	lua_settop(l, 1);
+	struct ldclient_async *a = ldclient_checkasync(l);
+
+	if(a->state == LDCLIENT_ASYNC_PENDING && sem_trywait(&a->req.sem) == 0) {
+		sem_destroy(&a->req.sem);
+		if(a->q != NULL) ldqueue_release(a->q);
+		a->state = LDCLIENT_ASYNC_DONE;
+	}
+
+	lua_pushboolean(l, a->state != LDCLIENT_ASYNC_PENDING);
+	return 1;
+}
+
+static int ldclient_mtwait(lua_State *l) {
+	lua_settop(l, 1);
+	struct ldclient_async *a = ldclient_checkasync(l);
+
+	if(a->state == LDCLIENT_ASYNC_PENDING) {
+		ldclient_wait(&a->req, a->q);
+		a->state = LDCLIENT_ASYNC_DONE;
+	}
+	return 0;
+}
+
+//Waits if need be, then returns what search would have
+static int ldclient_mtresult(lua_State *l) {
+	lua_settop(l, 1);
+	struct ldclient_async *a = ldclient_checkasync(l);
+
+	ldclient_mtwait(l);
+	if(a->state != LDCLIENT_ASYNC_DONE) {
+		return luaL_error(l, "Result already taken");
+	}
+	a->state = LDCLIENT_ASYNC_TAKEN;
+
+	lua_pushcfunction(l, a->req.responseHandler);
+	lua_pushlightuserdata(l, a->req.responseData);
+
+	long long start = ldclient_nanotime();
+	int rc = lua_pcall(l, 1, LUA_MULTRET, 0);
+	ldclient_reporttiming(&a->req, ldclient_nanotime() - start);
+	if(rc != LUA_OK) return lua_error(l);
+
+	return lua_gettop(l) - 1;
+}
+
+static int ldclient_mtgc(lua_State *l) {
+	lua_settop(l, 1);
+	struct ldclient_async *a = ldclient_checkasync(l);
+
+	//An abandoned request still has to be waited for, and the response
+	//handler called for it to free its data
+	ldclient_mtwait(l);
+	if(a->state == LDCLIENT_ASYNC_DONE) {
+		a->state = LDCLIENT_ASYNC_TAKEN;
+		lua_pushcfunction(l, a->req.responseHandler);
+		lua_pushlightuserdata(l, a->req.responseData);
+		lua_pcall(l, 1, 0, 0);
+		ldclient_reporttiming(&a->req, -1);
+	}
+	return 0;
+}
+
+static int ldclient_setasyncmt(lua_State *l) {
+	lua_rawgetp(l, LUA_REGISTRYINDEX, (void *)ldclient_setasyncmt);
+	if(lua_type(l, -1) == LUA_TNIL) {
+		lua_pop(l, 1);
+		lua_newtable(l);
+
+		lua_pushvalue(l, -1);
+		lua_setfield(l, -2, "__index");
+
+		lua_pushcfunction(l, ldclient_mtpoll);
+		lua_setfield(l, -2, "poll");
+
+		lua_pushcfunction(l, ldclient_mtwait);
+		lua_setfield(l, -2, "wait");
+
+		lua_pushcfunction(l, ldclient_mtresult);
+		lua_setfield(l, -2, "result");
+
+		lua_pushcfunction(l, ldclient_mtgc);
+		lua_setfield(l, -2, "__gc");
+
+		lua_pushvalue(l, -1);
+		lua_rawsetp(l, LUA_REGISTRYINDEX, (void *)ldclient_setasyncmt);
+	}
+	assert(lua_type(l, -1) == LUA_TTABLE);
+	lua_setmetatable(l, -2);
+	return 0;
+}
+
+//Like ldclient_request, but returns a handle to the request
+//straight away instead of waiting for the response
+static int ldclient_requestasync(lua_State *l) {
+	lua_settop(l, 3);
+	luaL_checktype(l, 1, LUA_TSTRING);
+	luaL_checktype(l, 2, LUA_TSTRING);
+	luaL_checktype(l, 3, LUA_TSTRING);
+
+	size_t typebytes, namebytes;
+	const char *type = lua_tolstring(l, 2, &typebytes);
+	const char *name = lua_tolstring(l, 3, &namebytes);
+
+	//the strings are copied after the struct, the arguments
+	//can be collected before the server gets to them
+	struct ldclient_async *a = (struct ldclient_async *)lua_newuserdata(l,
+	 sizeof(struct ldclient_async) + typebytes + namebytes + 2);
+	char *strings = (char *)(a + 1);
+	memcpy(strings, type, typebytes + 1);
+	memcpy(strings + typebytes + 1, name, namebytes + 1);
+
+	a->req.type = strings;
+	a->req.name = strings + typebytes + 1;
+	a->req.count = 0;
+	a->req.batch = NULL;
+	a->q = NULL;
+	a->state = LDCLIENT_ASYNC_UNSENT;
+	ldclient_setasyncmt(l);
+
+	a->q = ldclient_post(l, lua_tostring(l, 1), &a->req);
+	a->state = LDCLIENT_ASYNC_PENDING;
+
+	return 1;
 }
 
 static int ldclient_moduleloader(lua_State *l) {
 	lua_newtable(l);
 	lua_pushcfunction(l, ldclient_request);
 	lua_setfield(l, -2, "search");
+	lua_pushcfunction(l, ldclient_requestmany);
+	lua_setfield(l, -2, "searchMany");
+	lua_pushcfunction(l, ldclient_requestasync);
+	lua_setfield(l, -2, "searchAsync");
 	return 1;
 }
@@ -25,11 +25,6 @@
 #include <lauxlib.h>
 #include <sqlite3.h>
 
-int ldext_init(
- sqlite3 *db,
- const char **errmsg,
- const void *api);
-
 struct lddb_userdata
 {
 	sqlite3 *db;
@@ -43,6 +38,8 @@ static int lddb_mtgc(lua_State *l) {
 	 (struct lddb_userdata *)lua_touserdata(l, 1);
 
 	if(ud->db != NULL) {
+		//finalize the statements the loader functions keep
+		sqlite3_exec(ud->db, "select ld_loader_release()", NULL, NULL, NULL);
 		sqlite3_close(ud->db);
 		ud->db = NULL;
 	}
@@ -122,6 +119,45 @@ static int lddb_mtwriteso(lua_State *l) {
 	return 0;
 }
 
+//Loads a shared store that was dumped into the software's objects
+static int lddb_mtloadstore(lua_State *l) {
+	lua_settop(l, 3);
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+	luaL_checktype(l, 2, LUA_TSTRING);
+	luaL_checktype(l, 3, LUA_TSTRING);
+
+	struct lddb_userdata *ud = (struct lddb_userdata *)lua_touserdata(l, 1);
+	assert(ud != NULL);
+
+	char *sql = sqlite3_mprintf(
+	 "select obj from \"%s_obj\" where objref=?", lua_tostring(l, 2));
+	sqlite3_stmt *stmt;
+	int rc = sqlite3_prepare_v2(ud->db, sql, -1, &stmt, NULL);
+	sqlite3_free(sql);
+	if(rc != SQLITE_OK || stmt == NULL) {
+		return luaL_error(l, "Unable to prepare statement");
+	}
+
+	rc = sqlite3_bind_text(stmt, 1, lua_tostring(l, 3), -1, SQLITE_STATIC);
+	assert(rc == SQLITE_OK);
+
+	rc = sqlite3_step(stmt);
+	if(rc != SQLITE_ROW) {
+		sqlite3_finalize(stmt);
+		return luaL_error(l, "No object %s", lua_tostring(l, 3));
+	}
+
+	//copied out first, so the statement can't leak if it's no store
+	lua_pushlstring(l, (const char *)sqlite3_column_blob(stmt, 0),
+	 sqlite3_column_bytes(stmt, 0));
+	sqlite3_finalize(stmt);
+
+	size_t len;
+	const char *data = lua_tolstring(l, -1, &len);
+	ldstore_load(l, data, len);
+	return 1;
+}
+
 static int lddb_setMetatable(lua_State *l) {
 	lua_settop(l, 1);
 	luaL_checktype(l, 1, LUA_TUSERDATA);
@@ -143,6 +179,9 @@ static int lddb_setMetatable(lua_State *l) {
 		lua_pushcfunction(l, lddb_mtwriteso);
 		lua_setfield(l, -2, "writeSharedObjs");
 
+		lua_pushcfunction(l, lddb_mtloadstore);
+		lua_setfield(l, -2, "loadSharedStore");
+
 		lua_pushvalue(l, -1);
 		lua_rawsetp(l, LUA_REGISTRYINDEX, (void *)lddb_setMetatable);
 	}
@@ -170,6 +209,8 @@ static int lddb_createFromSQLString(lua_State *l) {
 	assert(ud->db != NULL);
 
 	ldext_init(ud->db, NULL, NULL);
+	//released again before the connection is closed
+	sqlite3_exec(ud->db, "select ld_loader_cachestmts()", NULL, NULL, NULL);
 
 	const char *sql = lua_tostring(l, 1);
 	sqlite3_stmt *stmt;
@@ -239,6 +280,8 @@ static int lddb_createFromDBFile(lua_State *l) {
 	assert(ud->db != NULL);
 
 	ldext_init(ud->db, NULL, NULL);
+	//released again before the connection is closed
+	sqlite3_exec(ud->db, "select ld_loader_cachestmts()", NULL, NULL, NULL);
 
 	sqlite3_stmt *stmt;
 
@@ -0,0 +1,304 @@
+/******************************************************************************
+* Copyright (C) 2014, Kevin Martin (kev82@khn.org.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+//Process wide cache of dlopen handles, shared by every state.
+//
+//Each library is opened once, and its entry points are looked up once,
+//however many states load it. A state holds one reference to each
+//library it has loaded, dropped when the state is closed. What happens
+//when the last reference goes is the unload policy: by default
+//libraries stay loaded for the life of the process, so short lived
+//states don't keep running constructors and relocations.
+//
+//Libraries are matched on the file they were opened from, not the
+//path, since a memfd path names a different object once the fd is
+//reused. dlopen matches on the path too, so a memfd is only closed
+//once its library is.
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LDDL_KEEP 0	//never dlclose
+#define LDDL_UNLOAD 1	//dlclose when no state holds it
+
+struct lddl_symbol
+{
+	struct lddl_symbol *next;
+	char *name;
+	lua_CFunction func;
+};
+
+struct lddl_library
+{
+	struct lddl_library *next;
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	int stale;	//the file is going, never match it again
+	int fd;	//-1, or a memfd to close along with the library
+	void *hndl;
+	int refs;
+	struct lddl_symbol *symbols;
+};
+
+static pthread_mutex_t lddl_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lddl_library *lddl_libraries = NULL;
+static int lddl_policy = LDDL_KEEP;
+
+static void lddl_close(struct lddl_library *lib) {
+	dlclose(lib->hndl);
+	if(lib->fd != -1) close(lib->fd);
+	while(lib->symbols != NULL) {
+		struct lddl_symbol *sym = lib->symbols;
+		lib->symbols = sym->next;
+		free(sym->name);
+		free(sym);
+	}
+	free(lib->path);
+	free(lib);
+}
+
+//Must hold the lock. Closes every library nobody holds.
+static void lddl_sweep() {
+	struct lddl_library **plib = &lddl_libraries;
+	while(*plib != NULL) {
+		struct lddl_library *lib = *plib;
+		if(lib->refs == 0) {
+			*plib = lib->next;
+			lddl_close(lib);
+		} else {
+			plib = &lib->next;
+		}
+	}
+}
+
+//Must hold the lock
+static void lddl_unlink(struct lddl_library *lib) {
+	struct lddl_library **plib = &lddl_libraries;
+	while(*plib != lib) plib = &(*plib)->next;
+	*plib = lib->next;
+	lddl_close(lib);
+}
+
+//Returns a reference to the library, opening it if need be, along
+//with the named entry point. Returns NULL and sets *err on failure.
+static struct lddl_library *lddl_acquire(
+ const char *path,
+ const char *symbol,
+ lua_CFunction *func,
+ const char **err) {
+	struct stat st;
+	if(stat(path, &st) != 0) {
+		*err = "Unable to open shared obj";
+		return NULL;
+	}
+
+	pthread_mutex_lock(&lddl_lock);
+
+	struct lddl_library *lib;
+	for(lib=lddl_libraries;lib!=NULL;lib=lib->next) {
+		if(!lib->stale && lib->dev == st.st_dev && lib->ino == st.st_ino)
+			break;
+	}
+
+	if(lib == NULL) {
+		void *hndl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+		if(hndl == NULL) {
+			pthread_mutex_unlock(&lddl_lock);
+			*err = "Unable to open shared obj";
+			return NULL;
+		}
+
+		lib = (struct lddl_library *)malloc(sizeof(struct lddl_library));
+		assert(lib != NULL);
+		lib->path = strdup(path);
+		lib->dev = st.st_dev;
+		lib->ino = st.st_ino;
+		lib->stale = 0;
+		lib->fd = -1;
+		lib->hndl = hndl;
+		lib->refs = 0;
+		lib->symbols = NULL;
+		lib->next = lddl_libraries;
+		lddl_libraries = lib;
+	}
+
+	struct lddl_symbol *sym;
+	for(sym=lib->symbols;sym!=NULL;sym=sym->next) {
+		if(strcmp(sym->name, symbol) == 0) break;
+	}
+
+	if(sym == NULL) {
+		void *p = dlsym(lib->hndl, symbol);
+		if(p == NULL) {
+			if(lddl_policy == LDDL_UNLOAD) lddl_sweep();
+			pthread_mutex_unlock(&lddl_lock);
+			*err = "Unable to find symbol";
+			return NULL;
+		}
+
+		sym = (struct lddl_symbol *)malloc(sizeof(struct lddl_symbol));
+		assert(sym != NULL);
+		sym->name = strdup(symbol);
+		sym->func = (lua_CFunction)p;
+		sym->next = lib->symbols;
+		lib->symbols = sym;
+	}
+
+	++lib->refs;
+	*func = sym->func;
+	pthread_mutex_unlock(&lddl_lock);
+	return lib;
+}
+
+static void lddl_release(struct lddl_library *lib) {
+	pthread_mutex_lock(&lddl_lock);
+	--lib->refs;
+	if(lib->refs == 0) {
+		if(lddl_policy == LDDL_UNLOAD) lddl_sweep();
+		else if(lib->stale) lddl_unlink(lib);
+	}
+	pthread_mutex_unlock(&lddl_lock);
+}
+
+//Takes over closing a memfd. The library opened from it can't be opened
+//again, so is closed once nobody holds it whatever the policy, and the
+//fd with it, keeping the fd number from being reused until then.
+static void lddl_closefd(int fd) {
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		close(fd);
+		return;
+	}
+
+	pthread_mutex_lock(&lddl_lock);
+	struct lddl_library *lib;
+	for(lib=lddl_libraries;lib!=NULL;lib=lib->next) {
+		if(!lib->stale && lib->dev == st.st_dev && lib->ino == st.st_ino)
+			break;
+	}
+
+	if(lib == NULL) {
+		close(fd);
+	} else {
+		lib->stale = 1;
+		lib->fd = fd;
+		if(lib->refs == 0) lddl_unlink(lib);
+	}
+	pthread_mutex_unlock(&lddl_lock);
+}
+
+static int lddl_mtgc(lua_State *l) {
+	lua_settop(l, 1);
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+
+	//NULL if it never got the reference
+	struct lddl_library *lib = *(struct lddl_library **)lua_touserdata(l, 1);
+	if(lib != NULL) lddl_release(lib);
+	return 0;
+}
+
+//Run protected by lddl_hold, with the library as argument 1
+static int lddl_holdp(lua_State *l) {
+	struct lddl_library *lib = (struct lddl_library *)lua_touserdata(l, 1);
+
+	lua_rawgetp(l, LUA_REGISTRYINDEX, (void *)lddl_holdp);
+	if(lua_type(l, -1) == LUA_TNIL) {
+		lua_pop(l, 1);
+		lua_newtable(l);
+
+		lua_pushvalue(l, -1);
+		lua_rawsetp(l, LUA_REGISTRYINDEX, (void *)lddl_holdp);
+	}
+	assert(lua_type(l, -1) == LUA_TTABLE);
+
+	lua_rawgetp(l, -1, lib);
+	if(lua_type(l, -1) != LUA_TNIL) {
+		lddl_release(lib);
+		return 0;
+	}
+	lua_pop(l, 1);
+
+	struct lddl_library **plib = (struct lddl_library **)
+	 lua_newuserdata(l, sizeof(struct lddl_library *));
+	*plib = NULL;
+
+	lua_rawgetp(l, LUA_REGISTRYINDEX, (void *)lddl_mtgc);
+	if(lua_type(l, -1) == LUA_TNIL) {
+		lua_pop(l, 1);
+		lua_newtable(l);
+
+		lua_pushcfunction(l, lddl_mtgc);
+		lua_setfield(l, -2, "__gc");
+
+		lua_pushvalue(l, -1);
+		lua_rawsetp(l, LUA_REGISTRYINDEX, (void *)lddl_mtgc);
+	}
+	assert(lua_type(l, -1) == LUA_TTABLE);
+	lua_setmetatable(l, -2);
+
+	lua_pushvalue(l, -1);
+	lua_rawsetp(l, -3, lib);
+	*plib = lib;
+	return 0;
+}
+
+//Makes the state hold lib until it is closed, taking over the
+//reference. A state only ever holds one reference to a library. If
+//that can't be done the reference is dropped and the error raised.
+static void lddl_hold(lua_State *l, struct lddl_library *lib) {
+	lua_pushcfunction(l, lddl_holdp);
+	lua_pushlightuserdata(l, lib);
+	if(lua_pcall(l, 1, 0, 0) != LUA_OK) {
+		lddl_release(lib);
+		lua_error(l);
+	}
+}
+
+//luadeploy.setUnloadPolicy("keep" | "unload")
+static int lddl_setpolicy(lua_State *l) {
+	static const char *policies[] = {"keep", "unload", NULL};
+	int policy = luaL_checkoption(l, 1, NULL, policies);
+
+	pthread_mutex_lock(&lddl_lock);
+	lddl_policy = policy;
+	if(lddl_policy == LDDL_UNLOAD) lddl_sweep();
+	pthread_mutex_unlock(&lddl_lock);
+	return 0;
+}
+
+//luadeploy.unloadSharedObjs() closes every library no state holds,
+//whatever the policy
+static int lddl_unloadunused(lua_State *l) {
+	pthread_mutex_lock(&lddl_lock);
+	lddl_sweep();
+	pthread_mutex_unlock(&lddl_lock);
+	return 0;
+}
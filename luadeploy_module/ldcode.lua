@@ -51,13 +51,25 @@ do
 	end
 end
 
-function module.startServer(sname, software, db, path)
-	local rv = int_module.createServer(sname, software, db, tostring(path))
+function module.startServer(sname, software, db, path, workers, transport)
+	local rv = int_module.createServer(sname, software, db, tostring(path),
+	 workers, transport)
 	rv:start()
 	return rv
 end
 
 module.newState = int_module.newState
+module.setStatePoolSize = int_module.setStatePoolSize
+module.statePoolStats = int_module.statePoolStats
+module.setRunThreads = int_module.setRunThreads
+module.runPoolStats = int_module.runPoolStats
+module.buffer = int_module.buffer
+module.channel = int_module.channel
+module.sharedStore = int_module.sharedStore
+module.loadSharedStore = int_module.loadSharedStore
+module.dumpSharedStore = int_module.dumpSharedStore
+module.setUnloadPolicy = int_module.setUnloadPolicy
+module.unloadSharedObjs = int_module.unloadSharedObjs
 
 do
 	local s = int_module.newState({})
@@ -65,12 +77,12 @@ do
 
 	function m:runCode(code)
 		self:pushCode(code)
-		self:run()
+		self:run(0)
 	end
 
 	function m:runSearch(server, codetype, request)
 		self:pushSearch(server, codetype, request)
-		self:run()
+		self:run(0)
 	end
 end
 
@@ -80,4 +92,24 @@ function module.newSearcher(servername, datatype)
 	end
 end
 
+module.sendRequests = int_module.sendRequests
+module.sendRequestAsync = int_module.sendRequestAsync
+
+--Like newSearcher, but inside a coroutine the search yields the
+--request handle until the server has responded, so a scheduler can
+--keep several searches in flight. Resuming before h:poll() is true
+--just yields again. Where yielding isn't possible, e.g. under
+--require, it blocks like newSearcher.
+function module.newAsyncSearcher(servername, datatype)
+	return function(x)
+		local h = int_module.sendRequestAsync(servername, datatype, x)
+		while not h:poll() do
+			if not pcall(coroutine.yield, h) then
+				break
+			end
+		end
+		return h:result()
+	end
+end
+
 return module
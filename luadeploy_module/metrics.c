@@ -0,0 +1,185 @@
+/******************************************************************************
+* Copyright (C) 2014, Kevin Martin (kev82@khn.org.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+//Latency histograms for a server, one per request stage and type.
+//
+//Every histogram is an array of counters updated with relaxed atomic
+//adds, so recording never takes a lock and stats() can read them while
+//the workers are running. Buckets are log-linear: each power of two of
+//nanoseconds is split into four, so a percentile is accurate to within
+//25%.
+//
+//The struct is refcounted because the client reports the last two
+//stages after the server may have gone.
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LDMETRICS_QUEUE 0	//sent until a worker picked it up
+#define LDMETRICS_SEARCH 1	//ld_loader_search
+#define LDMETRICS_FETCH 2	//getting the object ready for the response
+#define LDMETRICS_SERVE 3	//picked up until the response was posted
+#define LDMETRICS_LOAD 4	//the response handler, lua_load or dlopen
+#define LDMETRICS_TOTAL 5	//what the client saw, send to loaded
+#define LDMETRICS_STAGES 6
+
+#define LDMETRICS_TYPES 4	//module, cmd, luadeploy and anything else
+
+#define LDMETRICS_BUCKETS 256
+
+static const char *ldmetrics_stagenames[LDMETRICS_STAGES] = {
+ "queue", "search", "fetch", "serve", "load", "total"
+};
+
+static const char *ldmetrics_typenames[LDMETRICS_TYPES] = {
+ "module", "cmd", "luadeploy", "other"
+};
+
+struct ldmetrics
+{
+	int refs;
+	int inflight;	//requests the workers are serving
+	long long counts[LDMETRICS_STAGES][LDMETRICS_TYPES][LDMETRICS_BUCKETS];
+	struct ldtrace trace;
+};
+
+static struct ldmetrics *ldmetrics_create() {
+	struct ldmetrics *m = (struct ldmetrics *)calloc(1,
+	 sizeof(struct ldmetrics));
+	assert(m != NULL);
+	m->refs = 1;
+	return m;
+}
+
+static void ldmetrics_release(struct ldmetrics *m) {
+	if(__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(m);
+	}
+}
+
+static int ldmetrics_typeindex(const char *type) {
+	int i;
+	for(i=0;i<LDMETRICS_TYPES-1;++i) {
+		if(strcmp(type, ldmetrics_typenames[i]) == 0) return i;
+	}
+	return LDMETRICS_TYPES-1;
+}
+
+static int ldmetrics_bucket(long long ns) {
+	if(ns < 4) return ns < 0 ? 0 : (int)ns;
+	int e = 63 - __builtin_clzll((unsigned long long)ns);
+	return (e-1)*4 + (int)((ns >> (e-2)) & 3);
+}
+
+//the largest value that lands in the bucket
+static long long ldmetrics_bucketmax(int bucket) {
+	if(bucket < 4) return bucket;
+	int e = bucket/4 + 1;
+	return ((long long)(5 + bucket%4) << (e-2)) - 1;
+}
+
+static void ldmetrics_record(
+ struct ldmetrics *m,
+ int stage,
+ int type,
+ long long ns) {
+	__atomic_add_fetch(&m->counts[stage][type][ldmetrics_bucket(ns)], 1,
+	 __ATOMIC_RELAXED);
+}
+
+//Given to the client with every response, see msg.h
+static void ldmetrics_timing(
+ struct ldloader_request *req,
+ long long loadns,
+ long long totalns) {
+	struct ldmetrics *m = (struct ldmetrics *)req->timingData;
+	int t = ldmetrics_typeindex(req->type);
+	if(loadns >= 0) ldmetrics_record(m, LDMETRICS_LOAD, t, loadns);
+	if(totalns >= 0) ldmetrics_record(m, LDMETRICS_TOTAL, t, totalns);
+	if(req->traceid != 0) {
+		ldtrace_report(&m->trace, req->traceid-1, loadns, totalns);
+	}
+	ldmetrics_release(m);
+}
+
+//Pushes { count=, p50=, p90=, p99= } with the percentiles in seconds
+static void ldmetrics_pushhistogram(lua_State *l, const long long *counts) {
+	long long snapshot[LDMETRICS_BUCKETS];
+	long long total = 0;
+	int i;
+	for(i=0;i<LDMETRICS_BUCKETS;++i) {
+		snapshot[i] = __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+		total += snapshot[i];
+	}
+
+	lua_createtable(l, 0, 4);
+	lua_pushnumber(l, total);
+	lua_setfield(l, -2, "count");
+
+	static const struct { const char *name; int percent; } pcts[] = {
+	 {"p50", 50}, {"p90", 90}, {"p99", 99}
+	};
+
+	int p;
+	for(p=0;p<3;++p) {
+		//the rank of the sample we want, counting from 1
+		long long rank = (total * pcts[p].percent + 99) / 100;
+		if(rank == 0) rank = 1;
+
+		long long seen = 0;
+		for(i=0;i<LDMETRICS_BUCKETS-1;++i) {
+			seen += snapshot[i];
+			if(seen >= rank) break;
+		}
+
+		lua_pushnumber(l, total == 0 ? 0 : ldmetrics_bucketmax(i) / 1e9);
+		lua_setfield(l, -2, pcts[p].name);
+	}
+}
+
+//Pushes { stage = { type = histogram } }, leaving out types that
+//have never been seen
+static void ldmetrics_push(lua_State *l, struct ldmetrics *m) {
+	lua_createtable(l, 0, LDMETRICS_STAGES);
+
+	int stage, type;
+	for(stage=0;stage<LDMETRICS_STAGES;++stage) {
+		lua_newtable(l);
+		for(type=0;type<LDMETRICS_TYPES;++type) {
+			ldmetrics_pushhistogram(l, m->counts[stage][type]);
+			lua_getfield(l, -1, "count");
+			int seen = lua_tonumber(l, -1) != 0;
+			lua_pop(l, 1);
+
+			if(seen) {
+				lua_setfield(l, -2, ldmetrics_typenames[type]);
+			} else {
+				lua_pop(l, 1);
+			}
+		}
+		lua_setfield(l, -2, ldmetrics_stagenames[stage]);
+	}
+}
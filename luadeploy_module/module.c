@@ -43,6 +43,12 @@ int luaopen_luadeploy(lua_State *l) {
 	lua_pushcfunction(l, ldclient_request);
 	lua_setfield(l, -2, "sendRequest");
 
+	lua_pushcfunction(l, ldclient_requestmany);
+	lua_setfield(l, -2, "sendRequests");
+
+	lua_pushcfunction(l, ldclient_requestasync);
+	lua_setfield(l, -2, "sendRequestAsync");
+
 	lua_pushcfunction(l, lddb_createFromSQLString);
 	lua_setfield(l, -2, "openSQLString");
 
@@ -55,6 +61,39 @@ int luaopen_luadeploy(lua_State *l) {
 	lua_pushcfunction(l, ldstate_create);
 	lua_setfield(l, -2, "newState");
 
+	lua_pushcfunction(l, ldstate_setpoolsize);
+	lua_setfield(l, -2, "setStatePoolSize");
+
+	lua_pushcfunction(l, ldstate_getpoolstats);
+	lua_setfield(l, -2, "statePoolStats");
+
+	lua_pushcfunction(l, ldrun_setthreadcount);
+	lua_setfield(l, -2, "setRunThreads");
+
+	lua_pushcfunction(l, ldrun_getstats);
+	lua_setfield(l, -2, "runPoolStats");
+
+	lua_pushcfunction(l, ldbuffer_create);
+	lua_setfield(l, -2, "buffer");
+
+	lua_pushcfunction(l, ldchannel_create);
+	lua_setfield(l, -2, "channel");
+
+	lua_pushcfunction(l, ldstore_build);
+	lua_setfield(l, -2, "sharedStore");
+
+	lua_pushcfunction(l, ldstore_loadstring);
+	lua_setfield(l, -2, "loadSharedStore");
+
+	lua_pushcfunction(l, ldstore_dump);
+	lua_setfield(l, -2, "dumpSharedStore");
+
+	lua_pushcfunction(l, lddl_setpolicy);
+	lua_setfield(l, -2, "setUnloadPolicy");
+
+	lua_pushcfunction(l, lddl_unloadunused);
+	lua_setfield(l, -2, "unloadSharedObjs");
+
 	lua_call(l, 1, 1);
 	return 1;
 }
@@ -24,31 +24,58 @@
 #include <semaphore.h>
 #include <lua.h>
 
+//One name in a batch request
+struct ldloader_response
+{
+	const char *name;
+
+	int (*responseHandler)(lua_State *l);
+	void *responseData;
+};
+
 struct ldloader_request
 {
 	//server posts when request finished
 	sem_t sem;
 
 	//Request information
-	char *type;
-	char *name;
+	const char *type;
+	const char *name;
+
+	//A batch request sets name to NULL and gives count names here
+	//instead, each gets its own response
+	int count;
+	struct ldloader_response *batch;
 
 	//Response
 	int (*responseHandler)(lua_State *l);
 	void *responseData;
+
+	//CLOCK_MONOTONIC nanoseconds when the client sent it
+	long long sent;
+
+	//Set by the server along with the response. Once the client has
+	//called the response handler(s) it reports how long that took and
+	//the whole round trip, in ns, negative if it doesn't know. This
+	//also frees timingData, so it must be called exactly once.
+	void (*timingHandler)(struct ldloader_request *req,
+	 long long loadns, long long totalns);
+	void *timingData;
+	unsigned long long traceid;	//the server's trace event plus one, or 0
 };
 
 //The client should
 //
-//o open the msg queue
-//o Allocate the struct
+//o put the struct somewhere that outlives the request (the stack will do)
 //o Initialize the semaphore
-//o strdup the name and type and fill it in
-//o post the message
+//o fill in the name (or batch) and type, they must stay valid until
+//  the response
+//o push it on the server's in process queue, or if the server isn't
+//  registered in this process, post it to the msg queue
 //o wait on the semaphore
 //o destroy the semaphore
-//o free the type and name
 //o push the function
 //o push the data
-//o free the struct
-//o call the function (it frees it's own data)
+//o call the function (it frees it's own data), for a batch call every
+//  entry's function even if an earlier one errors
+//o call the timing handler, if there is one, even if the function errored
@@ -0,0 +1,215 @@
+/******************************************************************************
+* Copyright (C) 2014, Kevin Martin (kev82@khn.org.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+//In process transport between clients and a server's workers.
+//
+//Servers register a queue under their name in a process wide registry
+//and clients find it there instead of opening a message queue. The
+//queue is a bounded lock free ring (Vyukov's MPMC design) of request
+//pointers. Every push adds one to an eventfd in semaphore mode, so a
+//worker that reads a token from it knows a request has been pushed.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define LDQUEUE_SLOTS 256	//a power of two
+
+struct ldqueue_slot
+{
+	size_t seq;
+	struct ldloader_request *req;
+};
+
+struct ldqueue
+{
+	//registry, protected by ldqueue_registrylock
+	struct ldqueue *next;
+	char *name;
+	int refs;
+
+	int event_fd;
+
+	struct ldqueue_slot slots[LDQUEUE_SLOTS];
+
+	//kept on their own cache lines, producers and consumers hammer them
+	size_t head __attribute__((aligned(64)));
+	size_t tail __attribute__((aligned(64)));
+};
+
+static pthread_mutex_t ldqueue_registrylock = PTHREAD_MUTEX_INITIALIZER;
+static struct ldqueue *ldqueue_registry = NULL;
+
+static struct ldqueue *ldqueue_find(const char *name) {
+	struct ldqueue *q;
+	for(q=ldqueue_registry;q!=NULL;q=q->next) {
+		if(strcmp(q->name, name) == 0) return q;
+	}
+	return NULL;
+}
+
+//Creates and registers a queue, the caller holds the only reference.
+//Returns NULL if the name is taken.
+static struct ldqueue *ldqueue_create(const char *name) {
+	struct ldqueue *q = NULL;
+	if(posix_memalign((void **)&q, 64, sizeof(struct ldqueue)) != 0) {
+		return NULL;
+	}
+
+	q->event_fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+	if(q->event_fd == -1) {
+		free(q);
+		return NULL;
+	}
+
+	size_t i;
+	for(i=0;i<LDQUEUE_SLOTS;++i) {
+		q->slots[i].seq = i;
+		q->slots[i].req = NULL;
+	}
+	q->head = 0;
+	q->tail = 0;
+	q->refs = 1;
+	q->name = strdup(name);
+
+	pthread_mutex_lock(&ldqueue_registrylock);
+	if(ldqueue_find(name) != NULL) {
+		pthread_mutex_unlock(&ldqueue_registrylock);
+		close(q->event_fd);
+		free(q->name);
+		free(q);
+		return NULL;
+	}
+	q->next = ldqueue_registry;
+	ldqueue_registry = q;
+	pthread_mutex_unlock(&ldqueue_registrylock);
+
+	return q;
+}
+
+//Returns a reference to the named queue, or NULL if there isn't one
+static struct ldqueue *ldqueue_acquire(const char *name) {
+	pthread_mutex_lock(&ldqueue_registrylock);
+	struct ldqueue *q = ldqueue_find(name);
+	if(q != NULL) ++q->refs;
+	pthread_mutex_unlock(&ldqueue_registrylock);
+	return q;
+}
+
+static void ldqueue_release(struct ldqueue *q) {
+	pthread_mutex_lock(&ldqueue_registrylock);
+	int refs = --q->refs;
+	pthread_mutex_unlock(&ldqueue_registrylock);
+
+	if(refs != 0) return;
+
+	close(q->event_fd);
+	free(q->name);
+	free(q);
+}
+
+//Takes the queue out of the registry and drops the creator's
+//reference. Clients that already have it keep it until they release.
+static void ldqueue_unregister(struct ldqueue *q) {
+	pthread_mutex_lock(&ldqueue_registrylock);
+	struct ldqueue **p = &ldqueue_registry;
+	while(*p != q) p = &(*p)->next;
+	*p = q->next;
+	pthread_mutex_unlock(&ldqueue_registrylock);
+
+	ldqueue_release(q);
+}
+
+static int ldqueue_trypush(struct ldqueue *q, struct ldloader_request *req) {
+	size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	struct ldqueue_slot *slot;
+
+	while(1) {
+		slot = &q->slots[pos & (LDQUEUE_SLOTS-1)];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&q->tail, &pos, pos+1, 1,
+			 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		} else if(diff < 0) {
+			return 0;	//full
+		} else {
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->req = req;
+	__atomic_store_n(&slot->seq, pos+1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static void ldqueue_push(struct ldqueue *q, struct ldloader_request *req) {
+	//a full queue means the workers are behind, let them run
+	while(!ldqueue_trypush(q, req)) sched_yield();
+
+	uint64_t one = 1;
+	while(write(q->event_fd, &one, sizeof(uint64_t)) == -1) sched_yield();
+}
+
+//Returns NULL if no request has finished being pushed
+static struct ldloader_request *ldqueue_trypop(struct ldqueue *q) {
+	size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	struct ldqueue_slot *slot;
+
+	while(1) {
+		slot = &q->slots[pos & (LDQUEUE_SLOTS-1)];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos+1);
+
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&q->head, &pos, pos+1, 1,
+			 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		} else if(diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	struct ldloader_request *req = slot->req;
+	__atomic_store_n(&slot->seq, pos+LDQUEUE_SLOTS, __ATOMIC_RELEASE);
+	return req;
+}
+
+//Takes one request if the eventfd has a token for us. Returns NULL
+//if another worker got there first.
+static struct ldloader_request *ldqueue_pop(struct ldqueue *q) {
+	uint64_t token;
+	if(read(q->event_fd, &token, sizeof(uint64_t)) == -1) return NULL;
+
+	//The token means a push finished, but an earlier slot may still be
+	//being filled by a slower producer, so this can't spin for long.
+	struct ldloader_request *req;
+	while((req = ldqueue_trypop(q)) == NULL) sched_yield();
+	return req;
+}
@@ -0,0 +1,295 @@
+/******************************************************************************
+* Copyright (C) 2014, Kevin Martin (kev82@khn.org.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+//A process wide pool of threads that states are run on by runAsync.
+//
+//Every worker has its own deque of jobs. A worker pushes the jobs it
+//submits, and pops the next one to run, at the front of its own deque,
+//and steals from the back of the others' when its own is empty. Jobs
+//submitted from outside the pool are dealt out round robin. Each deque
+//has its own lock, a job is a whole run of a state so there's nothing
+//to gain from making them lock free.
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+#define LDRUN_MAXTHREADS 64
+
+struct ldrun_job
+{
+	struct ldrun_job *prev;
+	struct ldrun_job *next;
+	void (*run)(struct ldrun_job *job);
+};
+
+struct ldrun_worker
+{
+	pthread_mutex_t lock;
+	struct ldrun_job *front;
+	struct ldrun_job *back;
+	int alive;	//protected by ldrun_lock
+} __attribute__((aligned(64)));
+
+static struct ldrun_worker ldrun_workers[LDRUN_MAXTHREADS];
+static pthread_once_t ldrun_once = PTHREAD_ONCE_INIT;
+
+//protects the thread counts, and is what idle workers sleep on
+static pthread_mutex_t ldrun_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ldrun_wake = PTHREAD_COND_INITIALIZER;
+static int ldrun_nthreads = 0;	//how many there should be, 0 until first use
+static int ldrun_sleeping = 0;
+
+static int ldrun_queued = 0;	//submitted and not yet taken, atomic
+static unsigned ldrun_deal = 0;	//where the next outside job goes, atomic
+static long long ldrun_nrun = 0;	//atomic
+static long long ldrun_nstolen = 0;	//atomic
+
+static __thread int ldrun_self = -1;	//the worker this thread is
+
+static void ldrun_init() {
+	int i;
+	for(i=0;i<LDRUN_MAXTHREADS;++i) {
+		pthread_mutex_init(&ldrun_workers[i].lock, NULL);
+	}
+}
+
+//Threads started here never stop, so this library mustn't be unloaded
+//when the lua state that required it closes
+static int ldrun_pinlibrary() {
+	static int pinned = 0;
+	if(!__atomic_load_n(&pinned, __ATOMIC_ACQUIRE)) {
+		Dl_info info;
+		if(dladdr((void *)ldrun_pinlibrary, &info) == 0 ||
+		 dlopen(info.dli_fname, RTLD_NOW | RTLD_NODELETE) == NULL) {
+			return 0;
+		}
+		__atomic_store_n(&pinned, 1, __ATOMIC_RELEASE);
+	}
+	return 1;
+}
+
+static void ldrun_pushfront(struct ldrun_worker *w, struct ldrun_job *job) {
+	pthread_mutex_lock(&w->lock);
+	job->prev = NULL;
+	job->next = w->front;
+	if(w->front != NULL) w->front->prev = job;
+	else w->back = job;
+	w->front = job;
+	pthread_mutex_unlock(&w->lock);
+}
+
+static struct ldrun_job *ldrun_popfront(struct ldrun_worker *w) {
+	pthread_mutex_lock(&w->lock);
+	struct ldrun_job *job = w->front;
+	if(job != NULL) {
+		w->front = job->next;
+		if(w->front != NULL) w->front->prev = NULL;
+		else w->back = NULL;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return job;
+}
+
+static struct ldrun_job *ldrun_popback(struct ldrun_worker *w) {
+	//not worth taking the lock to find there's nothing there
+	if(__atomic_load_n(&w->back, __ATOMIC_RELAXED) == NULL) return NULL;
+
+	pthread_mutex_lock(&w->lock);
+	struct ldrun_job *job = w->back;
+	if(job != NULL) {
+		w->back = job->prev;
+		if(w->back != NULL) w->back->next = NULL;
+		else w->front = NULL;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return job;
+}
+
+//Takes a job for worker self, its own if it has one, else a steal
+static struct ldrun_job *ldrun_take(int self) {
+	struct ldrun_job *job = ldrun_popfront(&ldrun_workers[self]);
+	if(job == NULL) {
+		int i;
+		for(i=1;i<LDRUN_MAXTHREADS && job==NULL;++i) {
+			job = ldrun_popback(&ldrun_workers[(self + i) % LDRUN_MAXTHREADS]);
+		}
+		if(job == NULL) return NULL;
+		__atomic_add_fetch(&ldrun_nstolen, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_sub_fetch(&ldrun_queued, 1, __ATOMIC_RELAXED);
+	return job;
+}
+
+static void ldrun_execute(struct ldrun_job *job) {
+	__atomic_add_fetch(&ldrun_nrun, 1, __ATOMIC_RELAXED);
+	job->run(job);
+}
+
+static void *ldrun_worker(void *p) {
+	int self = (int)(intptr_t)p;
+	ldrun_self = self;
+
+	pthread_mutex_lock(&ldrun_lock);
+	for(;;) {
+		pthread_mutex_unlock(&ldrun_lock);
+		struct ldrun_job *job = ldrun_take(self);
+		if(job != NULL) {
+			ldrun_execute(job);
+			pthread_mutex_lock(&ldrun_lock);
+			continue;
+		}
+		pthread_mutex_lock(&ldrun_lock);
+
+		//Nothing is dealt to a worker past the thread count, and it
+		//takes its own jobs first, so it has none left when it gets here
+		if(self >= ldrun_nthreads) break;
+
+		if(__atomic_load_n(&ldrun_queued, __ATOMIC_RELAXED) == 0) {
+			++ldrun_sleeping;
+			pthread_cond_wait(&ldrun_wake, &ldrun_lock);
+			--ldrun_sleeping;
+		}
+	}
+	ldrun_workers[self].alive = 0;
+	pthread_mutex_unlock(&ldrun_lock);
+	return NULL;
+}
+
+//Must hold ldrun_lock. Starts workers up to the thread count, returns
+//0 if none could be started.
+static int ldrun_startworkers() {
+	int i;
+	for(i=0;i<ldrun_nthreads;++i) {
+		if(ldrun_workers[i].alive) continue;
+
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, ldrun_worker,
+		 (void *)(intptr_t)i) != 0) {
+			break;
+		}
+		pthread_detach(thread);
+		ldrun_workers[i].alive = 1;
+	}
+	return ldrun_workers[0].alive;
+}
+
+//Sets the number of workers, those past it finish what they've been
+//given and stop. Returns 0 if the pool couldn't be started.
+static int ldrun_setthreads(int n) {
+	assert(n > 0 && n <= LDRUN_MAXTHREADS);
+	pthread_once(&ldrun_once, ldrun_init);
+	if(!ldrun_pinlibrary()) return 0;
+
+	pthread_mutex_lock(&ldrun_lock);
+	ldrun_nthreads = n;
+	int rc = ldrun_startworkers();
+	pthread_mutex_unlock(&ldrun_lock);
+
+	//so any past the count notice
+	pthread_cond_broadcast(&ldrun_wake);
+	return rc;
+}
+
+//Queues a job, starting the pool with a thread per cpu if it hasn't
+//been. Returns 0 if there's no pool to run it.
+static int ldrun_submit(struct ldrun_job *job) {
+	pthread_once(&ldrun_once, ldrun_init);
+
+	pthread_mutex_lock(&ldrun_lock);
+	int n = ldrun_nthreads;
+	pthread_mutex_unlock(&ldrun_lock);
+	if(n == 0) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if(ncpus < 1) ncpus = 1;
+		if(ncpus > LDRUN_MAXTHREADS) ncpus = LDRUN_MAXTHREADS;
+		if(!ldrun_setthreads(ncpus)) return 0;
+		n = ncpus;
+	}
+
+	int self = ldrun_self;
+	if(self < 0 || self >= n) {
+		self = __atomic_fetch_add(&ldrun_deal, 1, __ATOMIC_RELAXED) % n;
+	}
+
+	//counted first so a thief never takes it below zero
+	__atomic_add_fetch(&ldrun_queued, 1, __ATOMIC_RELAXED);
+	ldrun_pushfront(&ldrun_workers[self], job);
+
+	//A worker only sleeps after seeing nothing queued with the lock held,
+	//so with the lock taken here it either sees this job or gets woken
+	pthread_mutex_lock(&ldrun_lock);
+	int wake = ldrun_sleeping != 0;
+	pthread_mutex_unlock(&ldrun_lock);
+	if(wake) pthread_cond_signal(&ldrun_wake);
+	return 1;
+}
+
+//Runs one queued job if there is one and this is a worker, so a worker
+//waiting on a job doesn't tie up a thread. Returns 1 if it ran one.
+static int ldrun_help() {
+	if(ldrun_self < 0) return 0;
+
+	struct ldrun_job *job = ldrun_take(ldrun_self);
+	if(job == NULL) return 0;
+	ldrun_execute(job);
+	return 1;
+}
+
+static int ldrun_setthreadcount(lua_State *l) {
+	int n = luaL_checkint(l, 1);
+	luaL_argcheck(l, n > 0 && n <= LDRUN_MAXTHREADS, 1,
+	 "thread count out of range");
+
+	if(!ldrun_setthreads(n)) {
+		return luaL_error(l, "Unable to start run threads");
+	}
+	return 0;
+}
+
+static int ldrun_getstats(lua_State *l) {
+	pthread_mutex_lock(&ldrun_lock);
+	int threads = ldrun_nthreads;
+	pthread_mutex_unlock(&ldrun_lock);
+
+	lua_newtable(l);
+
+	lua_pushinteger(l, threads);
+	lua_setfield(l, -2, "threads");
+
+	lua_pushinteger(l, __atomic_load_n(&ldrun_queued, __ATOMIC_RELAXED));
+	lua_setfield(l, -2, "queued");
+
+	lua_pushnumber(l, __atomic_load_n(&ldrun_nrun, __ATOMIC_RELAXED));
+	lua_setfield(l, -2, "run");
+
+	lua_pushnumber(l, __atomic_load_n(&ldrun_nstolen, __ATOMIC_RELAXED));
+	lua_setfield(l, -2, "stolen");
+
+	return 1;
+}
@@ -31,247 +31,823 @@
 #include <semaphore.h>
 #include <stdlib.h>
 #include <string.h>
-#include <dlfcn.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+int ldext_init(
+ sqlite3 *db,
+ const char **errmsg,
+ const void *api);
+
+//Written by the server thread, read by stats() on the main thread
+struct ldserver_stats
+{
+	long long prepared;
+	long long reused;
+	long long savedns;
+
+	long long cachehits;
+	long long cachemisses;
+	long long cacheevictions;
+};
+
+#define LDSERVER_CACHESIZE 512
+
+//How a server gets shared objects onto something dlopen can open
+#define LDSERVER_SO_DIR 0	//written to the server's dir
+#define LDSERVER_SO_MEMFD 1	//copied to a sealed memfd
+#define LDSERVER_SO_CACHE 2	//in a content addressed dir, see deploy.c
+
+//The shared objects a server has materialised, shared by its workers.
+//Nothing is materialised until a request first resolves to it, so a
+//command only pays for the objects it uses. writeSharedObjs can still
+//fill a dir in advance, the files it wrote are then used as they are.
+struct ldserver_soentry
+{
+	struct ldserver_soentry *next;
+	char *objref;
+	char *path;
+	int fd;	//-1 unless it is a memfd
+};
+
+struct ldserver_sotable
+{
+	pthread_mutex_t lock;
+	int mode;
+	struct ldserver_soentry *entries;
+	int nentries;
+};
+
+//lua objects bigger than this are streamed rather than cached
+#define LDSERVER_INLINEBYTES 16384
+
+struct ldserver_cacheentry;
+
+//Resolved (type, name) pairs, most recently used first
+struct ldserver_rescache
+{
+	int entries;
+	int nbuckets;	//a power of two
+	struct ldserver_cacheentry **buckets;
+
+	struct ldserver_cacheentry *newest;
+	struct ldserver_cacheentry *oldest;
+
+	//the database state the entries were resolved against
+	sqlite3_stmt *versionstmt;
+	int version;
+	int changes;
+};
 
 struct ldserver_threaddata
 {
 	int piperead_fd;
 	mqd_t queue_fd;
+	struct ldqueue *inq;
 	sqlite3 *db;
+	struct ldserver_conn *conn;	//owns db
 	char *software;
 	char *sopath;
+
+	//prepared on first use, reset after every request
+	sqlite3_stmt *searchstmt;
+	sqlite3_stmt *getrowidstmt;
+	sqlite3_stmt *beginstmt;
+	sqlite3_stmt *commitstmt;
+	sqlite3_stmt *extractstmt;
+	long long searchns;
+	long long getrowidns;
+	long long beginns;
+	long long commitns;
+	long long extractns;
+
+	struct ldserver_rescache cache;
+	//set when the response is an I/O or resource failure, which may not
+	//happen next time, so mustn't be cached
+	int nocache;
+	struct ldserver_stats *stats;
+	struct ldserver_sotable *sotable;
+	struct ldmetrics *metrics;
+
+	int worker;
+	struct ldtrace_event event;	//the request being served
 };
 
 struct ldserver_userdata
 {
 	int pipewrite_fd;
+	int piperead_fd;	//shared by all the workers
 	mqd_t queue_fd;
 	char *queue_name;
+	struct ldqueue *inq;	//NULL if using the msg queue
+	int nworkers;
+
+	struct ldserver_stats stats;
+	struct ldserver_sotable sotable;
+	struct ldmetrics *metrics;
 };
 
+static long long ldserver_nanotime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//Prepares sql into *stmt the first time, then hands back the same
+//statement, counting what the prepare would have cost
+static sqlite3_stmt *ldserver_cachedstmt(
+ struct ldserver_threaddata *td,
+ sqlite3_stmt **stmt,
+ long long *preparens,
+ const char *sql) {
+	if(*stmt != NULL) {
+		__atomic_add_fetch(&td->stats->reused, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&td->stats->savedns, *preparens,
+		 __ATOMIC_RELAXED);
+		return *stmt;
+	}
+
+	long long start = ldserver_nanotime();
+	int rc = sqlite3_prepare_v2(td->db, sql, -1, stmt, NULL);
+	assert(rc == SQLITE_OK && *stmt != NULL);
+	*preparens = ldserver_nanotime() - start;
+
+	__atomic_add_fetch(&td->stats->prepared, 1, __ATOMIC_RELAXED);
+	return *stmt;
+}
+
 static int ldresponse_error(lua_State *l) {
 	lua_settop(l, 1);
 	char *err = lua_touserdata(l, 1);
 	lua_pushstring(l, err);
+	free(err);
 	return lua_error(l);
 }
 
+//A worker's connection. Responses for lua code stream the bytecode
+//out of it on the client's thread, so it stays open until the worker
+//and every response using it are done with it.
+struct ldserver_conn
+{
+	int refs;
+	sqlite3 *db;
+};
+
+static struct ldserver_conn *ldserver_conncreate(sqlite3 *db) {
+	struct ldserver_conn *conn =
+	 (struct ldserver_conn *)malloc(sizeof(struct ldserver_conn));
+	assert(conn != NULL);
+	conn->refs = 1;
+	conn->db = db;
+	return conn;
+}
+
+static void ldserver_connrelease(struct ldserver_conn *conn) {
+	if(__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		sqlite3_close(conn->db);
+		free(conn);
+	}
+}
+
+//What the server hands to the client when a search succeeds. The
+//search result and the object are stored straight after the struct.
+//It is shared between the client and the resolution cache, whoever
+//drops the last reference frees the lot with one call.
+struct ldresponse_obj
+{
+	int refs;
+	const struct ldsearch_result *search;
+	//bytecode, the obj table for streamed lua code, or the path of the so
+	const char *obj;
+	size_t objbytes;
+	size_t bytes;	//what the client loads, 0 for a so
+
+	//where streamed lua code is, otherwise NULL
+	struct ldserver_conn *conn;
+	sqlite3_int64 rowid;
+};
+
+static struct ldresponse_obj *ldresponse_objcreate(
+ const void *search,
+ const void *obj,
+ size_t objbytes) {
+	size_t searchbytes = ((const struct ldsearch_result *)search)->bytes;
+
+	struct ldresponse_obj *r = (struct ldresponse_obj *)malloc(
+	 sizeof(struct ldresponse_obj) + searchbytes + objbytes + 1);
+	assert(r != NULL);
+
+	char *data = (char *)(r + 1);
+	memcpy(data, search, searchbytes);
+	if(obj != NULL) memcpy(data + searchbytes, obj, objbytes);
+	data[searchbytes + objbytes] = 0;
+
+	r->refs = 1;
+	r->search = (const struct ldsearch_result *)data;
+	r->obj = data + searchbytes;
+	r->objbytes = objbytes;
+	r->bytes = objbytes;
+	r->conn = NULL;
+	r->rowid = 0;
+	return r;
+}
+
+static void ldresponse_objrelease(struct ldresponse_obj *r) {
+	if(__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		if(r->conn != NULL) ldserver_connrelease(r->conn);
+		free(r);
+	}
+}
+
+static int ldresponse_pushargs(
+ lua_State *l,
+ const struct ldsearch_result *search) {
+	const char *request = ldsearch_string(search, search->request);
+
+	int idx;
+	for(idx=0;idx<search->nargs;++idx) {
+		lua_pushlstring(l, request + search->args[idx].offset,
+		 search->args[idx].length);
+	}
+	return search->nargs;
+}
+
 /*
 //Don't remove, useful for debugging
 //Commented out to disable unused function warning
-static int ldresponse_dumpstate(lua_State *l) {
+static int ldresponse_dumpsearch(lua_State *l) {
 	lua_settop(l, 1);
-	lua_State *s = (lua_State *)lua_touserdata(l, 1);
-	lua_settop(s, 0);
-
-	lua_rawgeti(s, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
-	lua_pushnil(s);
-	while(lua_next(s, 1) != 0) {
-		fprintf(stderr, "searchdef has key %s\n", lua_tostring(s, -2));
-		if(lua_type(s, -1) == LUA_TSTRING) {
-			fprintf(stderr, "with value %s\n", lua_tostring(s, -1));
-		}
-		lua_pop(s, 1);
+	struct ldresponse_obj *r = (struct ldresponse_obj *)lua_touserdata(l, 1);
+
+	fprintf(stderr, "search has loader %d\n", r->search->loader);
+	fprintf(stderr, "search has objref %s\n",
+	 ldsearch_string(r->search, r->search->objref));
+	if(r->search->entrypoint != 0) {
+		fprintf(stderr, "search has entrypoint %s\n",
+		 ldsearch_string(r->search, r->search->entrypoint));
+	}
+	int idx;
+	for(idx=0;idx<r->search->nargs;++idx) {
+		fprintf(stderr, "search has arg %.*s\n",
+		 (int)r->search->args[idx].length,
+		 ldsearch_string(r->search, r->search->request) +
+		 r->search->args[idx].offset);
 	}
 
-	lua_close(s);
+	ldresponse_objrelease(r);
 
 	return luaL_error(l, "Not implemented");
 }
 */
 
-static int ldresponse_loadlua(lua_State *l) {
-	lua_settop(l, 1);
-	luaL_checktype(l, 1, LUA_TLIGHTUSERDATA);
+//Feeds lua_load from a blob a chunk at a time, so the bytecode is
+//never held in memory as a whole
+#define LDRESPONSE_CHUNKSIZE 4096
 
-	lua_State *s = (lua_State *)lua_touserdata(l, 1);
+struct ldresponse_blobreader
+{
+	sqlite3_blob *blob;
+	int offset;
+	int bytes;
+	char chunk[LDRESPONSE_CHUNKSIZE];
+};
 
-	lua_getglobal(s, "code");
-	size_t len;
-	const char *code = lua_tolstring(s, -1, &len);
+static const char *ldresponse_readblob(lua_State *l, void *p, size_t *size) {
+	struct ldresponse_blobreader *br = (struct ldresponse_blobreader *)p;
 
-	int rc = luaL_loadbufferx(l, code, len, "luadeploy_code", "b");
-	if(rc != LUA_OK) {
-		lua_close(s);
-		return luaL_error(l, "Unable to load luadeploy module");
+	int n = br->bytes - br->offset;
+	if(n > LDRESPONSE_CHUNKSIZE) n = LDRESPONSE_CHUNKSIZE;
+	if(n <= 0 || sqlite3_blob_read(br->blob, br->chunk, n,
+	 br->offset) != SQLITE_OK) {
+		*size = 0;
+		return NULL;
 	}
 
-	lua_settop(s, 0);
-	lua_getglobal(s, "entrypoint");
-	if(lua_type(s, -1) != LUA_TNIL) {
-		lua_close(s);
-		return luaL_error(l, "Lua code with entry points not supported");
-	}
+	br->offset += n;
+	*size = n;
+	return br->chunk;
+}
 
-	lua_settop(s, 0);
-	lua_getglobal(s, "args");
-	assert(lua_type(s, -1) == LUA_TTABLE);
-	int elems = lua_rawlen(s, -1);
-	int idx;
-	for(idx=1;idx<=elems;++idx) {
-		lua_rawgeti(s, 1, idx);
-		assert(lua_type(s, -1) == LUA_TSTRING);
-		lua_pushstring(l, lua_tostring(s, -1));
-		lua_pop(s, 1);
+//The loaded chunk is on top of the stack
+static int ldresponse_finishlua(lua_State *l, struct ldresponse_obj *r) {
+	if(r->search->entrypoint != 0) {
+		ldresponse_objrelease(r);
+		return luaL_error(l, "Lua code with entry points not supported");
 	}
 
-	lua_close(s);
+	int elems = ldresponse_pushargs(l, r->search);
+	ldresponse_objrelease(r);
 
 	return 1+elems;
 }
 
-static int lddlcloser_mtgc(lua_State *l) {
-	lua_settop(l, 1);
-	luaL_checktype(l, 1, LUA_TUSERDATA);
-
-	void *hndl = *(void **)lua_touserdata(l, 1);
-	fprintf(stderr, "calling dlclose on %p\n", hndl);
-	dlclose(hndl);
-
-	return 0;
-}
-
-static int lddlcloser_install(lua_State *l) {
+static int ldresponse_loadlua(lua_State *l) {
 	lua_settop(l, 1);
 	luaL_checktype(l, 1, LUA_TLIGHTUSERDATA);
 
-	void **phndl = (void **)lua_newuserdata(l, sizeof(void *));
-	*phndl = lua_touserdata(l, 1);
+	struct ldresponse_obj *r = (struct ldresponse_obj *)lua_touserdata(l, 1);
 
-	lua_rawgetp(l, LUA_REGISTRYINDEX, (void *)lddlcloser_install);
-	if(lua_type(l, -1) == LUA_TNIL) {
-		lua_pop(l, 1);
-
-		lua_newtable(l);
-
-		lua_pushcfunction(l, lddlcloser_mtgc);
-		lua_setfield(l, -2, "__gc");
+	if(r->conn == NULL) {
+		int rc = luaL_loadbufferx(l, r->obj, r->objbytes,
+		 "luadeploy_code", "b");
+		if(rc != LUA_OK) {
+			ldresponse_objrelease(r);
+			return luaL_error(l, "Unable to load luadeploy module");
+		}
+		return ldresponse_finishlua(l, r);
+	}
 
-		lua_pushvalue(l, -1);
-		lua_rawsetp(l, LUA_REGISTRYINDEX, (void *)lddlcloser_install);
+	struct ldresponse_blobreader br;
+	if(sqlite3_blob_open(r->conn->db, "main", r->obj, "obj", r->rowid, 0,
+	 &br.blob) != SQLITE_OK) {
+		sqlite3_blob_close(br.blob);
+		ldresponse_objrelease(r);
+		return luaL_error(l, "Unable to load luadeploy module");
 	}
-	assert(lua_type(l, -1) == LUA_TTABLE);
-	lua_setmetatable(l, -2);
+	br.offset = 0;
+	br.bytes = sqlite3_blob_bytes(br.blob);
 
-	//want it to be collected when the state is closed
-	luaL_ref(l, LUA_REGISTRYINDEX);
+	int rc = lua_load(l, ldresponse_readblob, &br, "luadeploy_code", "b");
+	sqlite3_blob_close(br.blob);
+	if(rc != LUA_OK) {
+		ldresponse_objrelease(r);
+		return luaL_error(l, "Unable to load luadeploy module");
+	}
 
-	return 0;
+	return ldresponse_finishlua(l, r);
 }
 
 static int ldresponse_loadso(lua_State *l) {
 	lua_settop(l, 1);
 	luaL_checktype(l, 1, LUA_TLIGHTUSERDATA);
 
-	lua_State *s = (lua_State *)lua_touserdata(l, 1);
-
-	lua_settop(s, 0);
-	lua_getglobal(s, "fullsopath");
-	lua_getglobal(s, "entrypoint");
+	struct ldresponse_obj *r = (struct ldresponse_obj *)lua_touserdata(l, 1);
 
-	void *hndl = dlopen(lua_tostring(s, 1), RTLD_NOW | RTLD_LOCAL);
-	if(hndl == NULL) {
-		lua_close(s);
-		return luaL_error(l, "Unable to open shared obj");
-	}
-
-	void *func = dlsym(hndl, lua_tostring(s, 2));
-	if(func == NULL) {
-		lua_close(s);
+	if(r->search->entrypoint == 0) {
+		ldresponse_objrelease(r);
 		return luaL_error(l, "Unable to find symbol");
 	}
-	
-	lua_pushcfunction(l, lddlcloser_install);
-	lua_pushlightuserdata(l, hndl);
-	lua_call(l, 1, 0);
-
-	lua_pushcfunction(l, (int (*)(lua_State *))func);
 
-	lua_settop(s, 0);
-	lua_getglobal(s, "args");
-	assert(lua_type(s, -1) == LUA_TTABLE);
-	int elems = lua_rawlen(s, -1);
-	int idx;
-	for(idx=1;idx<=elems;++idx) {
-		lua_rawgeti(s, 1, idx);
-		assert(lua_type(s, -1) == LUA_TSTRING);
-		lua_pushstring(l, lua_tostring(s, -1));
-		lua_pop(s, 1);
+	lua_CFunction func;
+	const char *err;
+	struct lddl_library *lib = lddl_acquire(r->obj,
+	 ldsearch_string(r->search, r->search->entrypoint), &func, &err);
+	if(lib == NULL) {
+		ldresponse_objrelease(r);
+		return luaL_error(l, "%s", err);
 	}
+	lddl_hold(l, lib);
+
+	lua_pushcfunction(l, func);
 
-	lua_close(s);
+	int elems = ldresponse_pushargs(l, r->search);
+	ldresponse_objrelease(r);
 
 	return 1+elems;
 }
 	
-static void ldserver_loadlua(
+//Opens the blob for objref, or sets an error response and returns NULL
+static sqlite3_blob *ldserver_openobj(
  struct ldserver_threaddata *td,
  struct ldloader_request *req,
- lua_State *searchResult) {
-	lua_settop(searchResult, 0);
-
-	lua_getglobal(searchResult, "software");
-	lua_getglobal(searchResult, "objref");
-
-	sqlite3_stmt *stmt = NULL;
-	int rc = sqlite3_prepare_v2(td->db, "select ld_loader_getobj(?,?)",
-	 -1, &stmt, NULL);
-	assert(rc == SQLITE_OK && stmt != NULL);
+ const char *objref,
+ sqlite3_int64 *rowid) {
+	sqlite3_stmt *stmt = ldserver_cachedstmt(td, &td->getrowidstmt,
+	 &td->getrowidns, "select ld_loader_getobjrowid(?,?)");
 
-	rc |= sqlite3_bind_text(stmt, 1, lua_tostring(searchResult, 1),
-	 -1, SQLITE_STATIC);
-	rc |= sqlite3_bind_text(stmt, 2, lua_tostring(searchResult, 2),
+	int rc = sqlite3_bind_text(stmt, 1, td->software,
 	 -1, SQLITE_STATIC);
+	rc |= sqlite3_bind_text(stmt, 2, objref, -1, SQLITE_STATIC);
 
 	assert(rc == SQLITE_OK);
 
 	rc = sqlite3_step(stmt);
 	assert(rc == SQLITE_ROW);
 
-	lua_pushlstring(searchResult, sqlite3_column_blob(stmt, 0),
-	 sqlite3_column_bytes(stmt, 0));
-	lua_setglobal(searchResult, "code");
-	sqlite3_finalize(stmt);
+	if(sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
+		sqlite3_reset(stmt);
+		char buffer[1024];
+		snprintf(buffer, 1023, "Unable to find object %s in %s",
+		 objref, td->software);
+
+		req->responseHandler = ldresponse_error;
+		req->responseData = strdup(buffer);
+		return NULL;
+	}
+
+	*rowid = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+
+	char *table = sqlite3_mprintf("%s_obj", td->software);
+	sqlite3_blob *blob;
+	rc = sqlite3_blob_open(td->db, "main", table, "obj", *rowid, 0, &blob);
+	sqlite3_free(table);
+	if(rc != SQLITE_OK) {
+		sqlite3_blob_close(blob);
+		req->responseHandler = ldresponse_error;
+		req->responseData = strdup("Unable to open object");
+		td->nocache = 1;
+		return NULL;
+	}
+
+	return blob;
+}
+
+static void ldserver_loadlua(
+ struct ldserver_threaddata *td,
+ struct ldloader_request *req,
+ const struct ldsearch_result *search) {
+	sqlite3_int64 rowid;
+	sqlite3_blob *blob = ldserver_openobj(td, req,
+	 ldsearch_string(search, search->objref), &rowid);
+	if(blob == NULL) return;
+
+	//Small objects are read straight into the response, which the
+	//cache keeps. For anything bigger only the location is kept and the
+	//client streams the bytecode itself.
+	struct ldresponse_obj *r;
+	int bytes = sqlite3_blob_bytes(blob);
+	if(bytes <= LDSERVER_INLINEBYTES) {
+		r = ldresponse_objcreate(search, NULL, bytes);
+		if(sqlite3_blob_read(blob, (char *)r->obj, bytes, 0) != SQLITE_OK) {
+			//may well work next time, so isn't cached
+			ldresponse_objrelease(r);
+			sqlite3_blob_close(blob);
+			req->responseHandler = ldresponse_error;
+			req->responseData = strdup("Unable to read object");
+			td->nocache = 1;
+			return;
+		}
+	} else {
+		char *table = sqlite3_mprintf("%s_obj", td->software);
+		r = ldresponse_objcreate(search, table, strlen(table));
+		sqlite3_free(table);
+		r->rowid = rowid;
+		r->bytes = bytes;
+		r->conn = td->conn;
+		__atomic_add_fetch(&td->conn->refs, 1, __ATOMIC_RELAXED);
+	}
+	sqlite3_blob_close(blob);
 
 	req->responseHandler = ldresponse_loadlua;
-	req->responseData = searchResult;
+	req->responseData = r;
+}
+
+//Copies the blob into a sealed memfd, returns the fd or -1
+static int ldserver_writememfd(sqlite3_blob *blob, const char *objref) {
+	int fd = memfd_create(objref, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(fd == -1) return -1;
+
+	char chunk[16384];
+	int bytes = sqlite3_blob_bytes(blob);
+	int offset = 0;
+	while(offset < bytes) {
+		int n = bytes - offset;
+		if(n > (int)sizeof(chunk)) n = sizeof(chunk);
+		if(sqlite3_blob_read(blob, chunk, n, offset) != SQLITE_OK) {
+			close(fd);
+			return -1;
+		}
+
+		int written = 0;
+		while(written < n) {
+			ssize_t rc = write(fd, chunk + written, n - written);
+			if(rc == -1) {
+				close(fd);
+				return -1;
+			}
+			written += rc;
+		}
+		offset += n;
+	}
+
+	//nothing can change the library underneath anyone who maps it
+	if(fcntl(fd, F_ADD_SEALS,
+	 F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+//These put objref somewhere dlopen can get at it, returning the path
+//or setting an error response and returning NULL
+static char *ldserver_extractmemfd(
+ struct ldserver_threaddata *td,
+ struct ldloader_request *req,
+ const char *objref,
+ int *memfd) {
+	sqlite3_int64 rowid;
+	sqlite3_blob *blob = ldserver_openobj(td, req, objref, &rowid);
+	if(blob == NULL) return NULL;
+
+	int fd = ldserver_writememfd(blob, objref);
+	sqlite3_blob_close(blob);
+	if(fd == -1) {
+		req->responseHandler = ldresponse_error;
+		req->responseData = strdup("Unable to extract shared obj");
+		td->nocache = 1;
+		return NULL;
+	}
+
+	*memfd = fd;
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	return strdup(path);
+}
+
+static char *ldserver_extractfile(
+ struct ldserver_threaddata *td,
+ struct ldloader_request *req,
+ const char *objref) {
+	sqlite3_stmt *stmt = ldserver_cachedstmt(td, &td->extractstmt,
+	 &td->extractns, "select ld_deploy_extractso(?, ?, ?)");
+
+	sqlite3_bind_text(stmt, 1, td->software, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, objref, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, td->sopath, -1, SQLITE_STATIC);
+
+	char *path = NULL;
+	if(sqlite3_step(stmt) == SQLITE_ROW &&
+	 sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+		path = strdup((const char *)sqlite3_column_text(stmt, 0));
+	}
+	sqlite3_reset(stmt);
+
+	if(path == NULL) {
+		req->responseHandler = ldresponse_error;
+		req->responseData = strdup("Unable to extract shared obj");
+		td->nocache = 1;
+	}
+	return path;
+}
+
+//Returns the path to dlopen for objref, materialising it the first
+//time any worker is asked for it. Sets an error response and returns
+//NULL if that isn't possible. The path is the caller's to free.
+static char *ldserver_sopath(
+ struct ldserver_threaddata *td,
+ struct ldloader_request *req,
+ const char *objref) {
+	struct ldserver_sotable *t = td->sotable;
+
+	pthread_mutex_lock(&t->lock);
+	struct ldserver_soentry *e;
+	for(e=t->entries;e!=NULL;e=e->next) {
+		if(strcmp(e->objref, objref) == 0) break;
+	}
+
+	if(e == NULL) {
+		int fd = -1;
+		char *path = t->mode == LDSERVER_SO_MEMFD ?
+		 ldserver_extractmemfd(td, req, objref, &fd) :
+		 ldserver_extractfile(td, req, objref);
+		if(path == NULL) {
+			pthread_mutex_unlock(&t->lock);
+			return NULL;
+		}
+
+		e = (struct ldserver_soentry *)malloc(sizeof(struct ldserver_soentry));
+		assert(e != NULL);
+		e->objref = strdup(objref);
+		e->path = path;
+		e->fd = fd;
+		e->next = t->entries;
+		t->entries = e;
+		++t->nentries;
+	}
+
+	char *path = strdup(e->path);
+	pthread_mutex_unlock(&t->lock);
+	return path;
 }
 
 static void ldserver_loadso(
  struct ldserver_threaddata *td,
  struct ldloader_request *req,
- lua_State *searchResult) {
-	lua_settop(searchResult, 0);
-
-	lua_pushstring(searchResult, td->sopath);
-	lua_pushstring(searchResult, "/");
-	lua_getglobal(searchResult, "objref");
-	lua_pushstring(searchResult, ".so");
-	lua_concat(searchResult, 4);
-	lua_setglobal(searchResult, "fullsopath");
-	
+ const struct ldsearch_result *search) {
+	const char *objref = ldsearch_string(search, search->objref);
+
+	char *path = ldserver_sopath(td, req, objref);
+	if(path == NULL) return;
+
 	req->responseHandler = ldresponse_loadso;
-	req->responseData = searchResult;
+	struct ldresponse_obj *r = ldresponse_objcreate(search, path, strlen(path));
+	r->bytes = 0;
+	req->responseData = r;
+	free(path);
 }
 
-static void ldserver_handleRequest(struct ldserver_threaddata *td,
+struct ldserver_cacheentry
+{
+	struct ldserver_cacheentry *chain;	//next in the bucket
+	struct ldserver_cacheentry *newer;
+	struct ldserver_cacheentry *older;
+
+	unsigned int hash;
+	char *type;
+	char *name;	//shares type's allocation
+
+	//either a reference to the object, or the error message
+	//for a request that can't be resolved
+	struct ldresponse_obj *obj;
+	char *error;
+};
+
+static unsigned int ldserver_hashrequest(const char *type, const char *name) {
+	//FNV-1a over both strings including type's terminator
+	unsigned int h = 2166136261u;
+	const char *p = type;
+	do {
+		h = (h ^ (unsigned char)*p) * 16777619u;
+	} while(*p++ != 0);
+	for(p=name;*p!=0;++p) {
+		h = (h ^ (unsigned char)*p) * 16777619u;
+	}
+	return h;
+}
+
+static void ldserver_cacheinit(struct ldserver_rescache *c) {
+	c->entries = 0;
+	c->nbuckets = 1;
+	while(c->nbuckets < LDSERVER_CACHESIZE) c->nbuckets *= 2;
+	c->buckets = (struct ldserver_cacheentry **)calloc(c->nbuckets,
+	 sizeof(struct ldserver_cacheentry *));
+	assert(c->buckets != NULL);
+	c->newest = NULL;
+	c->oldest = NULL;
+	c->versionstmt = NULL;
+	c->version = -1;
+	c->changes = -1;
+}
+
+static void ldserver_cacheunlink(
+ struct ldserver_rescache *c,
+ struct ldserver_cacheentry *e) {
+	if(e->newer == NULL) c->newest = e->older;
+	else e->newer->older = e->older;
+	if(e->older == NULL) c->oldest = e->newer;
+	else e->older->newer = e->newer;
+}
+
+static void ldserver_cachepushnewest(
+ struct ldserver_rescache *c,
+ struct ldserver_cacheentry *e) {
+	e->newer = NULL;
+	e->older = c->newest;
+	if(c->newest != NULL) c->newest->newer = e;
+	c->newest = e;
+	if(c->oldest == NULL) c->oldest = e;
+}
+
+static void ldserver_cacheremove(
+ struct ldserver_rescache *c,
+ struct ldserver_cacheentry *e) {
+	struct ldserver_cacheentry **pe = &c->buckets[e->hash & (c->nbuckets-1)];
+	while(*pe != e) pe = &(*pe)->chain;
+	*pe = e->chain;
+
+	ldserver_cacheunlink(c, e);
+	--c->entries;
+
+	if(e->obj != NULL) ldresponse_objrelease(e->obj);
+	free(e->error);
+	free(e->type);
+	free(e);
+}
+
+static void ldserver_cacheflush(struct ldserver_rescache *c) {
+	while(c->oldest != NULL) ldserver_cacheremove(c, c->oldest);
+}
+
+static void ldserver_cachedestroy(struct ldserver_rescache *c) {
+	ldserver_cacheflush(c);
+	free(c->buckets);
+	sqlite3_finalize(c->versionstmt);
+}
+
+//Empties the cache if anything has written to the database since
+//the entries were resolved, from this connection or another
+static void ldserver_cachecheckversion(
+ struct ldserver_threaddata *td,
+ struct ldserver_rescache *c) {
+	if(c->versionstmt == NULL) {
+		int rc = sqlite3_prepare_v2(td->db, "pragma data_version", -1,
+		 &c->versionstmt, NULL);
+		assert(rc == SQLITE_OK && c->versionstmt != NULL);
+	}
+
+	int version = -1;
+	if(sqlite3_step(c->versionstmt) == SQLITE_ROW) {
+		version = sqlite3_column_int(c->versionstmt, 0);
+	}
+	sqlite3_reset(c->versionstmt);
+
+	int changes = sqlite3_total_changes(td->db);
+	if(version == -1 || version != c->version || changes != c->changes) {
+		ldserver_cacheflush(c);
+		c->version = version;
+		c->changes = changes;
+	}
+}
+
+static struct ldserver_cacheentry *ldserver_cachefind(
+ struct ldserver_rescache *c,
+ const char *type,
+ const char *name) {
+	unsigned int hash = ldserver_hashrequest(type, name);
+
+	struct ldserver_cacheentry *e;
+	for(e=c->buckets[hash & (c->nbuckets-1)];e!=NULL;e=e->chain) {
+		if(e->hash == hash && strcmp(e->type, type) == 0 &&
+		 strcmp(e->name, name) == 0) {
+			ldserver_cacheunlink(c, e);
+			ldserver_cachepushnewest(c, e);
+			return e;
+		}
+	}
+	return NULL;
+}
+
+//Remembers the response the request has just been given
+static void ldserver_cacheinsert(
+ struct ldserver_threaddata *td,
+ struct ldserver_rescache *c,
  struct ldloader_request *req) {
-	char *query =
-	 sqlite3_mprintf("select ld_loader_search('%s', ?, ?)", td->software);
+	if(c->entries == LDSERVER_CACHESIZE) {
+		ldserver_cacheremove(c, c->oldest);
+		__atomic_add_fetch(&td->stats->cacheevictions, 1, __ATOMIC_RELAXED);
+	}
 
-	sqlite3_stmt *stmt;
-	int rc = sqlite3_prepare_v2(td->db, query, -1, &stmt, NULL);
-	sqlite3_free(query);
-	assert(rc == SQLITE_OK);
+	size_t typebytes = strlen(req->type) + 1;
+	size_t namebytes = strlen(req->name) + 1;
+
+	struct ldserver_cacheentry *e = (struct ldserver_cacheentry *)malloc(
+	 sizeof(struct ldserver_cacheentry));
+	assert(e != NULL);
+	e->type = (char *)malloc(typebytes + namebytes);
+	assert(e->type != NULL);
+	memcpy(e->type, req->type, typebytes);
+	e->name = e->type + typebytes;
+	memcpy(e->name, req->name, namebytes);
+	e->hash = ldserver_hashrequest(req->type, req->name);
+
+	e->obj = NULL;
+	e->error = NULL;
+	if(req->responseHandler == ldresponse_error) {
+		e->error = strdup((const char *)req->responseData);
+	} else {
+		e->obj = (struct ldresponse_obj *)req->responseData;
+		__atomic_add_fetch(&e->obj->refs, 1, __ATOMIC_RELAXED);
+	}
+
+	struct ldserver_cacheentry **bucket =
+	 &c->buckets[e->hash & (c->nbuckets-1)];
+	e->chain = *bucket;
+	*bucket = e;
+	ldserver_cachepushnewest(c, e);
+	++c->entries;
+}
 
-	sqlite3_bind_text(stmt, 1, req->type, -1, SQLITE_STATIC);
-	sqlite3_bind_text(stmt, 2, req->name, -1, SQLITE_STATIC);
+static void ldserver_cacherespond(
+ struct ldserver_cacheentry *e,
+ struct ldloader_request *req) {
+	if(e->obj == NULL) {
+		req->responseHandler = ldresponse_error;
+		req->responseData = strdup(e->error);
+		return;
+	}
+
+	__atomic_add_fetch(&e->obj->refs, 1, __ATOMIC_RELAXED);
+	req->responseHandler = e->obj->search->loader == LDSEARCH_LOADER_SO ?
+	 ldresponse_loadso : ldresponse_loadlua;
+	req->responseData = e->obj;
+}
+
+static void ldserver_resolve(struct ldserver_threaddata *td,
+ struct ldloader_request *req) {
+	sqlite3_stmt *stmt = ldserver_cachedstmt(td, &td->searchstmt,
+	 &td->searchns, "select ld_loader_search(?, ?, ?)");
+
+	sqlite3_bind_text(stmt, 1, td->software, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, req->type, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, req->name, -1, SQLITE_STATIC);
 	
-	rc = sqlite3_step(stmt);
+	int type = ldmetrics_typeindex(req->type);
+	long long start = ldserver_nanotime();
+	int rc = sqlite3_step(stmt);
 	assert(rc == SQLITE_ROW);
+	long long searched = ldserver_nanotime();
+	ldmetrics_record(td->metrics, LDMETRICS_SEARCH, type, searched - start);
 	
 	if(sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
-		sqlite3_finalize(stmt);
+		sqlite3_reset(stmt);
+		td->event.searchstart = start;
+		td->event.searchend = searched;
+		td->event.fetchend = searched;
+
 		char buffer[1024];
 		snprintf(buffer, 1023, "Unable to find %s in %s/%s",
 		 req->name, td->software, req->type);
@@ -281,33 +857,137 @@ static void ldserver_handleRequest(struct ldserver_threaddata *td,
 		return;
 	}
 
-	assert(sqlite3_column_type(stmt, 0) == SQLITE_TEXT);
-
-	lua_State *responseState = luaL_newstate();
-	rc = luaL_loadbufferx(responseState,
-	 (const char *)sqlite3_column_text(stmt, 0),
-	 sqlite3_column_bytes(stmt, 0), "searchdef", "t");
-	assert(rc == LUA_OK);
-	sqlite3_finalize(stmt);
-	rc = lua_pcall(responseState, 0, 0, 0);
-	assert(rc == LUA_OK);
-
-	lua_getglobal(responseState, "loader");
-	if(strncmp(lua_tostring(responseState, 1), "so", 3) == 0) {
-		lua_settop(responseState, 0);
-		ldserver_loadso(td, req, responseState);
-		//responseState is sent in the response, so we
-		//can't close it here
-	} else if(strncmp(lua_tostring(responseState, 1), "lua", 4) == 0) {
-		lua_settop(responseState, 0);
-		ldserver_loadlua(td, req, responseState);
-		//responseState is sent in the response, so we
-		//can't close it here
+	assert(sqlite3_column_type(stmt, 0) == SQLITE_BLOB);
+
+	const struct ldsearch_result *search =
+	 (const struct ldsearch_result *)sqlite3_column_blob(stmt, 0);
+	assert(sqlite3_column_bytes(stmt, 0) == search->bytes);
+
+	//search points into the statement's row, so it has to stay
+	//un-reset until it has been copied into the response
+	if(search->loader == LDSEARCH_LOADER_SO) {
+		ldserver_loadso(td, req, search);
+	} else if(search->loader == LDSEARCH_LOADER_LUA) {
+		ldserver_loadlua(td, req, search);
 	} else {
 		req->responseHandler = ldresponse_error;
 		req->responseData = strdup("Unknown Loader");
-		lua_close(responseState);
 	}
+	long long fetched = ldserver_nanotime();
+	ldmetrics_record(td->metrics, LDMETRICS_FETCH, type, fetched - searched);
+	sqlite3_reset(stmt);
+
+	td->event.searchstart = start;
+	td->event.searchend = searched;
+	td->event.fetchend = fetched;
+}
+
+static void ldserver_lookup(struct ldserver_threaddata *td,
+ struct ldloader_request *req) {
+	struct ldserver_cacheentry *e =
+	 ldserver_cachefind(&td->cache, req->type, req->name);
+	if(e != NULL) {
+		__atomic_add_fetch(&td->stats->cachehits, 1, __ATOMIC_RELAXED);
+		ldserver_cacherespond(e, req);
+		td->event.cached = 1;
+		return;
+	}
+
+	__atomic_add_fetch(&td->stats->cachemisses, 1, __ATOMIC_RELAXED);
+	td->nocache = 0;
+	ldserver_resolve(td, req);
+	if(!td->nocache) ldserver_cacheinsert(td, &td->cache, req);
+}
+
+//Starts the trace event for a request a worker has just picked up
+static void ldserver_tracestart(
+ struct ldserver_threaddata *td,
+ struct ldloader_request *req,
+ long long picked) {
+	struct ldtrace_event *e = &td->event;
+	ldtrace_setstring(e->type, sizeof(e->type), req->type);
+	e->worker = td->worker;
+	e->sent = req->sent;
+	e->picked = picked;
+	e->loadns = -1;
+	e->totalns = -1;
+}
+
+//Finishes the trace event for one name from the response it's been
+//given, and records it. Returns the id plus one, as msg.h wants.
+static unsigned long long ldserver_tracefinish(
+ struct ldserver_threaddata *td,
+ const char *name,
+ int (*responseHandler)(lua_State *),
+ void *responseData) {
+	struct ldtrace_event *e = &td->event;
+	ldtrace_setstring(e->name, sizeof(e->name), name);
+	e->found = responseHandler != ldresponse_error;
+	if(e->found) {
+		struct ldresponse_obj *r = (struct ldresponse_obj *)responseData;
+		ldtrace_setstring(e->objref, sizeof(e->objref),
+		 ldsearch_string(r->search, r->search->objref));
+		e->loader = r->search->loader;
+		e->bytes = r->bytes;
+	} else {
+		e->objref[0] = 0;
+		e->loader = LDSEARCH_LOADER_UNKNOWN;
+		e->bytes = 0;
+	}
+	e->served = ldserver_nanotime();
+
+	unsigned long long id = ldtrace_record(&td->metrics->trace, e);
+
+	e->cached = 0;
+	e->searchstart = e->searchend = e->fetchend = 0;
+	return id+1;
+}
+
+//Every name in the batch is resolved inside one read transaction, so
+//sqlite takes its locks and checks the schema once for the lot
+static void ldserver_handleBatch(struct ldserver_threaddata *td,
+ struct ldloader_request *req) {
+	sqlite3_stmt *stmt = ldserver_cachedstmt(td, &td->beginstmt,
+	 &td->beginns, "begin");
+	int intransaction = sqlite3_step(stmt) == SQLITE_DONE;
+	sqlite3_reset(stmt);
+
+	ldserver_cachecheckversion(td, &td->cache);
+
+	int i;
+	for(i=0;i<req->count;++i) {
+		struct ldloader_request one;
+		one.type = req->type;
+		one.name = req->batch[i].name;
+		ldserver_lookup(td, &one);
+
+		req->batch[i].responseHandler = one.responseHandler;
+		req->batch[i].responseData = one.responseData;
+
+		//the client only reports once for the whole batch, so these
+		//never get a load time
+		ldserver_tracefinish(td, one.name, one.responseHandler,
+		 one.responseData);
+		td->event.picked = td->event.served;
+	}
+
+	if(intransaction) {
+		stmt = ldserver_cachedstmt(td, &td->commitstmt,
+		 &td->commitns, "commit");
+		sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+	}
+}
+
+static void ldserver_handleRequest(struct ldserver_threaddata *td,
+ struct ldloader_request *req) {
+	if(req->name == NULL) {
+		ldserver_handleBatch(td, req);
+		return;
+	}
+
+	ldserver_cachecheckversion(td, &td->cache);
+	ldserver_lookup(td, req);
 }
 
 static void *ldserver_thread(void *p) {
@@ -316,13 +996,14 @@ static void *ldserver_thread(void *p) {
 
 	fd_set readfds;
 
+	int wake_fd = td->inq != NULL ? td->inq->event_fd : td->queue_fd;
 	int maxfd = td->piperead_fd;
-	if(td->queue_fd > maxfd) maxfd = td->queue_fd;
+	if(wake_fd > maxfd) maxfd = wake_fd;
 
 	while(1) {
 		FD_ZERO(&readfds);
 		FD_SET(td->piperead_fd, &readfds);
-		FD_SET(td->queue_fd, &readfds);
+		FD_SET(wake_fd, &readfds);
 
 		if(select(maxfd+1, &readfds, NULL, NULL, NULL) == -1) continue;
 
@@ -331,15 +1012,51 @@ static void *ldserver_thread(void *p) {
 			break;
 		}
 
-		if(FD_ISSET(td->queue_fd, &readfds)) {
-			void *msg;
-			mq_receive(td->queue_fd, (char *)&msg, sizeof(void *), NULL);
-			ldserver_handleRequest(td, (struct ldloader_request *)msg);
-			sem_post(&((struct ldloader_request *)msg)->sem);
+		if(FD_ISSET(wake_fd, &readfds)) {
+			//both queues are non-blocking, another worker may have
+			//taken the message first
+			struct ldloader_request *msg = NULL;
+			if(td->inq != NULL) {
+				msg = ldqueue_pop(td->inq);
+			} else if(mq_receive(td->queue_fd, (char *)&msg,
+			 sizeof(void *), NULL) == -1) {
+				msg = NULL;
+			}
+			if(msg == NULL) continue;
+
+			long long picked = ldserver_nanotime();
+			int type = ldmetrics_typeindex(msg->type);
+			ldmetrics_record(td->metrics, LDMETRICS_QUEUE, type,
+			 picked - msg->sent);
+			__atomic_add_fetch(&td->metrics->inflight, 1, __ATOMIC_RELAXED);
+			ldserver_tracestart(td, msg, picked);
+
+			ldserver_handleRequest(td, msg);
+
+			msg->traceid = msg->name == NULL ? 0 : ldserver_tracefinish(td,
+			 msg->name, msg->responseHandler, msg->responseData);
+
+			__atomic_sub_fetch(&td->metrics->inflight, 1, __ATOMIC_RELAXED);
+			ldmetrics_record(td->metrics, LDMETRICS_SERVE, type,
+			 ldserver_nanotime() - picked);
+
+			//the client reports the load and total, after which the
+			//server may be gone
+			__atomic_add_fetch(&td->metrics->refs, 1, __ATOMIC_RELAXED);
+			msg->timingHandler = ldmetrics_timing;
+			msg->timingData = td->metrics;
+			sem_post(&msg->sem);
 		}
 	}
 
-	close(td->piperead_fd);
+	ldserver_cachedestroy(&td->cache);
+	sqlite3_finalize(td->searchstmt);
+	sqlite3_finalize(td->getrowidstmt);
+	sqlite3_finalize(td->beginstmt);
+	sqlite3_finalize(td->commitstmt);
+	sqlite3_finalize(td->extractstmt);
+	sqlite3_exec(td->db, "select ld_loader_release()", NULL, NULL, NULL);
+	ldserver_connrelease(td->conn);
 	free(td->software);
 	free(td->sopath);
 	free(p);
@@ -347,6 +1064,95 @@ static void *ldserver_thread(void *p) {
 	return NULL;
 }
 
+//Each worker gets its own read only connection to the server's
+//database. An in memory database can't be opened twice, so the
+//workers get a private copy of it instead.
+static sqlite3 *ldserver_openworkerdb(
+ const char *filename,
+ const unsigned char *snapshot,
+ sqlite3_int64 snapshotbytes) {
+	sqlite3 *db = NULL;
+
+	if(snapshot == NULL) {
+		sqlite3_open_v2(filename, &db,
+		 SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_READONLY, NULL);
+	} else {
+		sqlite3_open_v2(":memory:", &db,
+		 SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_READWRITE, NULL);
+
+		unsigned char *copy = (unsigned char *)sqlite3_malloc64(snapshotbytes);
+		if(db != NULL && copy != NULL) {
+			memcpy(copy, snapshot, snapshotbytes);
+			//copy is freed by sqlite even if this fails
+			if(sqlite3_deserialize(db, "main", copy, snapshotbytes,
+			 snapshotbytes, SQLITE_DESERIALIZE_FREEONCLOSE |
+			 SQLITE_DESERIALIZE_READONLY) != SQLITE_OK) {
+				sqlite3_close(db);
+				return NULL;
+			}
+		} else {
+			sqlite3_free(copy);
+			sqlite3_close(db);
+			return NULL;
+		}
+	}
+
+	if(db == NULL || sqlite3_errcode(db) != SQLITE_OK ||
+	 ldext_init(db, NULL, NULL) != SQLITE_OK) {
+		sqlite3_close(db);
+		return NULL;
+	}
+
+	//every worker releases them before closing
+	sqlite3_exec(db, "select ld_loader_cachestmts()", NULL, NULL, NULL);
+	return db;
+}
+
+//Tells n workers to exit and waits for them all to go
+static void ldserver_stopworkers(int pipewrite_fd, int n) {
+	sem_t sem;
+	sem_init(&sem, 0, 0);
+	sem_t *psem = &sem;
+
+	int i;
+	for(i=0;i<n;++i) {
+		write(pipewrite_fd, &psem, sizeof(sem_t *));
+	}
+	for(i=0;i<n;++i) {
+		sem_wait(&sem);
+	}
+	sem_destroy(&sem);
+}
+
+//Answers every request still queued with an error. Once the workers
+//have gone nothing else will, and the clients wait for an answer.
+static void ldserver_failpending(struct ldserver_userdata *ud) {
+	while(1) {
+		struct ldloader_request *msg = NULL;
+		if(ud->inq != NULL) {
+			msg = ldqueue_pop(ud->inq);
+		} else if(ud->queue_fd != -1 && mq_receive(ud->queue_fd,
+		 (char *)&msg, sizeof(void *), NULL) == -1) {
+			msg = NULL;
+		}
+		if(msg == NULL) break;
+
+		if(msg->name == NULL) {
+			int i;
+			for(i=0;i<msg->count;++i) {
+				msg->batch[i].responseHandler = ldresponse_error;
+				msg->batch[i].responseData = strdup("Server stopped");
+			}
+		} else {
+			msg->responseHandler = ldresponse_error;
+			msg->responseData = strdup("Server stopped");
+		}
+		msg->timingHandler = NULL;
+		msg->traceid = 0;
+		sem_post(&msg->sem);
+	}
+}
+
 static int ldserver_mtStart(lua_State *l) {
 	lua_settop(l, 1);
 	luaL_checktype(l, 1, LUA_TUSERDATA);
@@ -360,35 +1166,82 @@ static int ldserver_mtStart(lua_State *l) {
 		return 2;
 	}
 
-	int pipefd[2];
-	pipe2(pipefd, O_CLOEXEC);
-
-	struct ldserver_threaddata *td =
-	 (struct ldserver_threaddata *)malloc(sizeof(struct ldserver_threaddata));
-	assert(td != NULL);
-	td->piperead_fd = pipefd[0];
-	td->queue_fd = ud->queue_fd;
-
 	lua_getuservalue(l, 1);
 	lua_getfield(l, -1, "sopath");
 	lua_getfield(l, -2, "dbud");
 	lua_getfield(l, -3, "software");
-	td->software = strdup(lua_tostring(l, -1));
-	td->db = *(sqlite3 **)lua_touserdata(l, -2);
-	td->sopath = strdup(lua_tostring(l, -3));
+	//[uvpds]
+	sqlite3 *db = *(sqlite3 **)lua_touserdata(l, 4);
+
+	const char *filename = sqlite3_db_filename(db, "main");
+	unsigned char *snapshot = NULL;
+	sqlite3_int64 snapshotbytes = 0;
+	if(filename == NULL || filename[0] == 0) {
+		snapshot = sqlite3_serialize(db, "main", &snapshotbytes, 0);
+		if(snapshot == NULL) {
+			return luaL_error(l, "Unable to copy in memory database");
+		}
+	}
+
+	int pipefd[2];
+	if(pipe2(pipefd, O_CLOEXEC) != 0) {
+		sqlite3_free(snapshot);
+		return luaL_error(l, "Unable to create pipe");
+	}
+
+	int started;
+	for(started=0;started<ud->nworkers;++started) {
+		sqlite3 *workerdb =
+		 ldserver_openworkerdb(filename, snapshot, snapshotbytes);
+		if(workerdb == NULL) break;
+
+		struct ldserver_threaddata *td = (struct ldserver_threaddata *)
+		 malloc(sizeof(struct ldserver_threaddata));
+		assert(td != NULL);
+		td->piperead_fd = pipefd[0];
+		td->queue_fd = ud->queue_fd;
+		td->inq = ud->inq;
+		td->db = workerdb;
+		td->conn = ldserver_conncreate(workerdb);
+		td->software = strdup(lua_tostring(l, 5));
+		td->sopath = strdup(lua_tostring(l, 3));
+		td->searchstmt = NULL;
+		td->getrowidstmt = NULL;
+		td->beginstmt = NULL;
+		td->commitstmt = NULL;
+		td->extractstmt = NULL;
+		ldserver_cacheinit(&td->cache);
+		td->stats = &ud->stats;
+		td->sotable = &ud->sotable;
+		td->metrics = ud->metrics;
+		td->worker = started;
+		memset(&td->event, 0, sizeof(struct ldtrace_event));
+
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, ldserver_thread, td) != 0) {
+			ldserver_cachedestroy(&td->cache);
+			sqlite3_exec(workerdb, "select ld_loader_release()",
+			 NULL, NULL, NULL);
+			ldserver_connrelease(td->conn);
+			free(td->software);
+			free(td->sopath);
+			free(td);
+			break;
+		}
+		pthread_detach(thread);
+	}
+	sqlite3_free(snapshot);
 	lua_pop(l, 4);
 
-	pthread_t thread;
-	int rc = pthread_create(&thread, NULL, ldserver_thread, td);
-	if(rc != 0) {
+	if(started != ud->nworkers) {
+		ldserver_stopworkers(pipefd[1], started);
 		close(pipefd[0]);
 		close(pipefd[1]);
-		free(td);
-		return luaL_error(l, "Unable to create thread");
+		return luaL_error(l, "Unable to start worker threads");
 	}
-	pthread_detach(thread);
 
 	ud->pipewrite_fd = pipefd[1];
+	ud->piperead_fd = pipefd[0];
 
 	lua_pushboolean(l, 1);
 	return 1;
@@ -407,20 +1260,106 @@ static int ldserver_mtStop(lua_State *l) {
 		return 2;
 	}
 
-	sem_t sem;
-	sem_init(&sem, 0, 0);
-	sem_t *psem = &sem;
-	write(ud->pipewrite_fd, &psem, sizeof(sem_t *));
-	sem_wait(&sem);
-	sem_destroy(&sem);
+	ldserver_stopworkers(ud->pipewrite_fd, ud->nworkers);
+	ldserver_failpending(ud);
 
 	close(ud->pipewrite_fd);
+	close(ud->piperead_fd);
 	ud->pipewrite_fd = -1;
+	ud->piperead_fd = -1;
 
 	lua_pushboolean(l, 1);
 	return 1;
 }
 
+static int ldserver_mtstats(lua_State *l) {
+	lua_settop(l, 1);
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+
+	struct ldserver_userdata *ud =
+	 (struct ldserver_userdata *)lua_touserdata(l, 1);
+
+	lua_newtable(l);
+
+	lua_pushnumber(l, __atomic_load_n(&ud->stats.prepared,
+	 __ATOMIC_RELAXED));
+	lua_setfield(l, -2, "prepared");
+
+	lua_pushnumber(l, __atomic_load_n(&ud->stats.reused,
+	 __ATOMIC_RELAXED));
+	lua_setfield(l, -2, "reused");
+
+	lua_pushnumber(l, __atomic_load_n(&ud->stats.savedns,
+	 __ATOMIC_RELAXED) / 1e9);
+	lua_setfield(l, -2, "preparesaved");
+
+	lua_pushnumber(l, __atomic_load_n(&ud->stats.cachehits,
+	 __ATOMIC_RELAXED));
+	lua_setfield(l, -2, "cachehits");
+
+	lua_pushnumber(l, __atomic_load_n(&ud->stats.cachemisses,
+	 __ATOMIC_RELAXED));
+	lua_setfield(l, -2, "cachemisses");
+
+	lua_pushnumber(l, __atomic_load_n(&ud->stats.cacheevictions,
+	 __ATOMIC_RELAXED));
+	lua_setfield(l, -2, "cacheevictions");
+
+	pthread_mutex_lock(&ud->sotable.lock);
+	lua_pushnumber(l, ud->sotable.nentries);
+	pthread_mutex_unlock(&ud->sotable.lock);
+	lua_setfield(l, -2, "sharedobjs");
+
+	lua_pushnumber(l, __atomic_load_n(&ud->metrics->inflight,
+	 __ATOMIC_RELAXED));
+	lua_setfield(l, -2, "inflight");
+
+	//requests waiting for a worker
+	long long depth = 0;
+	if(ud->inq != NULL) {
+		depth = (long long)(__atomic_load_n(&ud->inq->tail, __ATOMIC_RELAXED) -
+		 __atomic_load_n(&ud->inq->head, __ATOMIC_RELAXED));
+	} else if(ud->queue_fd != -1) {
+		struct mq_attr attr;
+		if(mq_getattr(ud->queue_fd, &attr) == 0) depth = attr.mq_curmsgs;
+	}
+	lua_pushnumber(l, depth < 0 ? 0 : depth);
+	lua_setfield(l, -2, "queuedepth");
+
+	ldmetrics_push(l, ud->metrics);
+	lua_setfield(l, -2, "latency");
+
+	return 1;
+}
+
+//Returns the last requests served as chrome trace JSON
+static int ldserver_mttrace(lua_State *l) {
+	lua_settop(l, 1);
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+
+	struct ldserver_userdata *ud =
+	 (struct ldserver_userdata *)lua_touserdata(l, 1);
+
+	ldtrace_push(l, &ud->metrics->trace, ud->nworkers);
+	return 1;
+}
+
+//Requests that take longer than this many seconds are logged to
+//stderr, 0 turns it off
+static int ldserver_mtsetslow(lua_State *l) {
+	lua_settop(l, 2);
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+	lua_Number seconds = luaL_checknumber(l, 2);
+	luaL_argcheck(l, seconds >= 0, 2, "negative threshold");
+
+	struct ldserver_userdata *ud =
+	 (struct ldserver_userdata *)lua_touserdata(l, 1);
+
+	__atomic_store_n(&ud->metrics->trace.slowns, (long long)(seconds * 1e9),
+	 __ATOMIC_RELAXED);
+	return 0;
+}
+
 static int ldserver_mtgc(lua_State *l) {
 	lua_settop(l, 1);
 	luaL_checktype(l, 1, LUA_TUSERDATA);
@@ -430,6 +1369,9 @@ static int ldserver_mtgc(lua_State *l) {
 	struct ldserver_userdata *ud =
 	 (struct ldserver_userdata *)lua_touserdata(l, 1);
 
+	//anything sent while it was stopped
+	ldserver_failpending(ud);
+
 	if(ud->queue_fd != -1) {
 		mq_unlink(ud->queue_name);
 		free(ud->queue_name);
@@ -437,6 +1379,28 @@ static int ldserver_mtgc(lua_State *l) {
 		mq_close(ud->queue_fd);
 		ud->queue_fd = -1;
 	}
+
+	if(ud->inq != NULL) {
+		ldqueue_unregister(ud->inq);
+		ud->inq = NULL;
+	}
+
+	//a library loaded from a memfd keeps its fd until it is unloaded,
+	//so the path can't be reused for another object
+	while(ud->sotable.entries != NULL) {
+		struct ldserver_soentry *e = ud->sotable.entries;
+		ud->sotable.entries = e->next;
+		if(e->fd != -1) lddl_closefd(e->fd);
+		free(e->objref);
+		free(e->path);
+		free(e);
+	}
+	pthread_mutex_destroy(&ud->sotable.lock);
+
+	if(ud->metrics != NULL) {
+		ldmetrics_release(ud->metrics);
+		ud->metrics = NULL;
+	}
 	
 	return 0;
 }
@@ -462,8 +1426,9 @@ static int ldserver_openmqueue(lua_State *l) {
 	 (struct ldserver_userdata *)lua_touserdata(l, 1);
 	ud->queue_name = strdup(buffer);
 
+	//non-blocking because all the workers select on it
 	ud->queue_fd = mq_open(ud->queue_name,
-	 O_RDONLY | O_CREAT | O_EXCL,
+	 O_RDONLY | O_NONBLOCK | O_CREAT | O_EXCL,
 	 S_IRUSR | S_IWUSR, &attr);
 	if(ud->queue_fd == -1) {
 		return luaL_error(l, "Unable to open msgqueue");
@@ -472,6 +1437,22 @@ static int ldserver_openmqueue(lua_State *l) {
 	return 0;
 }
 
+static int ldserver_openinqueue(lua_State *l) {
+	lua_settop(l, 2);
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+	luaL_checktype(l, 2, LUA_TSTRING);
+
+	struct ldserver_userdata *ud =
+	 (struct ldserver_userdata *)lua_touserdata(l, 1);
+
+	ud->inq = ldqueue_create(lua_tostring(l, 2));
+	if(ud->inq == NULL) {
+		return luaL_error(l, "Unable to register queue");
+	}
+
+	return 0;
+}
+
 static int ldserver_setMetatable(lua_State *l) {
 	lua_settop(l, 1);
 	luaL_checktype(l, 1, LUA_TUSERDATA);
@@ -490,6 +1471,15 @@ static int ldserver_setMetatable(lua_State *l) {
 		lua_pushcfunction(l, ldserver_mtStart);
 		lua_setfield(l, -2, "start");
 
+		lua_pushcfunction(l, ldserver_mtstats);
+		lua_setfield(l, -2, "stats");
+
+		lua_pushcfunction(l, ldserver_mttrace);
+		lua_setfield(l, -2, "trace");
+
+		lua_pushcfunction(l, ldserver_mtsetslow);
+		lua_setfield(l, -2, "setSlowThreshold");
+
 		lua_pushcfunction(l, ldserver_mtgc);
 		lua_setfield(l, -2, "__gc");
 
@@ -503,11 +1493,24 @@ static int ldserver_setMetatable(lua_State *l) {
 }
 
 static int ldserver_createThreadObj(lua_State *l) {
-	lua_settop(l, 4);	//[ssus]
+	static const char *transports[] = {"inproc", "mqueue", NULL};
+
+	lua_settop(l, 6);	//[ssusns]
 	luaL_checktype(l, 1, LUA_TSTRING);
 	luaL_checktype(l, 2, LUA_TSTRING);
 	luaL_checktype(l, 3, LUA_TUSERDATA);
 	luaL_checktype(l, 4, LUA_TSTRING);
+	int nworkers = luaL_optint(l, 5, 1);
+	luaL_argcheck(l, nworkers >= 1, 5, "need at least one worker");
+	int usemqueue = luaL_checkoption(l, 6, "inproc", transports);
+	lua_pop(l, 2);
+
+	int somode = LDSERVER_SO_DIR;
+	if(strcmp(lua_tostring(l, 4), "memfd") == 0) {
+		somode = LDSERVER_SO_MEMFD;
+	} else if(strncmp(lua_tostring(l, 4), "cache:", 6) == 0) {
+		somode = LDSERVER_SO_CACHE;
+	}
 
 	lua_newtable(l);	//[ssust]
 	lua_insert(l, 2);	//[stsus]
@@ -523,14 +1526,25 @@ static int ldserver_createThreadObj(lua_State *l) {
 	lua_setuservalue(l, -2);	//[su]
 
 	ud->pipewrite_fd = -1;
+	ud->piperead_fd = -1;
 	ud->queue_fd = -1;
 	ud->queue_name = NULL;
+	ud->inq = NULL;
+	ud->nworkers = nworkers;
+	memset(&ud->stats, 0, sizeof(struct ldserver_stats));
+	ud->metrics = ldmetrics_create();
+
+	pthread_mutex_init(&ud->sotable.lock, NULL);
+	ud->sotable.entries = NULL;
+	ud->sotable.nentries = 0;
+	ud->sotable.mode = somode;
 
 	lua_pushcfunction(l, ldserver_setMetatable);
 	lua_pushvalue(l, -2);
 	lua_call(l, 1, 0);
 
-	lua_pushcfunction(l, ldserver_openmqueue);
+	lua_pushcfunction(l, usemqueue ? ldserver_openmqueue :
+	 ldserver_openinqueue);
 	lua_pushvalue(l, -2);
 	lua_pushvalue(l, 1);
 	lua_call(l, 2, 0);
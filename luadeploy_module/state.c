@@ -23,12 +23,588 @@
 
 #include <lua.h>
 #include <lualib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+
+//Pools of states that have had their modules opened, ready to hand
+//out, one for each list of modules newState is called with. A thread
+//tops them up in the background. States are only ever pooled before
+//anyone has used them, once code has run in one it's closed, by the
+//same thread so whoever was using it doesn't wait for that.
+
+#define LDSTATE_MAXPOOLS 16	//past this lists of modules go unpooled
+#define LDSTATE_MAXREADY 64
+
+struct ldstate_pool
+{
+	struct ldstate_pool *next;
+	char *signature;	//the module names, comma separated, and options
+	int allocator;	//LDALLOC_*
+	int lazy;
+	int nmodules;
+	char **names;	//what the modules are required as
+	lua_CFunction *openers;
+
+	lua_State *ready[LDSTATE_MAXREADY];
+	int nready;
+};
+
+static pthread_mutex_t ldstate_poollock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ldstate_poolwake = PTHREAD_COND_INITIALIZER;
+static struct ldstate_pool *ldstate_pools = NULL;
+static int ldstate_npools = 0;
+static int ldstate_poolsize = 4;	//states kept ready in each pool
+static int ldstate_refillstarted = 0;
+
+//used states waiting for the refill thread to close them
+static lua_State *ldstate_closing[LDSTATE_MAXREADY];
+static int ldstate_nclosing = 0;
+
+//protected by ldstate_poollock
+static struct
+{
+	long long hits;
+	long long misses;
+	long long returned;	//unused states given back
+	long long created;
+	long long createns;
+} ldstate_poolstats;
+
+//A run of a state on the run pool. The state's userdata, the handle
+//runAsync returns and the run itself each hold a reference.
+struct ldstate_task
+{
+	struct ldrun_job job;	//first, so the job is the task
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int refs;	//atomic
+	int finished;
+	int close;	//the state was collected while running, close it after
+	int taken;	//the results have been taken, or thrown away
+	lua_State *state;
+	int rc;
+};
 
 struct ldstate_userdata
 {
 	lua_State *state;
+	struct ldstate_pool *pool;	//where to return the state, or NULL
+	int used;	//once set the state can't go back in the pool
+	struct ldstate_task *task;	//the last runAsync, until it's finished with
+};
+
+struct ldstate_handle
+{
+	struct ldstate_task *task;
 };
 
+static long long ldstate_nanotime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static const luaL_Reg ldstate_requirefdata[] = {
+ {"_G", luaopen_base},
+ {LUA_LOADLIBNAME, luaopen_package},
+ {LUA_COLIBNAME, luaopen_coroutine},
+ {LUA_TABLIBNAME, luaopen_table},
+ {LUA_IOLIBNAME, luaopen_io},
+ {LUA_OSLIBNAME, luaopen_os},
+ {LUA_STRLIBNAME, luaopen_string},
+ {LUA_BITLIBNAME, luaopen_bit32},
+ {LUA_MATHLIBNAME, luaopen_math},
+ {LUA_DBLIBNAME, luaopen_debug},
+ {"ldclient", ldclient_moduleloader},
+ {"ldchannel", ldchannel_moduleloader},
+ {NULL, NULL}
+};
+
+//Returns the entry for a module name, or NULL if there isn't one
+static const luaL_Reg *ldstate_findmodule(const char *name) {
+	if(strcmp(name, "base") == 0) name = "_G";
+
+	const luaL_Reg *m;
+	for(m=ldstate_requirefdata;m->name!=NULL;++m) {
+		if(strcmp(m->name, name) == 0) return m;
+	}
+	return NULL;
+}
+
+static int ldstate_panic(lua_State *l) {
+	fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+	 lua_tostring(l, -1));
+	return 0;
+}
+
+//What a state has run, and how much it's allowed to per run. It's a
+//userdata in the state's registry so it lives as long as the state,
+//whichever thread closes it.
+//
+//Limits are checked by a count hook, every LDSTATE_HOOKCOUNT
+//instructions, so they overrun by up to that many, and instructions
+//are only counted when there is a limit. Going over the instruction or
+//cpu time limit raises an error once a run, which the code can catch.
+//Going past the deadline makes every instruction raise one, so the run
+//can only unwind.
+#define LDSTATE_HOOKCOUNT 10000
+
+struct ldstate_budget
+{
+	//per run, 0 for none
+	long long instructions;
+	long long cpuns;
+	long long deadlinens;
+
+	//this run
+	long long runinstructions;
+	long long runcpu;	//the thread's cpu clock when it started
+	long long runstart;
+	int overran;	//the soft limit error's been raised
+
+	long long totalinstructions;
+	long long totalcpuns;
+	long long runs;
+	long long overruns;
+};
+
+static long long ldstate_cputime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void ldstate_hook(lua_State *l, lua_Debug *ar);
+
+static struct ldstate_budget *ldstate_getbudget(lua_State *state) {
+	lua_rawgetp(state, LUA_REGISTRYINDEX, (void *)ldstate_hook);
+	struct ldstate_budget *b = (struct ldstate_budget *)
+	 lua_touserdata(state, -1);
+	lua_pop(state, 1);
+	assert(b != NULL);
+	return b;
+}
+
+static void ldstate_hook(lua_State *l, lua_Debug *ar) {
+	struct ldstate_budget *b = ldstate_getbudget(l);
+	b->runinstructions += LDSTATE_HOOKCOUNT;
+
+	if(b->deadlinens != 0 &&
+	 ldstate_nanotime() - b->runstart > b->deadlinens) {
+		if(!b->overran) ++b->overruns;
+		b->overran = 1;
+		lua_sethook(l, ldstate_hook, LUA_MASKCOUNT, 1);
+		luaL_error(l, "State deadline exceeded");
+	}
+	if(b->overran) return;
+
+	if(b->instructions != 0 && b->runinstructions > b->instructions) {
+		b->overran = 1;
+		++b->overruns;
+		luaL_error(l, "State instruction limit exceeded");
+	}
+	if(b->cpuns != 0 && ldstate_cputime() - b->runcpu > b->cpuns) {
+		b->overran = 1;
+		++b->overruns;
+		luaL_error(l, "State cpu time limit exceeded");
+	}
+}
+
+//Sets the limits, 0 for none, which turns the hook on or off
+static void ldstate_setbudget(
+ lua_State *state,
+ long long instructions,
+ long long cpuns,
+ long long deadlinens) {
+	struct ldstate_budget *b = ldstate_getbudget(state);
+	b->instructions = instructions;
+	b->cpuns = cpuns;
+	b->deadlinens = deadlinens;
+
+	if(instructions != 0 || cpuns != 0 || deadlinens != 0) {
+		lua_sethook(state, ldstate_hook, LUA_MASKCOUNT, LDSTATE_HOOKCOUNT);
+	} else {
+		lua_sethook(state, NULL, 0, 0);
+	}
+}
+
+//Around every run and runAsync, on the thread doing the running
+static void ldstate_beginrun(lua_State *state) {
+	struct ldstate_budget *b = ldstate_getbudget(state);
+	b->runinstructions = 0;
+	b->overran = 0;
+	b->runstart = ldstate_nanotime();
+	b->runcpu = ldstate_cputime();
+
+	//the deadline may have left it checking every instruction
+	if(b->deadlinens != 0) {
+		lua_sethook(state, ldstate_hook, LUA_MASKCOUNT, LDSTATE_HOOKCOUNT);
+	}
+}
+
+static void ldstate_endrun(lua_State *state) {
+	struct ldstate_budget *b = ldstate_getbudget(state);
+	b->totalinstructions += b->runinstructions;
+	b->totalcpuns += ldstate_cputime() - b->runcpu;
+	++b->runs;
+}
+
+//Lazily opened modules. Rather than being opened when the state is,
+//each is opened the first time its global is read, through an __index
+//on the globals table, or when it's required, through package.preload.
+//The base and string libraries are always opened up front, string
+//because it sets the metatable strings' methods come from.
+
+//Opens a lazy module, leaving it on the stack. Upvalue 1 maps globals
+//to module names, upvalue 2 maps module names to openers.
+static void ldstate_lazyload(lua_State *l, const char *name) {
+	//it may have been required already
+	luaL_getsubtable(l, LUA_REGISTRYINDEX, "_LOADED");
+	lua_getfield(l, -1, name);
+	lua_remove(l, -2);
+	if(lua_type(l, -1) != LUA_TNIL) {
+		lua_pushglobaltable(l);
+		lua_pushvalue(l, -2);
+		lua_setfield(l, -2, name);
+		lua_pop(l, 1);
+	} else {
+		lua_pop(l, 1);
+		lua_getfield(l, lua_upvalueindex(2), name);
+		luaL_requiref(l, name, lua_tocfunction(l, -1), 1);
+		lua_remove(l, -2);
+	}
+
+	//forget every global that would have opened it
+	lua_pushnil(l);
+	while(lua_next(l, lua_upvalueindex(1))) {
+		int same = strcmp(lua_tostring(l, -1), name) == 0;
+		lua_pop(l, 1);
+		if(same) {
+			lua_pushvalue(l, -1);
+			lua_pushnil(l);
+			lua_rawset(l, lua_upvalueindex(1));
+		}
+	}
+}
+
+//Once package is open require can open the rest
+static void ldstate_lazypreload(lua_State *l, int openers) {
+	openers = lua_absindex(l, openers);
+	luaL_getsubtable(l, LUA_REGISTRYINDEX, "_LOADED");
+	lua_getfield(l, -1, LUA_LOADLIBNAME);
+	if(lua_type(l, -1) != LUA_TTABLE) {
+		lua_pop(l, 2);
+		return;
+	}
+	lua_getfield(l, -1, "preload");
+
+	lua_pushnil(l);
+	while(lua_next(l, openers)) {
+		lua_pushvalue(l, -2);
+		lua_insert(l, -2);
+		lua_rawset(l, -4);
+	}
+	lua_pop(l, 3);
+}
+
+//__index for the globals table
+static int ldstate_lazyindex(lua_State *l) {
+	lua_settop(l, 2);
+	lua_pushvalue(l, 2);
+	lua_rawget(l, lua_upvalueindex(1));
+	if(lua_type(l, -1) != LUA_TSTRING) return 0;
+
+	const char *name = lua_tostring(l, -1);
+	ldstate_lazyload(l, name);
+	if(strcmp(name, LUA_LOADLIBNAME) == 0) {
+		ldstate_lazypreload(l, lua_upvalueindex(2));
+	}
+
+	lua_pushvalue(l, 2);
+	lua_rawget(l, 1);
+	return 1;
+}
+
+//Makes the modules lazy, the tables are popped
+static void ldstate_setlazy(lua_State *state) {
+	//[go]
+	ldstate_lazypreload(state, -1);
+
+	lua_pushglobaltable(state);
+	lua_createtable(state, 0, 1);
+	lua_pushvalue(state, -4);
+	lua_pushvalue(state, -4);
+	lua_pushcclosure(state, ldstate_lazyindex, 2);
+	lua_setfield(state, -2, "__index");
+	lua_setmetatable(state, -2);
+	lua_pop(state, 3);
+}
+
+static struct ldalloc *ldstate_getalloc(lua_State *state) {
+	void *a;
+	lua_getallocf(state, &a);
+	return (struct ldalloc *)a;
+}
+
+//Opens a state with the modules, and counts it in the stats. Doesn't
+//touch any other state so it can be called on any thread.
+static lua_State *ldstate_open(
+ int nmodules,
+ char *const *names,
+ const lua_CFunction *openers,
+ int allocator,
+ int lazy) {
+	long long start = ldstate_nanotime();
+
+	struct ldalloc *a = ldalloc_create(allocator);
+	lua_State *state = lua_newstate(ldalloc_alloc, a);
+	assert(state != NULL);
+	lua_atpanic(state, ldstate_panic);
+
+	struct ldstate_budget *b = (struct ldstate_budget *)
+	 lua_newuserdata(state, sizeof(struct ldstate_budget));
+	memset(b, 0, sizeof(struct ldstate_budget));
+	lua_rawsetp(state, LUA_REGISTRYINDEX, (void *)ldstate_hook);
+
+	if(lazy) {
+		lua_newtable(state);	//globals to module names
+		lua_newtable(state);	//module names to openers
+	}
+
+	int i;
+	for(i=0;i<nmodules;++i) {
+		if(lazy && strcmp(names[i], "_G") != 0 &&
+		 strcmp(names[i], LUA_STRLIBNAME) != 0) {
+			lua_pushstring(state, names[i]);
+			lua_setfield(state, -3, names[i]);
+			if(strcmp(names[i], LUA_LOADLIBNAME) == 0) {
+				lua_pushstring(state, names[i]);
+				lua_setfield(state, -3, "require");
+			}
+			lua_pushcfunction(state, openers[i]);
+			lua_setfield(state, -2, names[i]);
+			continue;
+		}
+
+		luaL_requiref(state, names[i], openers[i], 1);
+		assert(lua_type(state, -1) == LUA_TTABLE);
+		lua_pop(state, 1);
+	}
+	if(lazy) ldstate_setlazy(state);
+
+	long long took = ldstate_nanotime() - start;
+	pthread_mutex_lock(&ldstate_poollock);
+	++ldstate_poolstats.created;
+	ldstate_poolstats.createns += took;
+	pthread_mutex_unlock(&ldstate_poollock);
+
+	return state;
+}
+
+static void ldstate_close(lua_State *state) {
+	struct ldalloc *a = ldstate_getalloc(state);
+	a->closing = 1;
+	lua_close(state);
+	ldalloc_destroy(a);
+}
+
+//Must hold the lock. Returns a pool that needs topping up, or NULL.
+static struct ldstate_pool *ldstate_needsrefill() {
+	struct ldstate_pool *pool;
+	for(pool=ldstate_pools;pool!=NULL;pool=pool->next) {
+		if(pool->nready < ldstate_poolsize) return pool;
+	}
+	return NULL;
+}
+
+static void *ldstate_refill(void *p) {
+	//only use a cpu nothing else wants, it mustn't slow down the
+	//threads it's working for
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+	pthread_mutex_lock(&ldstate_poollock);
+	while(1) {
+		if(ldstate_nclosing != 0) {
+			lua_State *state = ldstate_closing[--ldstate_nclosing];
+			pthread_mutex_unlock(&ldstate_poollock);
+			ldstate_close(state);
+			pthread_mutex_lock(&ldstate_poollock);
+			continue;
+		}
+
+		struct ldstate_pool *pool = ldstate_needsrefill();
+		if(pool == NULL) {
+			pthread_cond_wait(&ldstate_poolwake, &ldstate_poollock);
+			continue;
+		}
+
+		//pools are never freed, so it's safe to use without the lock
+		pthread_mutex_unlock(&ldstate_poollock);
+		lua_State *state = ldstate_open(pool->nmodules, pool->names,
+		 pool->openers, pool->allocator, pool->lazy);
+		pthread_mutex_lock(&ldstate_poollock);
+
+		if(pool->nready < ldstate_poolsize) {
+			pool->ready[pool->nready++] = state;
+			state = NULL;
+		}
+
+		if(state != NULL) {
+			pthread_mutex_unlock(&ldstate_poollock);
+			ldstate_close(state);
+			pthread_mutex_lock(&ldstate_poollock);
+		}
+	}
+	return NULL;
+}
+
+//Must hold the lock. Starts the refill thread if it isn't running,
+//returns 0 if it can't be. The caller signals ldstate_poolwake after
+//unlocking, so the thread doesn't wake up only to wait for the lock.
+static int ldstate_startrefill() {
+	if(!ldstate_refillstarted) {
+		if(!ldrun_pinlibrary()) return 0;
+
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, ldstate_refill, NULL) != 0) return 0;
+		pthread_detach(thread);
+		ldstate_refillstarted = 1;
+	}
+	return 1;
+}
+
+//Must hold the lock. Returns the pool for the signature, creating it
+//if there's room, or NULL.
+static struct ldstate_pool *ldstate_findpool(
+ const char *signature,
+ int nmodules,
+ const luaL_Reg *const *modules,
+ int allocator,
+ int lazy) {
+	struct ldstate_pool *pool;
+	for(pool=ldstate_pools;pool!=NULL;pool=pool->next) {
+		if(strcmp(pool->signature, signature) == 0) return pool;
+	}
+
+	if(ldstate_npools == LDSTATE_MAXPOOLS) return NULL;
+
+	pool = (struct ldstate_pool *)malloc(sizeof(struct ldstate_pool));
+	assert(pool != NULL);
+	pool->signature = strdup(signature);
+	pool->allocator = allocator;
+	pool->lazy = lazy;
+	pool->nmodules = nmodules;
+	pool->names = (char **)malloc(nmodules * sizeof(char *));
+	pool->openers = (lua_CFunction *)malloc(nmodules * sizeof(lua_CFunction));
+	assert(pool->names != NULL && pool->openers != NULL);
+	int i;
+	for(i=0;i<nmodules;++i) {
+		pool->names[i] = strdup(modules[i]->name);
+		pool->openers[i] = modules[i]->func;
+	}
+	pool->nready = 0;
+
+	pool->next = ldstate_pools;
+	ldstate_pools = pool;
+	++ldstate_npools;
+	return pool;
+}
+
+//Done with a pooled state. If it's unused it goes back in the pool,
+//otherwise the refill thread closes it. Returns 0 if neither can take
+//it and the caller has to close it.
+static int ldstate_return(
+ struct ldstate_pool *pool,
+ lua_State *state,
+ int used) {
+	int taken = 0;
+	pthread_mutex_lock(&ldstate_poollock);
+	if(!used && pool->nready < ldstate_poolsize) {
+		pool->ready[pool->nready++] = state;
+		++ldstate_poolstats.returned;
+		taken = 1;
+	} else if(used && ldstate_refillstarted &&
+	 ldstate_nclosing < LDSTATE_MAXREADY) {
+		ldstate_closing[ldstate_nclosing++] = state;
+		taken = 1;
+	}
+	pthread_mutex_unlock(&ldstate_poollock);
+
+	if(taken && used) pthread_cond_signal(&ldstate_poolwake);
+	return taken;
+}
+
+static void ldstate_taskrelease(struct ldstate_task *task) {
+	if(__atomic_sub_fetch(&task->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		pthread_mutex_destroy(&task->lock);
+		pthread_cond_destroy(&task->done);
+		free(task);
+	}
+}
+
+static int ldstate_taskfinished(struct ldstate_task *task) {
+	pthread_mutex_lock(&task->lock);
+	int finished = task->finished;
+	pthread_mutex_unlock(&task->lock);
+	return finished;
+}
+
+static void ldstate_taskwait(struct ldstate_task *task) {
+	pthread_mutex_lock(&task->lock);
+	while(!task->finished) {
+		pthread_mutex_unlock(&task->lock);
+		int helped = ldrun_help();
+		pthread_mutex_lock(&task->lock);
+		if(!helped && !task->finished) {
+			pthread_cond_wait(&task->done, &task->lock);
+		}
+	}
+	pthread_mutex_unlock(&task->lock);
+}
+
+//Runs on a pool thread, results are left on the state's stack
+static void ldstate_taskrun(struct ldrun_job *job) {
+	struct ldstate_task *task = (struct ldstate_task *)job;
+
+	ldstate_beginrun(task->state);
+	int rc = lua_pcall(task->state, lua_gettop(task->state) - 1,
+	 LUA_MULTRET, 0);
+	ldstate_endrun(task->state);
+
+	pthread_mutex_lock(&task->lock);
+	task->rc = rc;
+	task->finished = 1;
+	int close = task->close;
+	pthread_cond_broadcast(&task->done);
+	pthread_mutex_unlock(&task->lock);
+
+	if(close) ldstate_close(task->state);
+	ldstate_taskrelease(task);
+}
+
+//Errors if the state is running. Drops the results of a finished run
+//that nobody took.
+static void ldstate_checkidle(lua_State *l, struct ldstate_userdata *ud) {
+	struct ldstate_task *task = ud->task;
+	if(task == NULL) return;
+
+	if(!ldstate_taskfinished(task)) {
+		luaL_error(l, "State is running");
+		return;
+	}
+
+	if(!task->taken) {
+		task->taken = 1;
+		lua_settop(ud->state, 0);
+	}
+	ud->task = NULL;
+	ldstate_taskrelease(task);
+}
+
 static int ldstate_mtgc(lua_State *l) {
 	lua_settop(l, 1);
 	luaL_checktype(l, 1, LUA_TUSERDATA);
@@ -36,8 +612,25 @@ static int ldstate_mtgc(lua_State *l) {
 	struct ldstate_userdata *ud =
 	 (struct ldstate_userdata *)lua_touserdata(l, 1);
 
+	if(ud->task != NULL) {
+		struct ldstate_task *task = ud->task;
+		pthread_mutex_lock(&task->lock);
+		int running = !task->finished;
+		if(running) task->close = 1;
+		pthread_mutex_unlock(&task->lock);
+
+		ud->task = NULL;
+		ldstate_taskrelease(task);
+		if(running) ud->state = NULL;
+	}
+
 	if(ud->state != NULL) {
-		lua_close(ud->state);
+		ldstate_getalloc(ud->state)->limit = 0;
+		ldstate_setbudget(ud->state, 0, 0, 0);
+		if(ud->pool == NULL ||
+		 !ldstate_return(ud->pool, ud->state, ud->used)) {
+			ldstate_close(ud->state);
+		}
 		ud->state = NULL;
 	}
 
@@ -51,10 +644,12 @@ static int ldstate_mtpushcode(lua_State *l) {
 
 	struct ldstate_userdata *ud =
 	 (struct ldstate_userdata *)lua_touserdata(l, 1);
+	ldstate_checkidle(l, ud);
 
 	if(lua_gettop(ud->state) != 0) {
 		return luaL_error(l, "Stack must be empty to push code");
 	}
+	ud->used = 1;
 
 	int rc = luaL_loadbufferx(ud->state, lua_tostring(l, 2),
 	 lua_rawlen(l, 2), "pushcode_func", "t");
@@ -76,10 +671,12 @@ static int ldstate_mtpushSearch(lua_State *l) {
 
 	struct ldstate_userdata *ud =
 	 (struct ldstate_userdata *)lua_touserdata(l, 1);
+	ldstate_checkidle(l, ud);
 
 	if(lua_gettop(ud->state) != 0) {
 		return luaL_error(l, "Stack must be empty to push code");
 	}
+	ud->used = 1;
 
 	lua_pushcfunction(ud->state, ldclient_request);
 	lua_pushstring(ud->state, lua_tostring(l, 2));
@@ -100,29 +697,154 @@ static int ldstate_mtpushSearch(lua_State *l) {
 	return 0;
 }
 
+//run([nresults]) returns what the function returned, all of it unless
+//nresults is given
 static int ldstate_mtrun(lua_State *l) {
-	lua_settop(l, 1);
+	lua_settop(l, 2);
 	luaL_checktype(l, 1, LUA_TUSERDATA);
+	int nresults = luaL_optint(l, 2, LUA_MULTRET);
+	luaL_argcheck(l, nresults >= LUA_MULTRET, 2, "negative result count");
 
 	struct ldstate_userdata *ud =
 	 (struct ldstate_userdata *)lua_touserdata(l, 1);
+	ldstate_checkidle(l, ud);
 	
 	if(lua_gettop(ud->state) < 1 ||
 	 lua_type(ud->state, 1) != LUA_TFUNCTION) {
 		return luaL_error(l, "No function to run");
 	}
 
-	int rc = lua_pcall(ud->state, lua_gettop(ud->state) - 1, 0, 0);
+	ldstate_beginrun(ud->state);
+	int rc = lua_pcall(ud->state, lua_gettop(ud->state) - 1, nresults, 0);
+	ldstate_endrun(ud->state);
 	if(rc != LUA_OK) {
 		lua_pushstring(l, lua_tostring(ud->state, 1));
 		lua_settop(ud->state, 0);
 		return lua_error(l);
 	}
 
+	//the results are popped even if they can't be copied, so a failed
+	//copy doesn't leave them for the next run
+	nresults = lua_gettop(ud->state);
+	ldvalue_move(l, ud->state, nresults, l);
 	assert(lua_gettop(ud->state) == 0);
+	return nresults;
+}
+
+//Pushes values onto the state's stack, after pushCode or pushSearch
+//they're the arguments run passes
+static int ldstate_mtpush(lua_State *l) {
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+
+	struct ldstate_userdata *ud =
+	 (struct ldstate_userdata *)lua_touserdata(l, 1);
+	ldstate_checkidle(l, ud);
+	ud->used = 1;
+
+	ldvalue_move(l, l, lua_gettop(l) - 1, ud->state);
 	return 0;
 }
 
+static int ldstate_handlemt(lua_State *l);
+
+//Like run, but on the run pool, returns a handle to wait for it with
+static int ldstate_mtrunasync(lua_State *l) {
+	lua_settop(l, 1);
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+
+	struct ldstate_userdata *ud =
+	 (struct ldstate_userdata *)lua_touserdata(l, 1);
+	ldstate_checkidle(l, ud);
+
+	if(lua_gettop(ud->state) < 1 ||
+	 lua_type(ud->state, 1) != LUA_TFUNCTION) {
+		return luaL_error(l, "No function to run");
+	}
+
+	struct ldstate_handle *handle = (struct ldstate_handle *)
+	 lua_newuserdata(l, sizeof(struct ldstate_handle));
+	handle->task = NULL;
+	lua_pushcfunction(l, ldstate_handlemt);
+	lua_insert(l, -2);
+	lua_call(l, 1, 1);
+
+	//the handle keeps the state alive, so the results can be taken. A
+	//uservalue has to be a table.
+	lua_createtable(l, 1, 0);
+	lua_pushvalue(l, 1);
+	lua_rawseti(l, -2, 1);
+	lua_setuservalue(l, 2);
+
+	struct ldstate_task *task = (struct ldstate_task *)
+	 malloc(sizeof(struct ldstate_task));
+	assert(task != NULL);
+	task->job.run = ldstate_taskrun;
+	pthread_mutex_init(&task->lock, NULL);
+	pthread_cond_init(&task->done, NULL);
+	task->refs = 3;
+	task->finished = 0;
+	task->close = 0;
+	task->taken = 0;
+	task->state = ud->state;
+	task->rc = LUA_OK;
+
+	if(!ldrun_submit(&task->job)) {
+		task->refs = 1;
+		ldstate_taskrelease(task);
+		return luaL_error(l, "Unable to start run threads");
+	}
+	handle->task = task;
+	ud->task = task;
+
+	return 1;
+}
+
+//Returns what the state's allocator has counted
+static int ldstate_mtmemstats(lua_State *l) {
+	lua_settop(l, 1);
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+
+	struct ldstate_userdata *ud =
+	 (struct ldstate_userdata *)lua_touserdata(l, 1);
+	if(ud->state == NULL) return luaL_error(l, "State is closed");
+	if(ud->task != NULL && !ldstate_taskfinished(ud->task)) {
+		return luaL_error(l, "State is running");
+	}
+
+	ldalloc_push(l, ldstate_getalloc(ud->state));
+	return 1;
+}
+
+//Returns what the state's runs have used. Instructions are only counted
+//while it has a limit.
+static int ldstate_mtcpustats(lua_State *l) {
+	lua_settop(l, 1);
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+
+	struct ldstate_userdata *ud =
+	 (struct ldstate_userdata *)lua_touserdata(l, 1);
+	if(ud->task != NULL && !ldstate_taskfinished(ud->task)) {
+		return luaL_error(l, "State is running");
+	}
+
+	struct ldstate_budget *b = ldstate_getbudget(ud->state);
+	lua_createtable(l, 0, 4);
+
+	lua_pushnumber(l, b->runs);
+	lua_setfield(l, -2, "runs");
+
+	lua_pushnumber(l, b->totalinstructions);
+	lua_setfield(l, -2, "instructions");
+
+	lua_pushnumber(l, b->totalcpuns / 1e9);
+	lua_setfield(l, -2, "cputime");
+
+	lua_pushnumber(l, b->overruns);
+	lua_setfield(l, -2, "overruns");
+
+	return 1;
+}
+
 static int ldstate_setMetatable(lua_State *l) {
 	lua_settop(l, 1);
 	luaL_checktype(l, 1, LUA_TUSERDATA);
@@ -147,6 +869,18 @@ static int ldstate_setMetatable(lua_State *l) {
 		lua_pushcfunction(l, ldstate_mtrun);
 		lua_setfield(l, -2, "run");
 
+		lua_pushcfunction(l, ldstate_mtpush);
+		lua_setfield(l, -2, "push");
+
+		lua_pushcfunction(l, ldstate_mtmemstats);
+		lua_setfield(l, -2, "memStats");
+
+		lua_pushcfunction(l, ldstate_mtcpustats);
+		lua_setfield(l, -2, "cpuStats");
+
+		lua_pushcfunction(l, ldstate_mtrunasync);
+		lua_setfield(l, -2, "runAsync");
+
 		lua_pushvalue(l, -1);
 		lua_rawsetp(l, LUA_REGISTRYINDEX, (void *)ldstate_setMetatable);
 	}
@@ -156,74 +890,269 @@ static int ldstate_setMetatable(lua_State *l) {
 	return 1;
 }
 
-static const luaL_Reg ldstate_requirefdata[] = {
- {"_G", luaopen_base},
- {LUA_LOADLIBNAME, luaopen_package},
- {LUA_COLIBNAME, luaopen_coroutine},
- {LUA_TABLIBNAME, luaopen_table},
- {LUA_IOLIBNAME, luaopen_io},
- {LUA_OSLIBNAME, luaopen_os},
- {LUA_STRLIBNAME, luaopen_string},
- {LUA_BITLIBNAME, luaopen_bit32},
- {LUA_MATHLIBNAME, luaopen_math},
- {LUA_DBLIBNAME, luaopen_debug},
- {"ldclient", ldclient_moduleloader},
- {NULL, NULL}
-};
+static struct ldstate_task *ldstate_checkhandle(lua_State *l) {
+	lua_settop(l, 1);
+	luaL_checktype(l, 1, LUA_TUSERDATA);
 
-static int ldstate_lookupmodule(lua_State *l) {
+	struct ldstate_handle *handle =
+	 (struct ldstate_handle *)lua_touserdata(l, 1);
+	if(handle->task == NULL) luaL_error(l, "Run was never started");
+	return handle->task;
+}
+
+static int ldstate_handlegc(lua_State *l) {
 	lua_settop(l, 1);
-	luaL_checktype(l, 1, LUA_TSTRING);
+	luaL_checktype(l, 1, LUA_TUSERDATA);
 
-	lua_newtable(l);
-	luaL_setfuncs(l, ldstate_requirefdata, 0);
-	lua_insert(l, 1);
+	struct ldstate_handle *handle =
+	 (struct ldstate_handle *)lua_touserdata(l, 1);
+	if(handle->task != NULL) {
+		ldstate_taskrelease(handle->task);
+		handle->task = NULL;
+	}
+	return 0;
+}
 
-	if(strncmp(lua_tostring(l, -1), "base", 5) == 0) {
-		lua_pop(l, 1);
-		lua_pushstring(l, "_G");
+static int ldstate_handledone(lua_State *l) {
+	lua_pushboolean(l, ldstate_taskfinished(ldstate_checkhandle(l)));
+	return 1;
+}
+
+static int ldstate_handlewait(lua_State *l) {
+	ldstate_taskwait(ldstate_checkhandle(l));
+	return 0;
+}
+
+//Waits for the run, then returns what it returned or raises its error.
+//Results can only be taken once.
+static int ldstate_handleresult(lua_State *l) {
+	struct ldstate_task *task = ldstate_checkhandle(l);
+	ldstate_taskwait(task);
+
+	if(task->taken) return luaL_error(l, "Results already taken");
+	task->taken = 1;
+	lua_State *state = task->state;
+
+	if(task->rc != LUA_OK) {
+		lua_pushstring(l, lua_tostring(state, -1));
+		lua_settop(state, 0);
+		return lua_error(l);
 	}
 
-	lua_pushvalue(l, -1);
+	int nresults = lua_gettop(state);
+	ldvalue_move(l, state, nresults, l);
+	assert(lua_gettop(state) == 0);
+	return nresults;
+}
+
+static int ldstate_handlemt(lua_State *l) {
+	lua_settop(l, 1);
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+
+	lua_rawgetp(l, LUA_REGISTRYINDEX, (void *)ldstate_handlemt);
+	if(lua_type(l, -1) == LUA_TNIL) {
+		lua_pop(l, 1);
+		lua_newtable(l);
+
+		lua_pushvalue(l, -1);
+		lua_setfield(l, -2, "__index");
+
+		lua_pushcfunction(l, ldstate_handlegc);
+		lua_setfield(l, -2, "__gc");
+
+		lua_pushcfunction(l, ldstate_handledone);
+		lua_setfield(l, -2, "done");
+
+		lua_pushcfunction(l, ldstate_handlewait);
+		lua_setfield(l, -2, "wait");
+
+		lua_pushcfunction(l, ldstate_handleresult);
+		lua_setfield(l, -2, "result");
 
-	lua_gettable(l, 1);
-	if(lua_type(l, -1) != LUA_TFUNCTION) {
-		return luaL_error(l, "No such module");
+		lua_pushvalue(l, -1);
+		lua_rawsetp(l, LUA_REGISTRYINDEX, (void *)ldstate_handlemt);
 	}
+	assert(lua_type(l, -1) == LUA_TTABLE);
+	lua_setmetatable(l, -2);
 
-	return 2;
+	return 1;
 }
 
+//newState(modules, [options]) where options can have
+//allocator - "system", the default, or "arena"
+//memlimit - the most bytes the state can use, allocating more raises
+// a memory error
+//instructions, cputime - how many instructions, and seconds of cpu, a
+// run can use before an error is raised in it
+//deadline - seconds a run can take before it's made to stop
+//lazy - if true modules other than base and string are opened when
+// they're first used rather than up front
 static int ldstate_create(lua_State *l) {
-	lua_settop(l, 1);
+	static const char *allocators[] = {"system", "arena", NULL};
+
+	lua_settop(l, 2);
 	luaL_checktype(l, 1, LUA_TTABLE);
+	int allocator = LDALLOC_SYSTEM;
+	size_t memlimit = 0;
+	lua_Number instructions = 0, cputime = 0, deadline = 0;
+	int lazy = 0;
+	if(lua_type(l, 2) != LUA_TNIL) {
+		luaL_checktype(l, 2, LUA_TTABLE);
+		lua_getfield(l, 2, "allocator");
+		allocator = luaL_checkoption(l, -1, "system", allocators);
+		lua_getfield(l, 2, "memlimit");
+		lua_Number limit = luaL_optnumber(l, -1, 0);
+		luaL_argcheck(l, limit >= 0, 2, "negative memlimit");
+		memlimit = (size_t)limit;
+		lua_getfield(l, 2, "instructions");
+		instructions = luaL_optnumber(l, -1, 0);
+		lua_getfield(l, 2, "cputime");
+		cputime = luaL_optnumber(l, -1, 0);
+		lua_getfield(l, 2, "deadline");
+		deadline = luaL_optnumber(l, -1, 0);
+		luaL_argcheck(l, instructions >= 0 && cputime >= 0 && deadline >= 0,
+		 2, "negative limit");
+		lua_getfield(l, 2, "lazy");
+		lazy = lua_toboolean(l, -1);
+		lua_pop(l, 6);
+	}
+
+	int nmodules = lua_rawlen(l, 1);
+	const luaL_Reg **modules = (const luaL_Reg **)
+	 lua_newuserdata(l, (nmodules+1) * sizeof(const luaL_Reg *));
+
+	luaL_Buffer signature;
+	luaL_buffinit(l, &signature);
+	int idx;
+	for(idx=0;idx<nmodules;++idx) {
+		lua_rawgeti(l, 1, idx+1);
+		const char *name = lua_tostring(l, -1);
+		modules[idx] = name != NULL ? ldstate_findmodule(name) : NULL;
+		if(modules[idx] == NULL) {
+			return luaL_error(l, "No such module");
+		}
+		lua_pop(l, 1);
+
+		if(idx != 0) luaL_addchar(&signature, ',');
+		luaL_addstring(&signature, modules[idx]->name);
+	}
+	luaL_addstring(&signature, allocator == LDALLOC_ARENA ? "|arena" : "");
+	luaL_addstring(&signature, lazy ? "|lazy" : "");
+	luaL_pushresult(&signature);
+	//[t?us]
 
 	struct ldstate_userdata *ud = (struct ldstate_userdata *)
 	 lua_newuserdata(l, sizeof(struct ldstate_userdata));
 	assert(ud != NULL);
 	ud->state = NULL;
+	ud->pool = NULL;
+	ud->used = 0;
+	ud->task = NULL;
 
 	lua_pushcfunction(l, ldstate_setMetatable);
-	lua_insert(l, 2);
+	lua_insert(l, -2);
 	lua_call(l, 1, 1);
+	//[t?usu]
 
-	ud->state = luaL_newstate();
+	//A state with no modules costs nothing more to open than to pool
+	if(nmodules != 0) {
+		pthread_mutex_lock(&ldstate_poollock);
+		ud->pool = ldstate_findpool(lua_tostring(l, 4), nmodules, modules,
+		 allocator, lazy);
+		if(ud->pool != NULL && ud->pool->nready != 0) {
+			ud->state = ud->pool->ready[--ud->pool->nready];
+			++ldstate_poolstats.hits;
+		} else {
+			++ldstate_poolstats.misses;
+		}
+		int wake = ud->pool != NULL && ldstate_poolsize != 0 &&
+		 ldstate_startrefill();
+		pthread_mutex_unlock(&ldstate_poollock);
 
-	int elems = lua_rawlen(l, 1);
-	int idx;
-	for(idx=1;idx<=elems;++idx) {
-		lua_pushcfunction(l, ldstate_lookupmodule);
-		lua_rawgeti(l, 1, idx);
-		lua_call(l, 1, 2);
+		if(wake) pthread_cond_signal(&ldstate_poolwake);
+	}
 
-		luaL_requiref(ud->state, lua_tostring(l, -2),
-		 lua_tocfunction(l, -1), 1);
-		assert(lua_type(ud->state, -1) == LUA_TTABLE);
-		lua_pop(ud->state, 1);
+	if(ud->state == NULL) {
+		char *names[nmodules+1];
+		lua_CFunction openers[nmodules+1];
+		for(idx=0;idx<nmodules;++idx) {
+			names[idx] = (char *)modules[idx]->name;
+			openers[idx] = modules[idx]->func;
+		}
+		ud->state = ldstate_open(nmodules, names, openers, allocator, lazy);
+	}
+	ldstate_getalloc(ud->state)->limit = memlimit;
+	ldstate_setbudget(ud->state, (long long)instructions,
+	 (long long)(cputime * 1e9), (long long)(deadline * 1e9));
 
-		lua_pop(l, 2);
+	return 1;
+}
+
+//Sets how many states are kept ready for each list of modules, 0 turns
+//pooling off and closes the states waiting
+static int ldstate_setpoolsize(lua_State *l) {
+	int size = luaL_checkint(l, 1);
+	luaL_argcheck(l, size >= 0 && size <= LDSTATE_MAXREADY, 1,
+	 "pool size out of range");
+
+	lua_State *excess[LDSTATE_MAXPOOLS * LDSTATE_MAXREADY];
+	int nexcess = 0;
+
+	pthread_mutex_lock(&ldstate_poollock);
+	ldstate_poolsize = size;
+	struct ldstate_pool *pool;
+	for(pool=ldstate_pools;pool!=NULL;pool=pool->next) {
+		while(pool->nready > size) {
+			excess[nexcess++] = pool->ready[--pool->nready];
+		}
+	}
+	int wake = size != 0 && ldstate_pools != NULL && ldstate_startrefill();
+	pthread_mutex_unlock(&ldstate_poollock);
+
+	if(wake) pthread_cond_signal(&ldstate_poolwake);
+
+	while(nexcess != 0) ldstate_close(excess[--nexcess]);
+	return 0;
+}
+
+static int ldstate_getpoolstats(lua_State *l) {
+	pthread_mutex_lock(&ldstate_poollock);
+	long long hits = ldstate_poolstats.hits;
+	long long misses = ldstate_poolstats.misses;
+	long long returned = ldstate_poolstats.returned;
+	long long created = ldstate_poolstats.created;
+	long long createns = ldstate_poolstats.createns;
+	int ready = 0;
+	struct ldstate_pool *pool;
+	for(pool=ldstate_pools;pool!=NULL;pool=pool->next) {
+		ready += pool->nready;
 	}
+	int npools = ldstate_npools;
+	pthread_mutex_unlock(&ldstate_poollock);
+
+	lua_newtable(l);
+
+	lua_pushnumber(l, hits);
+	lua_setfield(l, -2, "hits");
+
+	lua_pushnumber(l, misses);
+	lua_setfield(l, -2, "misses");
+
+	lua_pushnumber(l, returned);
+	lua_setfield(l, -2, "returned");
+
+	lua_pushnumber(l, created);
+	lua_setfield(l, -2, "created");
+
+	//mean seconds to open a state
+	lua_pushnumber(l, created == 0 ? 0 : createns / 1e9 / created);
+	lua_setfield(l, -2, "createtime");
+
+	lua_pushnumber(l, ready);
+	lua_setfield(l, -2, "ready");
+
+	lua_pushnumber(l, npools);
+	lua_setfield(l, -2, "pools");
 
 	return 1;
 }
-		
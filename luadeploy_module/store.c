@@ -0,0 +1,666 @@
+/******************************************************************************
+* Copyright (C) 2014, Kevin Martin (kev82@khn.org.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+//Shared stores, read only tables built once and read from any state
+//without being copied into it.
+//
+//A store is one block of memory holding every table in it, with
+//offsets rather than pointers so the block can be dumped as a string
+//and loaded again unchanged. Every value is a 16 byte record. A table
+//is a header, its array part, 1..n, as records, then an open addressed
+//hash part, a power of two of key/value record pairs.
+//
+//A store is a shared object, so it can be pushed to other states or
+//sent down channels. Indexing a table in it gives a new userdata for
+//the subtable, the same store with the table's offset as its aux, and
+//strings are pushed as lua strings, so only what's read is copied.
+//
+//Blocks that didn't come from building one are checked as they're
+//read, not up front, so a corrupt one raises an error when the bad
+//part is reached.
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LDSTORE_MAGIC "LDSTORE1"
+
+struct ldstore_value
+{
+	uint32_t type;	//LUA_T*
+	uint32_t len;	//a string's length
+	union
+	{
+		lua_Number number;
+		uint64_t offset;	//of a string's bytes, or a table's header
+		uint64_t boolean;
+	} u;
+};
+
+struct ldstore_table
+{
+	uint32_t narray;
+	uint32_t nslots;	//0 or a power of two
+	//then narray values, then nslots key value pairs
+};
+
+struct ldstore_header
+{
+	char magic[8];
+	uint64_t len;	//of the whole block
+	struct ldstore_value root;	//always a table
+};
+
+struct ldstore
+{
+	struct ldshared shared;
+	size_t len;
+	char *data;
+};
+
+static void ldstore_destroy(struct ldshared *s) {
+	struct ldstore *store = (struct ldstore *)s;
+	free(store->data);
+	free(store);
+}
+
+static uint32_t ldstore_hashbytes(const char *p, size_t len) {
+	uint32_t h = 2166136261u;
+	size_t i;
+	for(i=0;i<len;++i) {
+		h ^= (unsigned char)p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static uint32_t ldstore_hashnumber(lua_Number n) {
+	if(n == 0) n = 0;	//-0 and 0 are the same key
+	uint64_t bits;
+	memcpy(&bits, &n, sizeof(bits));
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdULL;
+	bits ^= bits >> 33;
+	return (uint32_t)bits;
+}
+
+//Returns a table's header, or NULL if it isn't all in the block
+static const struct ldstore_table *ldstore_gettable(
+ const struct ldstore *store,
+ uint64_t offset) {
+	if(offset % 8 != 0 || offset > store->len ||
+	 store->len - offset < sizeof(struct ldstore_table)) {
+		return NULL;
+	}
+	const struct ldstore_table *t =
+	 (const struct ldstore_table *)(store->data + offset);
+
+	uint64_t bytes = sizeof(struct ldstore_table) +
+	 ((uint64_t)t->narray + 2 * (uint64_t)t->nslots) *
+	 sizeof(struct ldstore_value);
+	if(store->len - offset < bytes || (t->nslots & (t->nslots - 1)) != 0) {
+		return NULL;
+	}
+	return t;
+}
+
+static const struct ldstore_value *ldstore_array(
+ const struct ldstore_table *t) {
+	return (const struct ldstore_value *)(t + 1);
+}
+
+static const struct ldstore_value *ldstore_slots(
+ const struct ldstore_table *t) {
+	return ldstore_array(t) + t->narray;
+}
+
+//Returns a string's bytes, or NULL if they aren't all in the block
+static const char *ldstore_getstring(
+ const struct ldstore *store,
+ const struct ldstore_value *v) {
+	if(v->u.offset > store->len || store->len - v->u.offset < v->len) {
+		return NULL;
+	}
+	return store->data + v->u.offset;
+}
+
+//Hashes a number, boolean or string key, the same as it's stored
+static uint32_t ldstore_hashkey(lua_State *l, int idx) {
+	switch(lua_type(l, idx)) {
+	case LUA_TNUMBER:
+		return ldstore_hashnumber(lua_tonumber(l, idx));
+	case LUA_TBOOLEAN:
+		return lua_toboolean(l, idx) ? 2 : 1;
+	case LUA_TSTRING: {
+		size_t len;
+		const char *str = lua_tolstring(l, idx, &len);
+		return ldstore_hashbytes(str, len);
+	}
+	}
+	return 0;
+}
+
+static struct ldstore *ldstore_check(lua_State *l, int idx, uint64_t *offset);
+
+static void ldstore_corrupt(lua_State *l) {
+	luaL_error(l, "Corrupt shared store");
+}
+
+//Pushes a value from the store
+static void ldstore_pushvalue(
+ lua_State *l,
+ struct ldstore *store,
+ const struct ldstore_value *v) {
+	switch(v->type) {
+	case LUA_TNIL:
+		lua_pushnil(l);
+		return;
+	case LUA_TBOOLEAN:
+		lua_pushboolean(l, v->u.boolean != 0);
+		return;
+	case LUA_TNUMBER:
+		lua_pushnumber(l, v->u.number);
+		return;
+	case LUA_TSTRING: {
+		const char *str = ldstore_getstring(store, v);
+		if(str == NULL) ldstore_corrupt(l);
+		lua_pushlstring(l, str, v->len);
+		return;
+	}
+	case LUA_TTABLE:
+		if(ldstore_gettable(store, v->u.offset) == NULL) ldstore_corrupt(l);
+		ldshared_push(l, &store->shared, v->u.offset);
+		return;
+	}
+	ldstore_corrupt(l);
+}
+
+//Returns the slot holding the key at idx, or -1 if there isn't one
+static int64_t ldstore_find(
+ lua_State *l,
+ struct ldstore *store,
+ const struct ldstore_table *t,
+ int idx) {
+	if(t->nslots == 0) return -1;
+
+	int type = lua_type(l, idx);
+	const char *str = NULL;
+	size_t len = 0;
+	lua_Number n = 0;
+	switch(type) {
+	case LUA_TNUMBER:
+		n = lua_tonumber(l, idx);
+		break;
+	case LUA_TBOOLEAN:
+		break;
+	case LUA_TSTRING:
+		str = lua_tolstring(l, idx, &len);
+		break;
+	default:
+		return -1;	//nothing else can be a key
+	}
+	uint32_t hash = ldstore_hashkey(l, idx);
+
+	const struct ldstore_value *slots = ldstore_slots(t);
+	uint32_t mask = t->nslots - 1;
+	uint32_t i, probe;
+	for(probe=0,i=hash&mask;probe<t->nslots;++probe,i=(i+1)&mask) {
+		const struct ldstore_value *k = &slots[2*i];
+		if(k->type == LUA_TNIL) return -1;
+		if((int)k->type != type) continue;
+
+		switch(type) {
+		case LUA_TNUMBER:
+			if(k->u.number == n) return i;
+			break;
+		case LUA_TBOOLEAN:
+			if((k->u.boolean != 0) == lua_toboolean(l, idx)) return i;
+			break;
+		case LUA_TSTRING:
+			if(k->len == len) {
+				const char *kstr = ldstore_getstring(store, k);
+				if(kstr == NULL) ldstore_corrupt(l);
+				if(memcmp(kstr, str, len) == 0) return i;
+			}
+			break;
+		}
+	}
+	return -1;
+}
+
+static const struct ldstore_table *ldstore_checktable(
+ lua_State *l,
+ int idx,
+ struct ldstore **store) {
+	uint64_t offset;
+	*store = ldstore_check(l, idx, &offset);
+	const struct ldstore_table *t = ldstore_gettable(*store, offset);
+	if(t == NULL) ldstore_corrupt(l);
+	return t;
+}
+
+static int ldstore_mtindex(lua_State *l) {
+	lua_settop(l, 2);
+	struct ldstore *store;
+	const struct ldstore_table *t = ldstore_checktable(l, 1, &store);
+
+	if(lua_type(l, 2) == LUA_TNUMBER) {
+		lua_Number n = lua_tonumber(l, 2);
+		if(n >= 1 && n <= t->narray && n == (uint32_t)n) {
+			ldstore_pushvalue(l, store, &ldstore_array(t)[(uint32_t)n - 1]);
+			return 1;
+		}
+	}
+
+	int64_t slot = ldstore_find(l, store, t, 2);
+	if(slot < 0) lua_pushnil(l);
+	else ldstore_pushvalue(l, store, &ldstore_slots(t)[2*slot+1]);
+	return 1;
+}
+
+static int ldstore_mtlen(lua_State *l) {
+	struct ldstore *store;
+	const struct ldstore_table *t = ldstore_checktable(l, 1, &store);
+	lua_pushinteger(l, t->narray);
+	return 1;
+}
+
+static int ldstore_mtnewindex(lua_State *l) {
+	return luaL_error(l, "Shared stores are read only");
+}
+
+//next for a table in a store, the array part then the hash part
+static int ldstore_next(lua_State *l) {
+	lua_settop(l, 2);
+	struct ldstore *store;
+	const struct ldstore_table *t = ldstore_checktable(l, 1, &store);
+
+	//where to carry on looking, array indexes then slots after them
+	uint64_t pos = 0;
+	if(lua_type(l, 2) != LUA_TNIL) {
+		lua_Number n = lua_tonumber(l, 2);
+		if(lua_type(l, 2) == LUA_TNUMBER &&
+		 n >= 1 && n <= t->narray && n == (uint32_t)n) {
+			pos = (uint32_t)n;
+		} else {
+			int64_t slot = ldstore_find(l, store, t, 2);
+			if(slot < 0) return luaL_error(l, "invalid key to 'next'");
+			pos = t->narray + slot + 1;
+		}
+	}
+
+	//the array part can have holes, which aren't keys
+	const struct ldstore_value *array = ldstore_array(t);
+	for(;pos<t->narray;++pos) {
+		if(array[pos].type == LUA_TNIL) continue;
+		lua_pushinteger(l, pos + 1);
+		ldstore_pushvalue(l, store, &array[pos]);
+		return 2;
+	}
+
+	const struct ldstore_value *slots = ldstore_slots(t);
+	for(pos-=t->narray;pos<t->nslots;++pos) {
+		if(slots[2*pos].type == LUA_TNIL) continue;
+		ldstore_pushvalue(l, store, &slots[2*pos]);
+		ldstore_pushvalue(l, store, &slots[2*pos+1]);
+		return 2;
+	}
+
+	lua_pushnil(l);
+	return 1;
+}
+
+static int ldstore_mtpairs(lua_State *l) {
+	lua_settop(l, 1);
+	lua_pushcfunction(l, ldstore_next);
+	lua_insert(l, 1);
+	lua_pushnil(l);
+	return 3;
+}
+
+static int ldstore_inext(lua_State *l) {
+	struct ldstore *store;
+	const struct ldstore_table *t = ldstore_checktable(l, 1, &store);
+	lua_Integer i = luaL_checkinteger(l, 2);
+	if(i < 0 || i >= t->narray) return 0;
+
+	//stops at the first hole, like ipairs on a table
+	const struct ldstore_value *v = &ldstore_array(t)[i];
+	if(v->type == LUA_TNIL) return 0;
+
+	lua_pushinteger(l, i + 1);
+	ldstore_pushvalue(l, store, v);
+	return 2;
+}
+
+static int ldstore_mtipairs(lua_State *l) {
+	lua_settop(l, 1);
+	lua_pushcfunction(l, ldstore_inext);
+	lua_insert(l, 1);
+	lua_pushinteger(l, 0);
+	return 3;
+}
+
+//dumpSharedStore(store) returns the block, which loadSharedStore takes.
+//It's not a method as every field of a store is its data.
+static int ldstore_dump(lua_State *l) {
+	uint64_t offset;
+	struct ldstore *store = ldstore_check(l, 1, &offset);
+	lua_pushlstring(l, store->data, store->len);
+	return 1;
+}
+
+static void ldstore_setmetatable(lua_State *l) {
+	if(ldshared_newmetatable(l, (void *)ldstore_setmetatable)) {
+		lua_pushcfunction(l, ldstore_mtindex);
+		lua_setfield(l, -2, "__index");
+
+		lua_pushcfunction(l, ldstore_mtnewindex);
+		lua_setfield(l, -2, "__newindex");
+
+		lua_pushcfunction(l, ldstore_mtlen);
+		lua_setfield(l, -2, "__len");
+
+		lua_pushcfunction(l, ldstore_mtpairs);
+		lua_setfield(l, -2, "__pairs");
+
+		lua_pushcfunction(l, ldstore_mtipairs);
+		lua_setfield(l, -2, "__ipairs");
+	}
+	lua_setmetatable(l, -2);
+}
+
+static struct ldstore *ldstore_check(lua_State *l, int idx, uint64_t *offset) {
+	struct ldshared_ud *ud = ldshared_check(l, idx,
+	 (void *)ldstore_setmetatable, "shared store");
+	*offset = ud->aux;
+	return (struct ldstore *)ud->s;
+}
+
+//Building a store. The block grows as tables are added, so everything
+//refers to it by offset until it's done.
+struct ldstore_builder
+{
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+static uint64_t ldstore_reserve(lua_State *l, struct ldstore_builder *b,
+ size_t bytes) {
+	bytes = (bytes + 7) & ~(size_t)7;	//keeps tables 8 byte aligned
+	if(b->len + bytes > b->cap) {
+		size_t cap = b->cap == 0 ? 4096 : b->cap;
+		while(cap < b->len + bytes) cap *= 2;
+		char *data = (char *)realloc(b->data, cap);
+		if(data == NULL) luaL_error(l, "not enough memory");
+		b->data = data;
+		b->cap = cap;
+	}
+	uint64_t offset = b->len;
+	memset(b->data + offset, 0, bytes);
+	b->len += bytes;
+	return offset;
+}
+
+#define LDSTORE_VALUE(b, offset) ((struct ldstore_value *)((b)->data + (offset)))
+
+static void ldstore_addtable(lua_State *l, struct ldstore_builder *b,
+ int idx, uint64_t voffset, int depth);
+
+//Fills in the record at voffset with the value at idx. Index 1 is the
+//offsets of the tables already added.
+static void ldstore_addvalue(
+ lua_State *l,
+ struct ldstore_builder *b,
+ int idx,
+ uint64_t voffset,
+ int depth) {
+	int type = lua_type(l, idx);
+	switch(type) {
+	case LUA_TBOOLEAN:
+		LDSTORE_VALUE(b, voffset)->u.boolean = lua_toboolean(l, idx);
+		break;
+	case LUA_TNUMBER:
+		LDSTORE_VALUE(b, voffset)->u.number = lua_tonumber(l, idx);
+		break;
+	case LUA_TSTRING: {
+		size_t len;
+		const char *str = lua_tolstring(l, idx, &len);
+		if(len > UINT32_MAX) luaL_error(l, "String too long for a store");
+		uint64_t offset = ldstore_reserve(l, b, len + 1);
+		memcpy(b->data + offset, str, len);
+		LDSTORE_VALUE(b, voffset)->len = len;
+		LDSTORE_VALUE(b, voffset)->u.offset = offset;
+		break;
+	}
+	case LUA_TTABLE:
+		ldstore_addtable(l, b, idx, voffset, depth);
+		break;
+	default:
+		luaL_error(l, "Can't store a %s", lua_typename(l, type));
+	}
+	LDSTORE_VALUE(b, voffset)->type = type;
+}
+
+static void ldstore_addtable(
+ lua_State *l,
+ struct ldstore_builder *b,
+ int idx,
+ uint64_t voffset,
+ int depth) {
+	luaL_checkstack(l, 4, "tables nested too deeply");
+	idx = lua_absindex(l, idx);
+
+	//a table seen before is stored once
+	lua_pushvalue(l, idx);
+	lua_rawget(l, 1);
+	if(lua_type(l, -1) != LUA_TNIL) {
+		LDSTORE_VALUE(b, voffset)->u.offset = (uint64_t)lua_tonumber(l, -1);
+		lua_pop(l, 1);
+		return;
+	}
+	lua_pop(l, 1);
+	if(depth >= LDVALUE_MAXDEPTH) luaL_error(l, "Tables nested too deeply");
+
+	//1..narray is the array part, everything else is hashed
+	size_t narray = lua_rawlen(l, idx);
+	while(narray > 0) {
+		lua_rawgeti(l, idx, narray);
+		int isnil = lua_type(l, -1) == LUA_TNIL;
+		lua_pop(l, 1);
+		if(!isnil) break;
+		--narray;
+	}
+	size_t nhash = 0;
+	lua_pushnil(l);
+	while(lua_next(l, idx)) {
+		lua_pop(l, 1);
+		if(lua_type(l, -1) == LUA_TNUMBER) {
+			lua_Number n = lua_tonumber(l, -1);
+			if(n >= 1 && n <= narray && n == (size_t)n) continue;
+		}
+		++nhash;
+	}
+	if(narray > UINT32_MAX || nhash > UINT32_MAX / 2) {
+		luaL_error(l, "Table too big for a store");
+	}
+	size_t nslots = 0;
+	if(nhash != 0) {
+		nslots = 1;
+		while(nslots < nhash + nhash / 3 + 1) nslots *= 2;	//under 3/4 full
+	}
+
+	uint64_t offset = ldstore_reserve(l, b, sizeof(struct ldstore_table) +
+	 (narray + 2 * nslots) * sizeof(struct ldstore_value));
+	struct ldstore_table *t = (struct ldstore_table *)(b->data + offset);
+	t->narray = narray;
+	t->nslots = nslots;
+	LDSTORE_VALUE(b, voffset)->u.offset = offset;
+
+	lua_pushvalue(l, idx);
+	lua_pushnumber(l, offset);
+	lua_rawset(l, 1);
+
+	uint64_t array = offset + sizeof(struct ldstore_table);
+	uint64_t slots = array + narray * sizeof(struct ldstore_value);
+	size_t i;
+	for(i=0;i<narray;++i) {
+		//a hole is left as the zeroed record, a nil
+		lua_rawgeti(l, idx, i+1);
+		if(lua_type(l, -1) != LUA_TNIL) {
+			ldstore_addvalue(l, b, -1, array + i * sizeof(struct ldstore_value),
+			 depth+1);
+		}
+		lua_pop(l, 1);
+	}
+
+	lua_pushnil(l);
+	while(lua_next(l, idx)) {
+		if(lua_type(l, -2) == LUA_TNUMBER) {
+			lua_Number n = lua_tonumber(l, -2);
+			if(n >= 1 && n <= narray && n == (size_t)n) {
+				lua_pop(l, 1);
+				continue;
+			}
+		}
+		int ktype = lua_type(l, -2);
+		if(ktype != LUA_TNUMBER && ktype != LUA_TSTRING &&
+		 ktype != LUA_TBOOLEAN) {
+			luaL_error(l, "Can't store a %s key", lua_typename(l, ktype));
+		}
+
+		uint32_t mask = nslots - 1;
+		uint32_t h = ldstore_hashkey(l, -2) & mask;
+		while(LDSTORE_VALUE(b, slots + 2 * h *
+		 sizeof(struct ldstore_value))->type != LUA_TNIL) {
+			h = (h + 1) & mask;
+		}
+		uint64_t k = slots + 2 * h * sizeof(struct ldstore_value);
+		ldstore_addvalue(l, b, -2, k, depth+1);
+		ldstore_addvalue(l, b, -1, k + sizeof(struct ldstore_value), depth+1);
+		lua_pop(l, 1);
+	}
+}
+
+//Run protected, with the builder and the table as arguments
+static int ldstore_buildp(lua_State *l) {
+	struct ldstore_builder *b = (struct ldstore_builder *)lua_touserdata(l, 1);
+	lua_newtable(l);
+	lua_replace(l, 1);
+
+	uint64_t header = ldstore_reserve(l, b, sizeof(struct ldstore_header));
+	assert(header == 0);
+	ldstore_addvalue(l, b, 2, offsetof(struct ldstore_header, root), 0);
+	return 0;
+}
+
+//Makes a store from a block, which it takes. Returns NULL if the block
+//isn't a store.
+static struct ldstore *ldstore_create(char *data, size_t len) {
+	const struct ldstore_header *h = (const struct ldstore_header *)data;
+	if(len < sizeof(struct ldstore_header) ||
+	 memcmp(h->magic, LDSTORE_MAGIC, sizeof(h->magic)) != 0 ||
+	 h->len != len || h->root.type != LUA_TTABLE) {
+		return NULL;
+	}
+
+	struct ldstore *store = (struct ldstore *)malloc(sizeof(struct ldstore));
+	if(store == NULL) return NULL;
+	ldshared_init(&store->shared, ldstore_destroy, ldstore_setmetatable);
+	store->len = len;
+	store->data = data;
+
+	if(ldstore_gettable(store, h->root.u.offset) == NULL) {
+		free(store);
+		return NULL;
+	}
+	return store;
+}
+
+static void ldstore_pushroot(lua_State *l, struct ldstore *store) {
+	const struct ldstore_header *h = (const struct ldstore_header *)store->data;
+	ldshared_push(l, &store->shared, h->root.u.offset);
+	ldshared_release(&store->shared);
+}
+
+//Pushes a store made from a copy of a dumped block
+static void ldstore_load(lua_State *l, const char *data, size_t len) {
+	char *copy = (char *)malloc(len == 0 ? 1 : len);
+	if(copy == NULL) luaL_error(l, "not enough memory");
+	memcpy(copy, data, len);
+
+	struct ldstore *store = ldstore_create(copy, len);
+	if(store == NULL) {
+		free(copy);
+		luaL_error(l, "Not a shared store");
+	}
+	ldstore_pushroot(l, store);
+}
+
+//sharedStore(table) builds a store from the table, which can hold
+//booleans, numbers, strings and tables
+static int ldstore_build(lua_State *l) {
+	lua_settop(l, 1);
+	luaL_checktype(l, 1, LUA_TTABLE);
+
+	struct ldstore_builder b;
+	b.data = NULL;
+	b.len = 0;
+	b.cap = 0;
+
+	lua_pushcfunction(l, ldstore_buildp);
+	lua_pushlightuserdata(l, &b);
+	lua_pushvalue(l, 1);
+	if(lua_pcall(l, 2, 0, 0) != LUA_OK) {
+		free(b.data);
+		return lua_error(l);
+	}
+
+	struct ldstore_header *h = (struct ldstore_header *)b.data;
+	memcpy(h->magic, LDSTORE_MAGIC, sizeof(h->magic));
+	h->len = b.len;
+
+	char *data = (char *)realloc(b.data, b.len);
+	if(data == NULL) data = b.data;
+
+	struct ldstore *store = ldstore_create(data, b.len);
+	if(store == NULL) {
+		free(data);
+		return luaL_error(l, "not enough memory");
+	}
+	ldstore_pushroot(l, store);
+	return 1;
+}
+
+//loadSharedStore(string) makes a store from what dumpSharedStore gave
+static int ldstore_loadstring(lua_State *l) {
+	size_t len;
+	const char *data = luaL_checklstring(l, 1, &len);
+	ldstore_load(l, data, len);
+	return 1;
+}
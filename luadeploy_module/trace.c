@@ -0,0 +1,256 @@
+/******************************************************************************
+* Copyright (C) 2014, Kevin Martin (kev82@khn.org.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+//A trace of the last LDTRACE_SLOTS requests a server has served.
+//
+//Workers claim a slot by bumping a counter and write their event into
+//it, so recording never blocks. A slot's seq is zero while it is being
+//written and its event's id plus one once it's done, export copies the
+//slot and throws it away if seq changed underneath it.
+//
+//The client fills in how long the response took to load afterwards,
+//provided the slot hasn't been reused by then.
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LDTRACE_SLOTS 2048	//a power of two
+
+struct ldtrace_event
+{
+	unsigned long long seq;
+	char type[16];
+	char name[96];
+	char objref[64];	//empty if nothing was found
+	int loader;	//LDSEARCH_LOADER_*
+	int cached;	//answered from the resolution cache
+	int found;
+	int worker;
+	long long bytes;	//the size of the object loaded
+
+	//CLOCK_MONOTONIC ns, search and fetch are 0 for cached responses
+	long long sent;
+	long long picked;
+	long long searchstart;
+	long long searchend;
+	long long fetchend;
+	long long served;
+
+	//reported by the client, -1 until then
+	long long loadns;
+	long long totalns;
+};
+
+struct ldtrace
+{
+	unsigned long long next;	//id of the next event
+	long long slowns;	//requests slower than this are logged, 0 for none
+	struct ldtrace_event events[LDTRACE_SLOTS];
+};
+
+static void ldtrace_setstring(char *dst, size_t size, const char *src) {
+	strncpy(dst, src != NULL ? src : "", size-1);
+	dst[size-1] = 0;
+}
+
+static void ldtrace_log(const struct ldtrace_event *e) {
+	char load[32] = "-";
+	if(e->loadns >= 0) snprintf(load, sizeof(load), "%.3fms", e->loadns / 1e6);
+
+	fprintf(stderr, "luadeploy: slow request %s/%s %.3fms"
+	 " (queue %.3fms, search %.3fms, fetch %.3fms, serve %.3fms, load %s)\n",
+	 e->type, e->name,
+	 (e->totalns >= 0 ? e->totalns : e->served - e->sent) / 1e6,
+	 (e->picked - e->sent) / 1e6,
+	 (e->searchend - e->searchstart) / 1e6,
+	 (e->fetchend - e->searchend) / 1e6,
+	 (e->served - e->picked) / 1e6,
+	 load);
+}
+
+//Copies e into the ring, returning its id
+static unsigned long long ldtrace_record(
+ struct ldtrace *t,
+ const struct ldtrace_event *e) {
+	unsigned long long id = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED);
+	struct ldtrace_event *slot = &t->events[id & (LDTRACE_SLOTS-1)];
+
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((char *)slot + sizeof(slot->seq), (const char *)e + sizeof(e->seq),
+	 sizeof(struct ldtrace_event) - sizeof(e->seq));
+	__atomic_store_n(&slot->seq, id+1, __ATOMIC_RELEASE);
+
+	//logged here if the server alone made it slow, otherwise the client
+	//logs it once it knows the total
+	long long slowns = __atomic_load_n(&t->slowns, __ATOMIC_RELAXED);
+	if(slowns != 0 && e->served - e->sent >= slowns) ldtrace_log(e);
+
+	return id;
+}
+
+//Copies the event into e, returns 0 if it's been overwritten
+static int ldtrace_read(
+ struct ldtrace *t,
+ unsigned long long id,
+ struct ldtrace_event *e) {
+	struct ldtrace_event *slot = &t->events[id & (LDTRACE_SLOTS-1)];
+	if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != id+1) return 0;
+	memcpy(e, slot, sizeof(struct ldtrace_event));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == id+1;
+}
+
+static void ldtrace_report(
+ struct ldtrace *t,
+ unsigned long long id,
+ long long loadns,
+ long long totalns) {
+	struct ldtrace_event *slot = &t->events[id & (LDTRACE_SLOTS-1)];
+	if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != id+1) return;
+	__atomic_store_n(&slot->loadns, loadns, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->totalns, totalns, __ATOMIC_RELAXED);
+
+	long long slowns = __atomic_load_n(&t->slowns, __ATOMIC_RELAXED);
+	struct ldtrace_event e;
+	if(slowns != 0 && totalns >= slowns && ldtrace_read(t, id, &e) &&
+	 e.served - e.sent < slowns) {
+		ldtrace_log(&e);
+	}
+}
+
+static void ldtrace_addjsonstring(luaL_Buffer *b, const char *s) {
+	luaL_addchar(b, '"');
+	for(;*s!=0;++s) {
+		unsigned char c = (unsigned char)*s;
+		if(c == '"' || c == '\\') {
+			luaL_addchar(b, '\\');
+			luaL_addchar(b, c);
+		} else if(c < 0x20) {
+			char esc[8];
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			luaL_addstring(b, esc);
+		} else {
+			luaL_addchar(b, c);
+		}
+	}
+	luaL_addchar(b, '"');
+}
+
+//Adds one trace event, ts is in ns and written in the us chrome wants
+static void ldtrace_addevent(
+ luaL_Buffer *b,
+ const char *name,
+ const char *ph,
+ unsigned long long id,
+ int tid,
+ long long ts,
+ long long dur) {
+	char buffer[160];
+	luaL_addstring(b, ",\n{\"name\":");
+	ldtrace_addjsonstring(b, name);
+	snprintf(buffer, sizeof(buffer),
+	 ",\"cat\":\"luadeploy\",\"ph\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f",
+	 ph, tid, ts / 1e3);
+	luaL_addstring(b, buffer);
+	if(ph[0] == 'X') {
+		snprintf(buffer, sizeof(buffer), ",\"dur\":%.3f}", dur / 1e3);
+	} else {
+		snprintf(buffer, sizeof(buffer), ",\"id\":%llu}", id);
+	}
+	luaL_addstring(b, buffer);
+}
+
+static void ldtrace_addrequest(luaL_Buffer *b, unsigned long long id,
+ const struct ldtrace_event *e) {
+	char buffer[256];
+	snprintf(buffer, sizeof(buffer), "%s %s", e->type, e->name);
+
+	//the whole request, as the client saw it, is an async span
+	long long end = e->totalns >= 0 ? e->sent + e->totalns : e->served;
+	luaL_addstring(b, ",\n{\"name\":");
+	ldtrace_addjsonstring(b, buffer);
+	snprintf(buffer, sizeof(buffer),
+	 ",\"cat\":\"luadeploy\",\"ph\":\"b\",\"pid\":1,\"tid\":0,\"ts\":%.3f,"
+	 "\"id\":%llu,\"args\":{\"objref\":", e->sent / 1e3, id);
+	luaL_addstring(b, buffer);
+	ldtrace_addjsonstring(b, e->objref);
+	snprintf(buffer, sizeof(buffer),
+	 ",\"loader\":\"%s\",\"result\":\"%s\",\"cached\":%s,\"bytes\":%lld}}",
+	 e->loader == LDSEARCH_LOADER_LUA ? "lua" :
+	 e->loader == LDSEARCH_LOADER_SO ? "so" : "",
+	 e->found ? "found" : "notfound",
+	 e->cached ? "true" : "false",
+	 e->bytes);
+	luaL_addstring(b, buffer);
+
+	ldtrace_addevent(b, "queue", "b", id, 0, e->sent, 0);
+	ldtrace_addevent(b, "queue", "e", id, 0, e->picked, 0);
+	if(e->loadns >= 0) {
+		ldtrace_addevent(b, "load", "b", id, 0, end - e->loadns, 0);
+		ldtrace_addevent(b, "load", "e", id, 0, end, 0);
+	}
+	snprintf(buffer, sizeof(buffer), "%s %s", e->type, e->name);
+	ldtrace_addevent(b, buffer, "e", id, 0, end, 0);
+
+	//and what the worker did, on the worker's own track
+	ldtrace_addevent(b, buffer, "X", id, e->worker+1, e->picked,
+	 e->served - e->picked);
+	if(!e->cached) {
+		ldtrace_addevent(b, "search", "X", id, e->worker+1, e->searchstart,
+		 e->searchend - e->searchstart);
+		ldtrace_addevent(b, "fetch", "X", id, e->worker+1, e->searchend,
+		 e->fetchend - e->searchend);
+	}
+}
+
+//Pushes the trace as chrome trace event format JSON, which perfetto
+//also reads. nworkers is only used to name the tracks.
+static void ldtrace_push(lua_State *l, struct ldtrace *t, int nworkers) {
+	luaL_Buffer b;
+	luaL_buffinit(l, &b);
+	luaL_addstring(&b, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+	 "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+	 "\"args\":{\"name\":\"requests\"}}");
+
+	char buffer[128];
+	int i;
+	for(i=0;i<nworkers;++i) {
+		snprintf(buffer, sizeof(buffer),
+		 ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+		 "\"args\":{\"name\":\"worker %d\"}}", i+1, i+1);
+		luaL_addstring(&b, buffer);
+	}
+
+	unsigned long long last = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+	unsigned long long id = last > LDTRACE_SLOTS ? last - LDTRACE_SLOTS : 0;
+	for(;id<last;++id) {
+		struct ldtrace_event e;
+		if(ldtrace_read(t, id, &e)) ldtrace_addrequest(&b, id, &e);
+	}
+
+	luaL_addstring(&b, "\n]}\n");
+	luaL_pushresult(&b);
+}
@@ -0,0 +1,677 @@
+/******************************************************************************
+* Copyright (C) 2014, Kevin Martin (kev82@khn.org.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+//Moving values between states.
+//
+//A state and one newState made, on the same thread, with the other
+//one idle, copy values straight from one stack to the other with
+//nothing serialised in between. States on different threads, talking
+//through a channel, serialise them into a blob that one writes and the
+//other reads. Either way a table reached twice is copied once, so
+//shared subtables and cycles come out the same shape.
+//
+//Shared objects, buffers and channels, are passed by reference. The
+//object is refcounted, and passing it to another state makes a new
+//userdata pointing at the same one. Buffers are for long strings that
+//shouldn't be copied, strings are interned per state so a plain string
+//is always copied once.
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LDVALUE_MAXDEPTH 200	//tables nested deeper than this aren't passed
+
+struct ldshared
+{
+	int refs;	//atomic
+	void (*destroy)(struct ldshared *s);
+	void (*setmetatable)(lua_State *l);	//on the userdata at the top
+};
+
+//What a userdata for a shared object holds. aux is the type's own, a
+//store uses it for which of its tables the userdata is.
+struct ldshared_ud
+{
+	struct ldshared *s;
+	size_t aux;
+};
+
+static void ldshared_init(
+ struct ldshared *s,
+ void (*destroy)(struct ldshared *s),
+ void (*setmetatable)(lua_State *l)) {
+	s->refs = 1;
+	s->destroy = destroy;
+	s->setmetatable = setmetatable;
+}
+
+static void ldshared_retain(struct ldshared *s) {
+	__atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void ldshared_release(struct ldshared *s) {
+	if(__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		s->destroy(s);
+	}
+}
+
+static int ldshared_mtgc(lua_State *l) {
+	struct ldshared_ud *ud = (struct ldshared_ud *)lua_touserdata(l, 1);
+	if(ud->s != NULL) {
+		ldshared_release(ud->s);
+		ud->s = NULL;
+	}
+	return 0;
+}
+
+//Userdata for the same object are equal
+static int ldshared_mteq(lua_State *l) {
+	struct ldshared_ud *a = (struct ldshared_ud *)lua_touserdata(l, 1);
+	struct ldshared_ud *b = (struct ldshared_ud *)lua_touserdata(l, 2);
+	lua_pushboolean(l, a->s == b->s && a->aux == b->aux);
+	return 1;
+}
+
+//Pushes the metatable for the type with the given key, returns 1 if
+//it's new and needs filling in. Like luaL_newmetatable, but the table
+//is also marked as a shared type's, so ldshared_test knows it.
+static int ldshared_newmetatable(lua_State *l, const void *key) {
+	lua_rawgetp(l, LUA_REGISTRYINDEX, key);
+	if(lua_type(l, -1) != LUA_TNIL) return 0;
+	lua_pop(l, 1);
+
+	lua_newtable(l);
+	lua_pushcfunction(l, ldshared_mtgc);
+	lua_setfield(l, -2, "__gc");
+	lua_pushcfunction(l, ldshared_mteq);
+	lua_setfield(l, -2, "__eq");
+
+	lua_pushvalue(l, -1);
+	lua_rawsetp(l, LUA_REGISTRYINDEX, key);
+
+	lua_rawgetp(l, LUA_REGISTRYINDEX, (void *)ldshared_newmetatable);
+	if(lua_type(l, -1) == LUA_TNIL) {
+		lua_pop(l, 1);
+		lua_newtable(l);
+		lua_pushvalue(l, -1);
+		lua_rawsetp(l, LUA_REGISTRYINDEX, (void *)ldshared_newmetatable);
+	}
+	lua_pushvalue(l, -2);
+	lua_pushboolean(l, 1);
+	lua_rawset(l, -3);
+	lua_pop(l, 1);
+
+	return 1;
+}
+
+//Returns the shared object userdata at idx, or NULL if it isn't one
+static struct ldshared_ud *ldshared_test(lua_State *l, int idx) {
+	if(lua_type(l, idx) != LUA_TUSERDATA) return NULL;
+
+	idx = lua_absindex(l, idx);
+	lua_rawgetp(l, LUA_REGISTRYINDEX, (void *)ldshared_newmetatable);
+	if(lua_type(l, -1) == LUA_TNIL || !lua_getmetatable(l, idx)) {
+		lua_pop(l, 1);
+		return NULL;
+	}
+	lua_rawget(l, -2);
+	int shared = lua_toboolean(l, -1);
+	lua_pop(l, 2);
+
+	struct ldshared_ud *ud = (struct ldshared_ud *)lua_touserdata(l, idx);
+	return shared && ud->s != NULL ? ud : NULL;
+}
+
+//Returns the shared object userdata at idx, erroring if it isn't of
+//the type with the given metatable key
+static struct ldshared_ud *ldshared_check(
+ lua_State *l,
+ int idx,
+ const void *key,
+ const char *tname) {
+	if(lua_type(l, idx) == LUA_TUSERDATA && lua_getmetatable(l, idx)) {
+		lua_rawgetp(l, LUA_REGISTRYINDEX, key);
+		int same = lua_rawequal(l, -1, -2);
+		lua_pop(l, 2);
+		if(same) {
+			struct ldshared_ud *ud =
+			 (struct ldshared_ud *)lua_touserdata(l, idx);
+			if(ud->s != NULL) return ud;
+		}
+	}
+	luaL_argerror(l, idx, lua_pushfstring(l, "%s expected", tname));
+	return NULL;
+}
+
+//Pushes a new userdata for s, which takes a reference to it
+static void ldshared_push(lua_State *l, struct ldshared *s, size_t aux) {
+	struct ldshared_ud *ud = (struct ldshared_ud *)
+	 lua_newuserdata(l, sizeof(struct ldshared_ud));
+	ud->s = NULL;
+	ud->aux = aux;
+	s->setmetatable(l);
+
+	//only once nothing else can fail
+	ldshared_retain(s);
+	ud->s = s;
+}
+
+struct ldbuffer
+{
+	struct ldshared shared;
+	size_t len;
+	char data[];
+};
+
+static void ldbuffer_destroy(struct ldshared *s) {
+	free(s);
+}
+
+static struct ldbuffer *ldbuffer_check(lua_State *l, int idx);
+
+static int ldbuffer_mtlen(lua_State *l) {
+	lua_pushinteger(l, ldbuffer_check(l, 1)->len);
+	return 1;
+}
+
+static int ldbuffer_mttostring(lua_State *l) {
+	struct ldbuffer *b = ldbuffer_check(l, 1);
+	lua_pushlstring(l, b->data, b->len);
+	return 1;
+}
+
+//buffer:sub(i, [j]) is string.sub without making the whole string
+static int ldbuffer_mtsub(lua_State *l) {
+	struct ldbuffer *b = ldbuffer_check(l, 1);
+	ptrdiff_t len = b->len;
+	ptrdiff_t i = luaL_checkinteger(l, 2);
+	ptrdiff_t j = luaL_optinteger(l, 3, -1);
+
+	if(i < 0) i = i < -len ? 1 : len + i + 1;
+	else if(i == 0) i = 1;
+	if(j < 0) j = len + j + 1;
+	else if(j > len) j = len;
+
+	if(i > j) lua_pushliteral(l, "");
+	else lua_pushlstring(l, b->data + i - 1, j - i + 1);
+	return 1;
+}
+
+static void ldbuffer_setmetatable(lua_State *l) {
+	if(ldshared_newmetatable(l, (void *)ldbuffer_setmetatable)) {
+		lua_newtable(l);
+		lua_pushcfunction(l, ldbuffer_mtsub);
+		lua_setfield(l, -2, "sub");
+		lua_pushcfunction(l, ldbuffer_mtlen);
+		lua_setfield(l, -2, "len");
+		lua_pushcfunction(l, ldbuffer_mttostring);
+		lua_setfield(l, -2, "tostring");
+		lua_setfield(l, -2, "__index");
+
+		lua_pushcfunction(l, ldbuffer_mtlen);
+		lua_setfield(l, -2, "__len");
+
+		lua_pushcfunction(l, ldbuffer_mttostring);
+		lua_setfield(l, -2, "__tostring");
+	}
+	lua_setmetatable(l, -2);
+}
+
+static struct ldbuffer *ldbuffer_check(lua_State *l, int idx) {
+	return (struct ldbuffer *)ldshared_check(l, idx,
+	 (void *)ldbuffer_setmetatable, "buffer")->s;
+}
+
+//luadeploy.buffer(string)
+static int ldbuffer_create(lua_State *l) {
+	size_t len;
+	const char *data = luaL_checklstring(l, 1, &len);
+
+	struct ldbuffer *b = (struct ldbuffer *)
+	 malloc(sizeof(struct ldbuffer) + len);
+	if(b == NULL) return luaL_error(l, "Unable to allocate buffer");
+	ldshared_init(&b->shared, ldbuffer_destroy, ldbuffer_setmetatable);
+	b->len = len;
+	memcpy(b->data, data, len);
+
+	ldshared_push(l, &b->shared, 0);
+	ldshared_release(&b->shared);
+	return 1;
+}
+
+struct ldvalue_copy
+{
+	lua_State *from;
+	int first;
+	int n;
+	int seen;	//index in to, table copies by the address of the original
+};
+
+//Copies the value at idx in from onto to. Only errors in to, reading
+//from doesn't allocate.
+static void ldvalue_copyone(
+ struct ldvalue_copy *c,
+ lua_State *to,
+ int idx,
+ int depth) {
+	lua_State *from = c->from;
+	luaL_checkstack(to, 4, "values nested too deeply");
+
+	switch(lua_type(from, idx)) {
+	case LUA_TNIL:
+		lua_pushnil(to);
+		return;
+	case LUA_TBOOLEAN:
+		lua_pushboolean(to, lua_toboolean(from, idx));
+		return;
+	case LUA_TNUMBER:
+		lua_pushnumber(to, lua_tonumber(from, idx));
+		return;
+	case LUA_TSTRING: {
+		size_t len;
+		const char *str = lua_tolstring(from, idx, &len);
+		lua_pushlstring(to, str, len);
+		return;
+	}
+	case LUA_TTABLE:
+		break;
+	case LUA_TUSERDATA:
+		if(lua_checkstack(from, 3)) {
+			struct ldshared_ud *ud = ldshared_test(from, idx);
+			if(ud != NULL) {
+				ldshared_push(to, ud->s, ud->aux);
+				return;
+			}
+		}
+		//fall through
+	default:
+		luaL_error(to, "Can't pass a %s",
+		 lua_typename(from, lua_type(from, idx)));
+		return;
+	}
+
+	const void *p = lua_topointer(from, idx);
+	lua_rawgetp(to, c->seen, p);
+	if(lua_type(to, -1) != LUA_TNIL) return;
+	lua_pop(to, 1);
+
+	if(depth >= LDVALUE_MAXDEPTH) luaL_error(to, "Tables nested too deeply");
+	if(!lua_checkstack(from, 3)) luaL_error(to, "values nested too deeply");
+	idx = lua_absindex(from, idx);
+
+	lua_newtable(to);
+	lua_pushvalue(to, -1);
+	lua_rawsetp(to, c->seen, p);
+
+	lua_pushnil(from);
+	while(lua_next(from, idx)) {
+		ldvalue_copyone(c, to, -2, depth+1);
+		ldvalue_copyone(c, to, -1, depth+1);
+		lua_rawset(to, -3);
+		lua_pop(from, 1);
+	}
+}
+
+//Run protected in to
+static int ldvalue_copyp(lua_State *to) {
+	struct ldvalue_copy *c = (struct ldvalue_copy *)lua_touserdata(to, 1);
+	lua_settop(to, 0);
+	luaL_checkstack(to, c->n + 4, "too many values");
+
+	lua_newtable(to);
+	c->seen = 1;
+
+	int i;
+	for(i=0;i<c->n;++i) {
+		ldvalue_copyone(c, to, c->first + i, 0);
+	}
+	return c->n;
+}
+
+//Moves the top n values of from onto the top of to, they're popped
+//from from whether or not it works. l is whichever of the two called,
+//errors are raised in it.
+static void ldvalue_move(lua_State *l, lua_State *from, int n, lua_State *to) {
+	assert(l == from || l == to);
+	assert(n >= 0 && n <= lua_gettop(from));
+
+	struct ldvalue_copy c;
+	c.from = from;
+	c.first = lua_gettop(from) - n + 1;
+	c.n = n;
+	c.seen = 0;
+
+	if(!lua_checkstack(to, 2)) {
+		lua_settop(from, c.first - 1);
+		luaL_error(l, "Unable to grow the stack");
+	}
+
+	lua_pushcfunction(to, ldvalue_copyp);
+	lua_pushlightuserdata(to, &c);
+	int rc = lua_pcall(to, 1, n, 0);
+	lua_settop(from, c.first - 1);
+
+	if(rc != LUA_OK) {
+		if(to != l) {
+			lua_pushstring(l, lua_tostring(to, -1));
+			lua_pop(to, 1);
+		}
+		lua_error(l);
+	}
+}
+
+//Values serialised for another thread, which can be read in any state.
+//It holds a reference to each shared object in it.
+struct ldvalue_blob
+{
+	int nvalues;
+	char *data;
+	size_t len;
+	size_t cap;
+	struct ldshared_ud *shared;
+	int nshared;
+	int capshared;
+};
+
+#define LDVALUE_NIL 0
+#define LDVALUE_FALSE 1
+#define LDVALUE_TRUE 2
+#define LDVALUE_NUMBER 3
+#define LDVALUE_STRING 4	//then a size_t length and the bytes
+#define LDVALUE_TABLE 5	//then key value pairs, then LDVALUE_END
+#define LDVALUE_END 6
+#define LDVALUE_TABLEREF 7	//then the int index of a table already read
+#define LDVALUE_SHARED 8	//then the int index into shared
+
+static void ldvalue_freeblob(struct ldvalue_blob *b) {
+	int i;
+	for(i=0;i<b->nshared;++i) ldshared_release(b->shared[i].s);
+	free(b->shared);
+	free(b->data);
+	free(b);
+}
+
+struct ldvalue_writer
+{
+	struct ldvalue_blob *blob;
+	int ntables;
+};
+
+static void ldvalue_write(
+ lua_State *l,
+ struct ldvalue_blob *b,
+ const void *p,
+ size_t n) {
+	if(b->len + n > b->cap) {
+		size_t cap = b->cap == 0 ? 256 : b->cap;
+		while(cap < b->len + n) cap *= 2;
+		char *data = (char *)realloc(b->data, cap);
+		if(data == NULL) luaL_error(l, "not enough memory");
+		b->data = data;
+		b->cap = cap;
+	}
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
+}
+
+static void ldvalue_writetag(lua_State *l, struct ldvalue_blob *b, char tag) {
+	ldvalue_write(l, b, &tag, 1);
+}
+
+//Index 1 is the table of tables already written, by their index
+static void ldvalue_writeone(
+ lua_State *l,
+ struct ldvalue_writer *w,
+ int idx,
+ int depth) {
+	struct ldvalue_blob *b = w->blob;
+	luaL_checkstack(l, 4, "values nested too deeply");
+
+	switch(lua_type(l, idx)) {
+	case LUA_TNIL:
+		ldvalue_writetag(l, b, LDVALUE_NIL);
+		return;
+	case LUA_TBOOLEAN:
+		ldvalue_writetag(l, b,
+		 lua_toboolean(l, idx) ? LDVALUE_TRUE : LDVALUE_FALSE);
+		return;
+	case LUA_TNUMBER: {
+		lua_Number n = lua_tonumber(l, idx);
+		ldvalue_writetag(l, b, LDVALUE_NUMBER);
+		ldvalue_write(l, b, &n, sizeof(lua_Number));
+		return;
+	}
+	case LUA_TSTRING: {
+		size_t len;
+		const char *str = lua_tolstring(l, idx, &len);
+		ldvalue_writetag(l, b, LDVALUE_STRING);
+		ldvalue_write(l, b, &len, sizeof(size_t));
+		ldvalue_write(l, b, str, len);
+		return;
+	}
+	case LUA_TTABLE:
+		break;
+	case LUA_TUSERDATA: {
+		struct ldshared_ud *ud = ldshared_test(l, idx);
+		if(ud == NULL) break;
+
+		if(b->nshared == b->capshared) {
+			int cap = b->capshared == 0 ? 4 : 2 * b->capshared;
+			struct ldshared_ud *shared = (struct ldshared_ud *)
+			 realloc(b->shared, cap * sizeof(struct ldshared_ud));
+			if(shared == NULL) luaL_error(l, "not enough memory");
+			b->shared = shared;
+			b->capshared = cap;
+		}
+		ldvalue_writetag(l, b, LDVALUE_SHARED);
+		ldvalue_write(l, b, &b->nshared, sizeof(int));
+		ldshared_retain(ud->s);
+		b->shared[b->nshared++] = *ud;
+		return;
+	}
+	default:
+		break;
+	}
+
+	if(lua_type(l, idx) != LUA_TTABLE) {
+		luaL_error(l, "Can't pass a %s", luaL_typename(l, idx));
+		return;
+	}
+
+	idx = lua_absindex(l, idx);
+	lua_pushvalue(l, idx);
+	lua_rawget(l, 1);
+	if(lua_type(l, -1) != LUA_TNIL) {
+		int ref = lua_tointeger(l, -1);
+		lua_pop(l, 1);
+		ldvalue_writetag(l, b, LDVALUE_TABLEREF);
+		ldvalue_write(l, b, &ref, sizeof(int));
+		return;
+	}
+	lua_pop(l, 1);
+
+	if(depth >= LDVALUE_MAXDEPTH) luaL_error(l, "Tables nested too deeply");
+
+	lua_pushvalue(l, idx);
+	lua_pushinteger(l, ++w->ntables);
+	lua_rawset(l, 1);
+	ldvalue_writetag(l, b, LDVALUE_TABLE);
+
+	lua_pushnil(l);
+	while(lua_next(l, idx)) {
+		ldvalue_writeone(l, w, -2, depth+1);
+		ldvalue_writeone(l, w, -1, depth+1);
+		lua_pop(l, 1);
+	}
+	ldvalue_writetag(l, b, LDVALUE_END);
+}
+
+//Run protected, with the writer then the values as arguments
+static int ldvalue_serialisep(lua_State *l) {
+	struct ldvalue_writer *w = (struct ldvalue_writer *)lua_touserdata(l, 1);
+	lua_newtable(l);
+	lua_replace(l, 1);
+
+	int i, top = lua_gettop(l);
+	for(i=2;i<=top;++i) {
+		ldvalue_writeone(l, w, i, 0);
+	}
+	return 0;
+}
+
+//Serialises the top n values, leaving them where they are
+static struct ldvalue_blob *ldvalue_serialise(lua_State *l, int n) {
+	luaL_checkstack(l, n + 2, "too many values");
+
+	struct ldvalue_blob *b = (struct ldvalue_blob *)
+	 calloc(1, sizeof(struct ldvalue_blob));
+	if(b == NULL) luaL_error(l, "not enough memory");
+	b->nvalues = n;
+
+	struct ldvalue_writer w;
+	w.blob = b;
+	w.ntables = 0;
+
+	int first = lua_gettop(l) - n + 1;
+	lua_pushcfunction(l, ldvalue_serialisep);
+	lua_pushlightuserdata(l, &w);
+	int i;
+	for(i=0;i<n;++i) lua_pushvalue(l, first + i);
+
+	if(lua_pcall(l, n + 1, 0, 0) != LUA_OK) {
+		ldvalue_freeblob(b);
+		lua_error(l);
+	}
+	return b;
+}
+
+struct ldvalue_reader
+{
+	const struct ldvalue_blob *blob;
+	size_t pos;
+	int ntables;
+};
+
+static void ldvalue_read(struct ldvalue_reader *r, void *p, size_t n) {
+	assert(r->pos + n <= r->blob->len);
+	memcpy(p, r->blob->data + r->pos, n);
+	r->pos += n;
+}
+
+static char ldvalue_readtag(struct ldvalue_reader *r) {
+	char tag;
+	ldvalue_read(r, &tag, 1);
+	return tag;
+}
+
+//Index 1 is the tables read so far, in order
+static void ldvalue_readone(lua_State *l, struct ldvalue_reader *r) {
+	luaL_checkstack(l, 3, "values nested too deeply");
+
+	switch(ldvalue_readtag(r)) {
+	case LDVALUE_NIL:
+		lua_pushnil(l);
+		return;
+	case LDVALUE_FALSE:
+		lua_pushboolean(l, 0);
+		return;
+	case LDVALUE_TRUE:
+		lua_pushboolean(l, 1);
+		return;
+	case LDVALUE_NUMBER: {
+		lua_Number n;
+		ldvalue_read(r, &n, sizeof(lua_Number));
+		lua_pushnumber(l, n);
+		return;
+	}
+	case LDVALUE_STRING: {
+		size_t len;
+		ldvalue_read(r, &len, sizeof(size_t));
+		assert(r->pos + len <= r->blob->len);
+		lua_pushlstring(l, r->blob->data + r->pos, len);
+		r->pos += len;
+		return;
+	}
+	case LDVALUE_TABLEREF: {
+		int ref;
+		ldvalue_read(r, &ref, sizeof(int));
+		lua_rawgeti(l, 1, ref);
+		return;
+	}
+	case LDVALUE_SHARED: {
+		int idx;
+		ldvalue_read(r, &idx, sizeof(int));
+		assert(idx >= 0 && idx < r->blob->nshared);
+		ldshared_push(l, r->blob->shared[idx].s, r->blob->shared[idx].aux);
+		return;
+	}
+	case LDVALUE_TABLE:
+		break;
+	default:
+		assert(0);
+	}
+
+	lua_newtable(l);
+	lua_pushvalue(l, -1);
+	lua_rawseti(l, 1, ++r->ntables);
+
+	while(r->blob->data[r->pos] != LDVALUE_END) {
+		ldvalue_readone(l, r);
+		ldvalue_readone(l, r);
+		lua_rawset(l, -3);
+	}
+	++r->pos;
+}
+
+//Run protected, with the reader as the argument
+static int ldvalue_deserialisep(lua_State *l) {
+	struct ldvalue_reader *r = (struct ldvalue_reader *)lua_touserdata(l, 1);
+	lua_settop(l, 0);
+	luaL_checkstack(l, r->blob->nvalues + 4, "too many values");
+	lua_newtable(l);
+
+	int i;
+	for(i=0;i<r->blob->nvalues;++i) ldvalue_readone(l, r);
+	assert(r->pos == r->blob->len);
+	return r->blob->nvalues;
+}
+
+//Pushes the values in b, and frees it. Returns how many were pushed.
+static int ldvalue_deserialise(lua_State *l, struct ldvalue_blob *b) {
+	struct ldvalue_reader r;
+	r.blob = b;
+	r.pos = 0;
+	r.ntables = 0;
+
+	int n = b->nvalues;
+	lua_pushcfunction(l, ldvalue_deserialisep);
+	lua_pushlightuserdata(l, &r);
+	int rc = lua_pcall(l, 1, n, 0);
+	ldvalue_freeblob(b);
+
+	if(rc != LUA_OK) lua_error(l);
+	return n;
+}
@@ -24,6 +24,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 static int deploy_dumpobjtbl(
  FILE *stream,
@@ -210,6 +212,75 @@ static void deploy_softwaresql3(
 	sqlite3_result_int(ctx, 1);
 }
 
+//Shared objects are written to either a private dir, as <objref>.so,
+//or a content addressed cache named "cache:<dir>", as <sha256>.so.
+//A cache can be shared by any number of processes, they all dlopen
+//the same file and so share its pages.
+static const char *deploy_cachedir(const char *dir) {
+	return strncmp(dir, "cache:", 6) == 0 ? dir + 6 : NULL;
+}
+
+//mkdir -p, the cache usually lives somewhere like ~/.luadeploy/cache
+static void deploy_mkdirs(const char *dir) {
+	char *path = strdup(dir);
+	char *p;
+	for(p=path+1;*p!=0;++p) {
+		if(*p != '/') continue;
+		*p = 0;
+		mkdir(path, 0755);
+		*p = '/';
+	}
+	mkdir(path, 0755);
+	free(path);
+}
+
+static char *deploy_sopath(
+ const char *dir,
+ const char *objref,
+ const char *hash) {
+	const char *cachedir = deploy_cachedir(dir);
+	if(cachedir != NULL) {
+		return sqlite3_mprintf("%s/%s.so", cachedir, hash);
+	}
+	return sqlite3_mprintf("%s/%s.so", dir, objref);
+}
+
+//Writes blob to path through a temporary file and a rename, so nobody,
+//in this process or another, can dlopen half an object. Existing files
+//are left alone unless overwrite is set.
+static int deploy_writeobj(
+ const char *path,
+ const void *blob,
+ int bytes,
+ int overwrite) {
+	if(!overwrite && access(path, F_OK) == 0) return 0;
+
+	char *tmppath = sqlite3_mprintf("%s.XXXXXX", path);
+	int fd = mkstemp(tmppath);
+	if(fd == -1) {
+		sqlite3_free(tmppath);
+		return 1;
+	}
+
+	int written = 0;
+	while(written < bytes) {
+		ssize_t rc = write(fd, (const char *)blob + written, bytes - written);
+		if(rc == -1) break;
+		written += rc;
+	}
+	fchmod(fd, 0644);
+	close(fd);
+
+	if(written != bytes || rename(tmppath, path) != 0) {
+		unlink(tmppath);
+		sqlite3_free(tmppath);
+		return 1;
+	}
+
+	sqlite3_free(tmppath);
+	return 0;
+}
+
 static void deploy_writeso(
  sqlite3_context *ctx,
  int argc,
@@ -219,8 +290,14 @@ static void deploy_writeso(
 	const char *software = (const char *)sqlite3_value_text(argv[0]);
 	const char *dir = (const char *)sqlite3_value_text(argv[1]);
 
+	const char *cachedir = deploy_cachedir(dir);
+	if(cachedir != NULL) deploy_mkdirs(cachedir);
+
+	//only a cache names files by their hash
 	char *sql = sqlite3_mprintf(
-	 "select objref, obj from \"%s_obj\" where loader='so'", software);
+	 "select objref, obj, %s from \"%s_obj\" "
+	 "where loader='so'", cachedir != NULL ? "ld_blob_sha256(obj)" : "null",
+	 software);
 	sqlite3_stmt *stmt;
 	int rc = sqlite3_prepare_v2(sqlite3_context_db_handle(ctx),
 	 sql, -1, &stmt, NULL);
@@ -230,27 +307,26 @@ static void deploy_writeso(
 		return;
 	}
 
-	size_t pathbuflen = strlen(dir) + 1 + 64 + 3 + 1;
-	char *pathbuffer = (char *)malloc(pathbuflen);
-
 	rc = sqlite3_step(stmt);
 	while(rc == SQLITE_ROW) {
-		int bytes = snprintf(pathbuffer, pathbuflen,
-		 "%s/%s.so", dir, sqlite3_column_text(stmt, 0));
-		assert(bytes < pathbuflen);
+		char *path = deploy_sopath(dir,
+		 (const char *)sqlite3_column_text(stmt, 0),
+		 (const char *)sqlite3_column_text(stmt, 2));
 
 		const char *blob = sqlite3_column_blob(stmt, 1);
 		int blobbytes = sqlite3_column_bytes(stmt, 1);
 
-		FILE *f = fopen(pathbuffer, "w");
-		assert(f != NULL);
-		fwrite(blob, blobbytes, 1, f);
-		fclose(f);
+		//a cached file can only have these contents
+		int failed = deploy_writeobj(path, blob, blobbytes, cachedir == NULL);
+		sqlite3_free(path);
+		if(failed) {
+			sqlite3_finalize(stmt);
+			sqlite3_result_error(ctx, "Unable to write shared object", -1);
+			return;
+		}
 
 		rc = sqlite3_step(stmt);
 	}
-	free(pathbuffer);
-	pathbuffer = NULL;
 	sqlite3_finalize(stmt);
 
 	if(rc != SQLITE_DONE) {
@@ -261,6 +337,65 @@ static void deploy_writeso(
 	sqlite3_result_int(ctx, 1);
 }
 
+//Makes sure one shared object is in dir, in the same layout as
+//ld_deploy_writeso, and returns the path to it. A file already in a
+//cache is trusted, so that only costs a stat once it has been done. In
+//a private dir the file is always rewritten, it may be from an older
+//version of the database.
+static void deploy_extractso(
+ sqlite3_context *ctx,
+ int argc,
+ sqlite3_value **argv) {
+	assert(argc == 3);	//software, objref, dir
+
+	const char *software = (const char *)sqlite3_value_text(argv[0]);
+	const char *objref = (const char *)sqlite3_value_text(argv[1]);
+	const char *dir = (const char *)sqlite3_value_text(argv[2]);
+	if(software == NULL || objref == NULL || dir == NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+
+	const char *cachedir = deploy_cachedir(dir);
+	if(cachedir != NULL) deploy_mkdirs(cachedir);
+
+	char *sql = sqlite3_mprintf(
+	 "select obj, %s from \"%s_obj\" "
+	 "where objref=? and loader='so'",
+	 cachedir != NULL ? "ld_blob_sha256(obj)" : "null", software);
+	sqlite3_stmt *stmt;
+	int rc = sqlite3_prepare_v2(sqlite3_context_db_handle(ctx),
+	 sql, -1, &stmt, NULL);
+	sqlite3_free(sql);
+	if(rc != SQLITE_OK || stmt == NULL) {
+		sqlite3_result_error(ctx, "Unable to prepare statement", -1);
+		return;
+	}
+
+	sqlite3_bind_text(stmt, 1, objref, -1, SQLITE_STATIC);
+	rc = sqlite3_step(stmt);
+	if(rc != SQLITE_ROW) {
+		sqlite3_finalize(stmt);
+		if(rc == SQLITE_DONE) sqlite3_result_null(ctx);
+		else sqlite3_result_error(ctx, "Failed to run underlying query", -1);
+		return;
+	}
+
+	char *path = deploy_sopath(dir, objref,
+	 (const char *)sqlite3_column_text(stmt, 1));
+	int failed = deploy_writeobj(path, sqlite3_column_blob(stmt, 0),
+	 sqlite3_column_bytes(stmt, 0), cachedir == NULL);
+	sqlite3_finalize(stmt);
+
+	if(failed) {
+		sqlite3_free(path);
+		sqlite3_result_error(ctx, "Unable to write shared object", -1);
+		return;
+	}
+
+	sqlite3_result_text(ctx, path, -1, sqlite3_free);
+}
+
 static int register_deploy(
  sqlite3 *db) {
 	int rc = sqlite3_create_function_v2(db, "ld_deploy_softwaresql", 2,
@@ -275,5 +410,9 @@ static int register_deploy(
 	 SQLITE_ANY, NULL, deploy_writeso, NULL, NULL, NULL);
 	if(rc != SQLITE_OK) return rc;
 
+	rc = sqlite3_create_function_v2(db, "ld_deploy_extractso", 3,
+	 SQLITE_ANY, NULL, deploy_extractso, NULL, NULL, NULL);
+	if(rc != SQLITE_OK) return rc;
+
 	return SQLITE_OK;
 }
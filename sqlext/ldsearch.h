@@ -0,0 +1,57 @@
+/******************************************************************************
+* Copyright (C) 2013-2014, Kevin Martin (kev82@khn.org.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+#ifndef __LDSEARCH_HEADER__
+#define __LDSEARCH_HEADER__
+
+#include <stdint.h>
+
+#define LDSEARCH_LOADER_UNKNOWN 0
+#define LDSEARCH_LOADER_LUA 1
+#define LDSEARCH_LOADER_SO 2
+
+//regexec is given 20 slots and the whole match takes one
+#define LDSEARCH_MAXARGS 19
+
+//ld_loader_search returns this as a blob, followed by the strings
+//it refers to. String fields are offsets from the start of the blob
+//and the strings are zero terminated. The args are the regex
+//captures, as offsets into the copy of the request.
+struct ldsearch_result
+{
+	uint32_t bytes;		//of the whole blob, strings included
+	uint16_t loader;
+	uint16_t nargs;
+
+	uint32_t objref;
+	uint32_t entrypoint;	//0 if there isn't one
+	uint32_t request;
+
+	struct {
+		uint32_t offset;
+		uint32_t length;
+	} args[LDSEARCH_MAXARGS];
+};
+
+#define ldsearch_string(r, off) ((const char *)(r) + (off))
+
+#endif
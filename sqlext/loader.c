@@ -34,6 +34,10 @@
  * along with an object reference and returns the appropriate object
  * essentially running select obj from software_obj where objref = ?
  *
+ * ld_loader_getobjrowid takes the same arguments and returns the rowid
+ * of the object instead, for callers that want to stream it out with
+ * sqlite3_blob_open rather than have it copied into a result.
+ *
  * The third function ld_loader_search takes the request type and the
  * request for a particular piece of software and returns either null
  * or the loading instructions
@@ -44,17 +48,16 @@
  *		request)
  *
  * This should return either NULL if there are no matches in the manifest
- * or the following lua code:
+ * or a blob holding a struct ldsearch_result (see ldsearch.h) with
+ *
+ * loader - the type of loader to use
+ * objref - ref of the object to load, pass to ld_loader_getobj
+ * entrypoint - the entrypoint in the object (0 if should just exec the file)
+ * args - the list of arguments parsed from the regular expression
  *
- * software="name of the software" --used to figure out obj table
- * loader="the type of loader to use"
- * objref="ref of the object to load" --pass to ld_loader_getobj
- * entrypoint="The entrypoint in the object" (null if should just exec the file)
- * args = {
- * 		"The list of arguments parsed from the regular expression"
- * }
+ * The software isn't included, the caller already knows it.
  *
- * The function should run the following query to get the results
+ * The result must be the same as running the following query
  * 
  * select
  *		loader, objref, entrypoint,
@@ -69,6 +72,23 @@
  * limit
  *		1;
  *
+ * but compiling every regex in the manifest on every request is far
+ * too slow. Instead, the first search for a (software, type) pair
+ * loads that part of the manifest in priority order and compiles each
+ * regex once. A search is then a single pass down the list, stopping
+ * at the first regex that matches. The compiled manifests are kept
+ * per connection and thrown away whenever the database changes.
+ *
+ * ld_loader_getobj and ld_loader_getobjrowid can keep their prepared
+ * statement for each piece of software in the same per connection
+ * cache. Statements that are still prepared stop sqlite3_close from
+ * working, so this is off unless the connection owner runs
+ * select ld_loader_cachestmts(), and then it must run
+ * select ld_loader_release() before closing. The function
+ * ld_loader_stmtstats returns a lua table with the number of statements
+ * prepared, the number of times one was reused instead and the total
+ * prepare time in microseconds that reuse saved.
+ *
  * The loader needs to get the full list of shared objects in
  * a piece of software. The function ld_loader_objrefs takes
  * two arguments the software, and the loader. It returns a lua table
@@ -80,6 +100,87 @@
 #include <stdlib.h>
 #include <regex.h>
 #include <stdio.h>
+#include <time.h>
+
+#include "ldsearch.h"
+
+struct loader_manentry
+{
+	regex_t regex;
+	//only regexes with this many groups can trip "Too many captures"
+	int manycaptures;
+
+	char *loader;
+	char *objref;
+	char *entrypoint;	//NULL if there isn't one
+};
+
+struct loader_manifest
+{
+	struct loader_manifest *next;
+
+	char *software;
+	char *type;
+
+	//in the order the original query would consider them
+	int nentries;
+	struct loader_manentry *entries;
+};
+
+//a statement prepared for one piece of software
+struct loader_stmt
+{
+	struct loader_stmt *next;
+
+	char *software;
+	sqlite3_stmt *stmt;
+	long long preparens;	//what it cost to prepare
+};
+
+struct loader_cache
+{
+	struct loader_manifest *manifests;
+	struct loader_stmt *getobjstmts;
+	struct loader_stmt *getrowidstmts;
+	int cachestmts;	//only if the owner will release them
+
+	//how often we have avoided a prepare, and what that saved
+	long long prepared;
+	long long reused;
+	long long savedns;
+
+	//used to spot when the compiled manifests are stale
+	int version;
+	int changes;
+};
+
+//matches must come from a regexec with 20 slots and must not
+//have used the last one
+static void loader_writecaptures(
+ FILE *output,
+ const char *src,
+ const regmatch_t *matches) {
+	if(matches[1].rm_so == -1) {
+		fprintf(output, "{}");
+		return;
+	}
+
+	fprintf(output, "{ \"");
+	fwrite(src+matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so,
+	 1, output);
+	fprintf(output, "\"");
+
+	int i=2;
+	while(matches[i].rm_so != -1) {
+		fprintf(output, ", \"");
+		fwrite(src+matches[i].rm_so, matches[i].rm_eo - matches[i].rm_so,
+		 1, output);
+		fprintf(output, "\"");
+		++i;
+	}
+
+	fprintf(output, "}");
+}
 
 static void loader_regmatch(
  sqlite3_context *ctx,
@@ -115,76 +216,286 @@ static void loader_regmatch(
 		return;
 	}
 
-	const char *src = (const char *)sqlite3_value_text(argv[1]);
-
 	size_t bytes;
 	char *buffer;
 	FILE *output = open_memstream(&buffer, &bytes);
 	assert(output != NULL);
 
-	fprintf(output, "{ \"");
-	fwrite(src+matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so,
-	 1, output);
-	fprintf(output, "\"");
-
-	int i=2;
-	while(matches[i].rm_so != -1) {
-		fprintf(output, ", \"");
-		fwrite(src+matches[i].rm_so, matches[i].rm_eo - matches[i].rm_so,
-		 1, output);
-		fprintf(output, "\"");
-		++i;
-	}
-
-	fprintf(output, "}");
+	loader_writecaptures(output,
+	 (const char *)sqlite3_value_text(argv[1]), matches);
 
 	fclose(output);
 	sqlite3_result_text(ctx, buffer, -1, free);
 } 
 
+static long long loader_nanotime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//Returns the cached statement for this software, preparing it with
+//sqltmpl on first use. The statement is reset and ready to bind.
+static sqlite3_stmt *loader_cachedstmt(
+ struct loader_cache *c,
+ struct loader_stmt **list,
+ sqlite3 *db,
+ const char *sqltmpl,
+ const char *swname) {
+	struct loader_stmt *ls;
+	for(ls=*list;ls!=NULL;ls=ls->next) {
+		if(strcmp(ls->software, swname) == 0) {
+			++c->reused;
+			c->savedns += ls->preparens;
+			return ls->stmt;
+		}
+	}
+
+	char *query = sqlite3_mprintf(sqltmpl, swname);
+
+	long long start = loader_nanotime();
+	sqlite3_stmt *stmt;
+	int rc = sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
+	long long elapsed = loader_nanotime() - start;
+	sqlite3_free(query);
+	if(rc != SQLITE_OK || stmt == NULL) return NULL;
+
+	ls = (struct loader_stmt *)malloc(sizeof(struct loader_stmt));
+	assert(ls != NULL);
+	ls->software = strdup(swname);
+	ls->stmt = stmt;
+	ls->preparens = elapsed;
+	ls->next = *list;
+	*list = ls;
+
+	++c->prepared;
+	return stmt;
+}
+
+static void loader_freestmts(struct loader_stmt **list) {
+	while(*list != NULL) {
+		struct loader_stmt *ls = *list;
+		*list = ls->next;
+		sqlite3_finalize(ls->stmt);
+		free(ls->software);
+		free(ls);
+	}
+}
+
+//Runs the cached (software, objref) query, returning its one column
+static void loader_objquery(
+ sqlite3_context *ctx,
+ sqlite3_value **argv,
+ struct loader_stmt **list,
+ const char *sqltmpl) {
+	sqlite3 *db = sqlite3_context_db_handle(ctx);
+	struct loader_cache *c = (struct loader_cache *)sqlite3_user_data(ctx);
+	const char *swname = (const char *)sqlite3_value_text(argv[0]);
+	const char *objref = (const char *)sqlite3_value_text(argv[1]);
+
+	if(swname == NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+
+	sqlite3_stmt *stmt = NULL;
+	if(c->cachestmts) {
+		stmt = loader_cachedstmt(c, list, db, sqltmpl, swname);
+	} else {
+		char *query = sqlite3_mprintf(sqltmpl, swname);
+		if(sqlite3_prepare_v2(db, query, -1, &stmt, NULL) != SQLITE_OK) {
+			sqlite3_finalize(stmt);
+			stmt = NULL;
+		}
+		sqlite3_free(query);
+	}
+	if(stmt == NULL) {
+		sqlite3_result_error(ctx, "Unable to prepare statement", -1);
+		return;
+	}
+
+	int rc = sqlite3_bind_text(stmt, 1, objref, -1, SQLITE_STATIC);
+	if(rc != SQLITE_OK) {
+		sqlite3_result_error(ctx, "Failed to bind parameters", -1);
+	} else if((rc = sqlite3_step(stmt)) == SQLITE_DONE) {
+		sqlite3_result_null(ctx);
+	} else if(rc != SQLITE_ROW) {
+		sqlite3_result_error(ctx, "Error in underlying query", -1);
+	} else {
+		sqlite3_result_value(ctx, sqlite3_column_value(stmt, 0));
+	}
+
+	if(c->cachestmts) sqlite3_reset(stmt);
+	else sqlite3_finalize(stmt);
+}
+
 static void loader_getobj(
  sqlite3_context *ctx,
  int argc,
  sqlite3_value **argv) {
 	assert(argc == 2);
 
-	sqlite3 *db = sqlite3_context_db_handle(ctx);
-	const char *swname = (const char *)sqlite3_value_text(argv[0]);
-	const char *objref = (const char *)sqlite3_value_text(argv[1]);
+	struct loader_cache *c = (struct loader_cache *)sqlite3_user_data(ctx);
+	loader_objquery(ctx, argv, &c->getobjstmts,
+	 "select obj from \"%s_obj\" where objref=?");
+}
+
+static void loader_getobjrowid(
+ sqlite3_context *ctx,
+ int argc,
+ sqlite3_value **argv) {
+	assert(argc == 2);
+
+	struct loader_cache *c = (struct loader_cache *)sqlite3_user_data(ctx);
+	loader_objquery(ctx, argv, &c->getrowidstmts,
+	 "select rowid from \"%s_obj\" where objref=?");
+}
+
+static char *loader_strdup(const unsigned char *s) {
+	return s == NULL ? NULL : strdup((const char *)s);
+}
+
+static void loader_freemanifest(struct loader_manifest *m) {
+	int i;
+	for(i=0;i<m->nentries;++i) {
+		regfree(&m->entries[i].regex);
+		free(m->entries[i].loader);
+		free(m->entries[i].objref);
+		free(m->entries[i].entrypoint);
+	}
+	free(m->entries);
+	free(m->software);
+	free(m->type);
+	free(m);
+}
+
+static void loader_flushcache(struct loader_cache *c) {
+	while(c->manifests != NULL) {
+		struct loader_manifest *m = c->manifests;
+		c->manifests = m->next;
+		loader_freemanifest(m);
+	}
+}
 
+static void loader_destroycache(void *p) {
+	struct loader_cache *c = (struct loader_cache *)p;
+	loader_flushcache(c);
+	loader_freestmts(&c->getobjstmts);
+	loader_freestmts(&c->getrowidstmts);
+	free(c);
+}
+
+//Throws away the compiled manifests if anything has written to
+//the database since they were built, from this connection or another
+static int loader_checkcache(
+ struct loader_cache *c,
+ sqlite3 *db) {
+	int version;
+	int rc = sqlite3_file_control(db, "main",
+	 SQLITE_FCNTL_DATA_VERSION, &version);
+	if(rc != SQLITE_OK) return rc;
+
+	int changes = sqlite3_total_changes(db);
+	if(version != c->version || changes != c->changes) {
+		loader_flushcache(c);
+		c->version = version;
+		c->changes = changes;
+	}
+
+	return SQLITE_OK;
+}
+
+static struct loader_manifest *loader_compilemanifest(
+ sqlite3 *db,
+ const char *swname,
+ const char *exptype,
+ const char **err) {
 	char *query = sqlite3_mprintf(
-	 "select obj from \"%s_obj\" where objref=?", swname);
+	 "select regex, loader, objref, entrypoint"
+	 " from \"%s_manifest\" where type=?"
+	 " order by priority desc", swname);
 
 	sqlite3_stmt *stmt;
 	int rc = sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
 	sqlite3_free(query);
 	if(rc != SQLITE_OK || stmt == NULL) {
-		sqlite3_result_error(ctx, "Unable to prepare statement", -1);
-		return;
+		*err = "Unable to prepare statement";
+		return NULL;
 	}
 
-	rc |= sqlite3_bind_text(stmt, 1, objref, -1, SQLITE_STATIC);
-
-	if(rc != SQLITE_OK) {
-		sqlite3_result_error(ctx, "Failed to bind parameters", -1);
-		return;
+	if(sqlite3_bind_text(stmt, 1, exptype, -1, SQLITE_STATIC) != SQLITE_OK) {
+		sqlite3_finalize(stmt);
+		*err = "Failed to bind parameters";
+		return NULL;
 	}
 
+	struct loader_manifest *m =
+	 (struct loader_manifest *)malloc(sizeof(struct loader_manifest));
+	assert(m != NULL);
+	m->next = NULL;
+	m->software = strdup(swname);
+	m->type = strdup(exptype);
+	m->nentries = 0;
+	m->entries = NULL;
+
+	int space = 0;
 	rc = sqlite3_step(stmt);
-	if(rc == SQLITE_DONE) {
-		sqlite3_finalize(stmt);
-		sqlite3_result_null(ctx);
-		return;
+	while(rc == SQLITE_ROW) {
+		if(m->nentries == space) {
+			space = space == 0 ? 16 : 2*space;
+			m->entries = (struct loader_manentry *)realloc(m->entries,
+			 space * sizeof(struct loader_manentry));
+			assert(m->entries != NULL);
+		}
+
+		const char *regex = (const char *)sqlite3_column_text(stmt, 0);
+		struct loader_manentry *e = &m->entries[m->nentries];
+		if(regex == NULL || regcomp(&e->regex, regex, REG_EXTENDED) != 0) {
+			sqlite3_finalize(stmt);
+			loader_freemanifest(m);
+			*err = "Unable to compile regex";
+			return NULL;
+		}
+
+		e->manycaptures = e->regex.re_nsub >= 19;
+		e->loader = loader_strdup(sqlite3_column_text(stmt, 1));
+		e->objref = loader_strdup(sqlite3_column_text(stmt, 2));
+		e->entrypoint = loader_strdup(sqlite3_column_text(stmt, 3));
+		++m->nentries;
+
+		rc = sqlite3_step(stmt);
 	}
+	sqlite3_finalize(stmt);
 
-	if(rc != SQLITE_ROW) {
-		sqlite3_finalize(stmt);
-		sqlite3_result_error(ctx, "Error in underlying query", -1);
-		return;
+	if(rc != SQLITE_DONE) {
+		loader_freemanifest(m);
+		*err = "Error in underlying query";
+		return NULL;
 	}
 
-	sqlite3_result_value(ctx, sqlite3_column_value(stmt, 0));
-	sqlite3_finalize(stmt);
+	return m;
+}
+
+static struct loader_manifest *loader_findmanifest(
+ struct loader_cache *c,
+ sqlite3 *db,
+ const char *swname,
+ const char *exptype,
+ const char **err) {
+	struct loader_manifest *m;
+	for(m=c->manifests;m!=NULL;m=m->next) {
+		if(strcmp(m->software, swname) == 0 &&
+		 strcmp(m->type, exptype) == 0) {
+			return m;
+		}
+	}
+
+	m = loader_compilemanifest(db, swname, exptype, err);
+	if(m == NULL) return NULL;
+
+	m->next = c->manifests;
+	c->manifests = m;
+	return m;
 }
 
 static void loader_search(
@@ -194,66 +505,108 @@ static void loader_search(
 	assert(argc == 3);
 
 	sqlite3 *db = sqlite3_context_db_handle(ctx);
+	struct loader_cache *c = (struct loader_cache *)sqlite3_user_data(ctx);
 	const char *swname = (const char *)sqlite3_value_text(argv[0]);
 	const char *exptype = (const char *)sqlite3_value_text(argv[1]);
 	const char *request = (const char *)sqlite3_value_text(argv[2]);
 
-	char *query = sqlite3_mprintf(
-	 "select loader, objref, entrypoint,"
-	 " ld_loader_regmatch(regex, ?) as params"
-	 " from \"%s_manifest\" where type=? and"
-	 " ld_loader_regmatch(regex, ?) not null"
-	 " order by priority desc limit 1", swname);
-
-	sqlite3_stmt *stmt;
-	int rc = sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
-	sqlite3_free(query);
-	if(rc != SQLITE_OK || stmt == NULL) {
-		sqlite3_result_error(ctx, "Unable to prepare statement", -1);
+	if(swname == NULL || exptype == NULL || request == NULL) {
+		sqlite3_result_null(ctx);
 		return;
 	}
 
-	rc |= sqlite3_bind_text(stmt, 1, request, -1, SQLITE_STATIC);
-	rc |= sqlite3_bind_text(stmt, 2, exptype, -1, SQLITE_STATIC);
-	rc |= sqlite3_bind_text(stmt, 3, request, -1, SQLITE_STATIC);
-
-	if(rc != SQLITE_OK) {
-		sqlite3_result_error(ctx, "Failed to bind parameters", -1);
+	if(loader_checkcache(c, db) != SQLITE_OK) {
+		sqlite3_result_error(ctx, "Unable to check data version", -1);
 		return;
 	}
 
-	rc = sqlite3_step(stmt);
-	if(rc == SQLITE_DONE) {
-		sqlite3_finalize(stmt);
-		sqlite3_result_null(ctx);
+	const char *err = NULL;
+	struct loader_manifest *m =
+	 loader_findmanifest(c, db, swname, exptype, &err);
+	if(m == NULL) {
+		sqlite3_result_error(ctx, err, -1);
 		return;
 	}
 
-	if(rc != SQLITE_ROW) {
-		sqlite3_finalize(stmt);
-		sqlite3_result_error(ctx, "Error in underlying query", -1);
+	regmatch_t matches[20];
+	struct loader_manentry *found = NULL;
+	int i;
+	for(i=0;i<m->nentries;++i) {
+		if(regexec(&m->entries[i].regex, request, 20, matches, 0) == 0) {
+			found = &m->entries[i];
+			break;
+		}
+	}
+
+	//The original query ran the regex on every row, so any match
+	//with too many captures was an error, not just the winner's
+	int j;
+	for(j=0;j<m->nentries;++j) {
+		if(!m->entries[j].manycaptures) continue;
+
+		regmatch_t checkmatches[20];
+		regmatch_t *mp = j == i ? matches : checkmatches;
+		if((j == i || regexec(&m->entries[j].regex, request,
+		 20, mp, 0) == 0) && mp[19].rm_so != -1) {
+			sqlite3_result_error(ctx, "Too many captures", -1);
+			return;
+		}
+	}
+
+	if(found == NULL) {
+		sqlite3_result_null(ctx);
 		return;
 	}
 
-	size_t bytes;
-	char *result;
-	FILE *rstream = open_memstream(&result, &bytes);
-	
-	fprintf(rstream, "software = [=[%s]=]\n", swname);		
-	fprintf(rstream, "loader = [=[%s]=]\n", sqlite3_column_text(stmt, 0));
-	fprintf(rstream, "objref = [=[%s]=]\n", sqlite3_column_text(stmt, 1));
-	if(sqlite3_column_type(stmt, 2) == SQLITE_NULL) {
-		fprintf(rstream, "entrypoint = nil\n");
+	size_t objreflen = found->objref == NULL ? 0 : strlen(found->objref);
+	size_t entrylen =
+	 found->entrypoint == NULL ? 0 : strlen(found->entrypoint) + 1;
+	size_t requestlen = strlen(request);
+	size_t bytes = sizeof(struct ldsearch_result) +
+	 objreflen + 1 + entrylen + requestlen + 1;
+
+	struct ldsearch_result *r = (struct ldsearch_result *)malloc(bytes);
+	assert(r != NULL);
+	memset(r, 0, sizeof(struct ldsearch_result));
+	r->bytes = bytes;
+
+	if(found->loader == NULL) {
+		r->loader = LDSEARCH_LOADER_UNKNOWN;
+	} else if(strcmp(found->loader, "lua") == 0) {
+		r->loader = LDSEARCH_LOADER_LUA;
+	} else if(strcmp(found->loader, "so") == 0) {
+		r->loader = LDSEARCH_LOADER_SO;
 	} else {
-		fprintf(rstream, "entrypoint = [=[%s]=]\n",
-		 sqlite3_column_text(stmt, 2));
+		r->loader = LDSEARCH_LOADER_UNKNOWN;
 	}
-	fprintf(rstream, "args = %s\n", sqlite3_column_text(stmt, 3));
 
-	sqlite3_finalize(stmt);
+	char *strings = (char *)r;
+	size_t used = sizeof(struct ldsearch_result);
 
-	fclose(rstream);
-	sqlite3_result_text(ctx, result, -1, free);
+	r->objref = used;
+	memcpy(strings + used, found->objref == NULL ? "" : found->objref,
+	 objreflen + 1);
+	used += objreflen + 1;
+
+	if(found->entrypoint != NULL) {
+		r->entrypoint = used;
+		memcpy(strings + used, found->entrypoint, entrylen);
+		used += entrylen;
+	}
+
+	r->request = used;
+	memcpy(strings + used, request, requestlen + 1);
+
+	//stop at the first group that didn't take part, as regmatch does
+	while(r->nargs < LDSEARCH_MAXARGS &&
+	 matches[r->nargs+1].rm_so != -1) {
+		r->args[r->nargs].offset = matches[r->nargs+1].rm_so;
+		r->args[r->nargs].length =
+		 matches[r->nargs+1].rm_eo - matches[r->nargs+1].rm_so;
+		++r->nargs;
+	}
+
+	sqlite3_result_blob(ctx, r, bytes, free);
 }
 
 static void loader_objrefs(
@@ -313,18 +666,89 @@ static void loader_objrefs(
 	sqlite3_result_text(ctx, result, -1, free);
 }
 
+static void loader_release(
+ sqlite3_context *ctx,
+ int argc,
+ sqlite3_value **argv) {
+	assert(argc == 0);
+
+	struct loader_cache *c = (struct loader_cache *)sqlite3_user_data(ctx);
+	loader_flushcache(c);
+	loader_freestmts(&c->getobjstmts);
+	loader_freestmts(&c->getrowidstmts);
+
+	sqlite3_result_int(ctx, 1);
+}
+
+static void loader_cachestmts(
+ sqlite3_context *ctx,
+ int argc,
+ sqlite3_value **argv) {
+	assert(argc == 0);
+
+	struct loader_cache *c = (struct loader_cache *)sqlite3_user_data(ctx);
+	c->cachestmts = 1;
+
+	sqlite3_result_int(ctx, 1);
+}
+
+static void loader_stmtstats(
+ sqlite3_context *ctx,
+ int argc,
+ sqlite3_value **argv) {
+	assert(argc == 0);
+
+	struct loader_cache *c = (struct loader_cache *)sqlite3_user_data(ctx);
+
+	char *result = sqlite3_mprintf(
+	 "{ prepared = %lld; reused = %lld; savedus = %lld; }",
+	 c->prepared, c->reused, c->savedns / 1000);
+	sqlite3_result_text(ctx, result, -1, sqlite3_free);
+}
+
 static int register_loader(
  sqlite3 *db) {
 	int rc = sqlite3_create_function_v2(db, "ld_loader_regmatch", 2,
 	 SQLITE_ANY, NULL, loader_regmatch, NULL, NULL, NULL);
 	if(rc != SQLITE_OK) return rc;
 
+	struct loader_cache *cache =
+	 (struct loader_cache *)malloc(sizeof(struct loader_cache));
+	assert(cache != NULL);
+	cache->manifests = NULL;
+	cache->getobjstmts = NULL;
+	cache->getrowidstmts = NULL;
+	cache->cachestmts = 0;
+	cache->prepared = 0;
+	cache->reused = 0;
+	cache->savedns = 0;
+	cache->version = -1;
+	cache->changes = -1;
+
+	//The cache belongs to ld_loader_search, sqlite calls
+	//loader_destroycache even if this fails
+	rc = sqlite3_create_function_v2(db, "ld_loader_search", 3,
+	 SQLITE_ANY, cache, loader_search, NULL, NULL, loader_destroycache);
+	if(rc != SQLITE_OK) return rc;
+
 	rc = sqlite3_create_function_v2(db, "ld_loader_getobj", 2,
-	 SQLITE_ANY, NULL, loader_getobj, NULL, NULL, NULL);
+	 SQLITE_ANY, cache, loader_getobj, NULL, NULL, NULL);
 	if(rc != SQLITE_OK) return rc;
 
-	rc = sqlite3_create_function_v2(db, "ld_loader_search", 3,
-	 SQLITE_ANY, NULL, loader_search, NULL, NULL, NULL);
+	rc = sqlite3_create_function_v2(db, "ld_loader_getobjrowid", 2,
+	 SQLITE_ANY, cache, loader_getobjrowid, NULL, NULL, NULL);
+	if(rc != SQLITE_OK) return rc;
+
+	rc = sqlite3_create_function_v2(db, "ld_loader_release", 0,
+	 SQLITE_ANY, cache, loader_release, NULL, NULL, NULL);
+	if(rc != SQLITE_OK) return rc;
+
+	rc = sqlite3_create_function_v2(db, "ld_loader_cachestmts", 0,
+	 SQLITE_ANY, cache, loader_cachestmts, NULL, NULL, NULL);
+	if(rc != SQLITE_OK) return rc;
+
+	rc = sqlite3_create_function_v2(db, "ld_loader_stmtstats", 0,
+	 SQLITE_ANY, cache, loader_stmtstats, NULL, NULL, NULL);
 	if(rc != SQLITE_OK) return rc;
 
 	rc = sqlite3_create_function_v2(db, "ld_loader_objrefs", 2,
@@ -107,23 +107,14 @@ static void readfile_plain(
 	closemappedfile(&mf);
 }
 
-static void readfile_sha256(
+//Sets the result to the hex SHA-256 of data
+static void readfile_resulthash(
  sqlite3_context *ctx,
- int argc,
- sqlite3_value **argv) {
-	assert(argc == 1);
-
-	struct mappedfile mf;
-	openmappedfile(&mf, (const char *)sqlite3_value_text(argv[0]));
-
-	if(mf.contents == NULL) {
-		sqlite3_result_error(ctx, "unable to open file", -1);
-		return;
-	}
-
+ const void *data,
+ size_t bytes) {
 	SHA256_CTX hashctx;
 	SHA256_Init(&hashctx);
-	SHA256_Update(&hashctx, mf.contents, mf.bytes);
+	SHA256_Update(&hashctx, data, bytes);
 	
 	unsigned char hash[SHA256_DIGEST_LENGTH];
 	SHA256_Final(hash, &hashctx);
@@ -138,9 +129,42 @@ static void readfile_sha256(
 
 	sqlite3_result_text(ctx, hashtext, 2*SHA256_DIGEST_LENGTH,
 	 sqlite3_free);
+}
+
+static void readfile_sha256(
+ sqlite3_context *ctx,
+ int argc,
+ sqlite3_value **argv) {
+	assert(argc == 1);
+
+	struct mappedfile mf;
+	openmappedfile(&mf, (const char *)sqlite3_value_text(argv[0]));
+
+	if(mf.contents == NULL) {
+		sqlite3_result_error(ctx, "unable to open file", -1);
+		return;
+	}
+
+	readfile_resulthash(ctx, mf.contents, mf.bytes);
 	closemappedfile(&mf);
 }
 
+//The same hash, of a blob that is already in the database
+static void readfile_blobsha256(
+ sqlite3_context *ctx,
+ int argc,
+ sqlite3_value **argv) {
+	assert(argc == 1);
+
+	if(sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+
+	const void *blob = sqlite3_value_blob(argv[0]);
+	readfile_resulthash(ctx, blob, sqlite3_value_bytes(argv[0]));
+}
+
 static int compiledchunkwriter(
  lua_State *l,
  const void *p,
@@ -312,6 +336,10 @@ static int register_readfile(
 	 SQLITE_ANY, NULL, readfile_sha256, NULL, NULL, NULL);
 	if(rc != SQLITE_OK) return rc;
 
+	rc = sqlite3_create_function_v2(db, "ld_blob_sha256" ,1,
+	 SQLITE_ANY, NULL, readfile_blobsha256, NULL, NULL, NULL);
+	if(rc != SQLITE_OK) return rc;
+
 	rc = sqlite3_create_function_v2(db, "ld_getfile_exportstext" ,1,
 	 SQLITE_ANY, NULL, readfile_exportstext, NULL, NULL, NULL);
 	if(rc != SQLITE_OK) return rc;